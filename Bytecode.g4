@@ -14,8 +14,12 @@ op
     | stringarray
     | intl=intliteral
     | floatl=floatliteral
+    | '.line' srcpos
     ;
 
+// source line and column of the code that follows, no code of its own
+srcpos: line=INT col=INT;
+
 intliteral: INT | HEX;
 floatliteral: FLOAT;
 name: ID;
@@ -60,16 +64,41 @@ opcode
     | 'list_access_ptr'
     | 'list_access'
     | 'list_length'
+    | 'list_create_local'
     | 'tuple_create'
     | 'tuple_concat'
     | 'tuple_access_ptr'
     | 'tuple_access'
+    | 'tuple_unpack'
     | 'closure_create'
     | 'closure_call'
     | 'map_create'
     | 'map_add'
     | 'map_access_ptr'
     | 'map_access'
+    | 'map_remove'
+    | 'map_has'
+    | 'add_int'
+    | 'sub_int'
+    | 'mul_int'
+    | 'div_int'
+    | 'mod_int'
+    | 'lt_int'
+    | 'lteq_int'
+    | 'gt_int'
+    | 'gteq_int'
+    | 'eq_int'
+    | 'neq_int'
+    | 'add_float'
+    | 'sub_float'
+    | 'mul_float'
+    | 'div_float'
+    | 'ifjump_int'
+    | 'ifnjump_int'
+    | 'list_access_int'
+    | 'list_access_u'
+    | 'list_access_ptr_u'
+    | 'call_memo'
     );
 
 ID
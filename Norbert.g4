@@ -6,6 +6,7 @@ function : 'function ' ID '(' (ID (',' ID)*)? ')' (stat|('=' exp));
 
 stat
   : lexp '=' exp #assignstat
+  | lexp (',' lexp)+ '=' exp #multiassignstat
   | exp '(' explist? ')' #funccallstat
   | 'while' exp stat    #whilestat
   | 'if' exp stat ('elseif' exp stat)* ('else' els=stat)?       #ifstat
@@ -25,6 +26,7 @@ exp
   | STRING                            #stringexp
   | ID                                #idexp
   | '[' explist? ']'                  #listexp
+  | '{' (exp ':' exp (',' exp ':' exp)*)? '}' #mapexp
   | exp '[' exp ']'                   #indexexp
   | exp '(' explist? ')'             #funccallexp
   | op=('-' | 'not') exp              #unaryexp
@@ -35,6 +37,7 @@ exp
   | exp op='and' exp                     #andexp
   | exp op='or' exp                      #orexp
   | exp 'if' exp 'else' exp           #ternaryexp
+  | '(' exp ',' explist? ')'         #tupleexp
   | '(' exp ')'                       #parenexp
   ;
 
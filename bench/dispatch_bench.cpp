@@ -0,0 +1,55 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <chrono>
+
+#include "../src/VirtualMachine.h"
+#include "../src/Assembler.h"
+#include "../src/Parser.h"
+#include "../src/Codegen.h"
+
+using namespace std;
+
+// Runs the arithmetic loops of bench/arith.nor with every instruction
+// dispatched through step, then with the top of the op stack cached in a
+// register, with and without the verifier's checks, best of RUNS
+
+const int RUNS = 5;
+
+double seconds(chrono::steady_clock::time_point start) {
+    return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+double best(const vmunit &code, bool verify, bool cacheTop) {
+    double t = 1e9;
+    for (int i=0;i<RUNS;i++) {
+        stringstream out;
+        VirtualMachine m(out);
+        m.verify = verify;
+        m.cacheTop = cacheTop;
+        m.load(code);
+        auto start = chrono::steady_clock::now();
+        m.run("main");
+        t = min(t, seconds(start));
+    }
+    return t;
+}
+
+int main(int argc, char **argv) {
+    ifstream stream("bench/arith.nor");
+    stringstream source;
+    source << stream.rdbuf();
+
+    for (int level : {0, 1}) {
+        auto code = CodeGen(1, level).gen(Parser(source.str()).parse());
+        for (bool verify : {false, true}) {
+            double plain = best(code, verify, false);
+            double cached = best(code, verify, true);
+            cout << "-O" << level << (verify ? " verified" : " checked ")
+                 << "  step : " << plain*1000 << " ms"
+                 << "  cached top : " << cached*1000 << " ms"
+                 << "  (" << (1 - cached/plain)*100 << "% less)" << endl;
+        }
+    }
+    return 0;
+}
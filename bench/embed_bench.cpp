@@ -0,0 +1,57 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <chrono>
+
+#include "../src/VirtualMachine.h"
+#include "../src/Assembler.h"
+#include "../src/Parser.h"
+#include "../src/Codegen.h"
+
+using namespace std;
+
+// Calls score from bench/embed.nor once per row, first with a call and an
+// epoch of its own per row, then with one batch call inside a single epoch
+
+const int ROWS = 100000;
+
+double seconds(chrono::steady_clock::time_point start) {
+    return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+int main(int argc, char **argv) {
+    ifstream stream("bench/embed.nor");
+    stringstream source;
+    source << stream.rdbuf();
+    auto code = CodeGen().gen(Parser(source.str()).parse());
+
+    vector<vector<HostValue>> rows;
+    for (int i=0;i<ROWS;i++) rows.push_back({HostValue("n" + to_string(i%100)), HostValue(i)});
+
+    VirtualMachine m(cout);
+    m.load(code);
+    auto start = chrono::steady_clock::now();
+    auto f = m.function("score");
+    int calls = 0;
+    for (int i=0;i<ROWS;i++) {
+        m.begin_epoch();
+        m.push(rows[i][0]);
+        m.push(rows[i][1]);
+        m.call(f);
+        m.end_epoch();
+        calls++;
+    }
+    double callTime = seconds(start);
+
+    VirtualMachine m2(cout);
+    m2.load(code);
+    start = chrono::steady_clock::now();
+    m2.begin_epoch();
+    auto results = m2.call_batch(m2.function("score"), rows);
+    double batchTime = seconds(start);
+
+    cout << calls << " " << results.back().s << endl;
+    cout << "call, epoch per call : " << callTime*1000 << " ms" << endl;
+    cout << "call_batch           : " << batchTime*1000 << " ms" << endl;
+    return 0;
+}
@@ -0,0 +1,52 @@
+#include <iostream>
+#include <chrono>
+#include <unordered_map>
+
+#include <antlr4-runtime/antlr4-runtime.h>
+#include "../src/parser/NorbertParser.h"
+#include "../src/parser/NorbertLexer.h"
+#include "../src/VirtualMachine.h"
+#include "../src/Assembler.h"
+#include "../src/ASTGen.h"
+#include "../src/Codegen.h"
+
+using namespace std;
+using namespace antlr4;
+
+// Same workload as bench/map.nor : 2000 insertions then 50 rounds of lookups
+
+const int KEYS = 2000;
+const int ROUNDS = 50;
+
+double seconds(chrono::steady_clock::time_point start) {
+    return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+int main(int argc, char **argv) {
+    ifstream stream("bench/map.nor");
+    ANTLRInputStream input(stream);
+    NorbertLexer lexer(&input);
+    CommonTokenStream tokens(&lexer);
+    NorbertParser parser(&tokens);
+    auto ast = ASTGen().gen(parser.file());
+    auto code = CodeGen().gen(ast);
+
+    VirtualMachine m(cout);
+    m.load(code);
+    auto start = chrono::steady_clock::now();
+    m.run("main");
+    double vmTime = seconds(start);
+
+    start = chrono::steady_clock::now();
+    unordered_map<int32_t, int32_t> map;
+    for (int i=0;i<KEYS;i++) map[i*7] = i;
+    volatile int32_t s = 0;
+    for (int r=0;r<ROUNDS;r++)
+        for (int i=0;i<KEYS;i++) s = s + map[i*7];
+    double stdTime = seconds(start);
+
+    cout << s << endl;
+    cout << "vm map            : " << vmTime*1000 << " ms" << endl;
+    cout << "std::unordered_map: " << stdTime*1000 << " ms" << endl;
+    return 0;
+}
@@ -1,164 +1,165 @@
 #pragma once
 
-#include <memory>
 #include <vector>
 #include <map>
-
-class File;
-class Stat;
-class Exp;
-class Lexp;
+#include <unordered_map>
+#include <string>
+#include <sstream>
+#include <cstdlib>
+#include <cstdint>
 
 using namespace std;
 
-using statp = shared_ptr<Stat>;
-using expp  = shared_ptr<Exp >;
-using lexpp = shared_ptr<Lexp>;
+// Nodes live in one arena per file and refer to each other by index.
+enum class NodeKind : uint8_t {
+    // statements
+    AssignStat, MultiAssignStat, FuncCallStat, WhileStat, IfStat, BlockStat, ReturnStat,
+    // assignment targets
+    LexpId, LexpIndex,
+    // expressions
+    IntExp, FloatExp, StringExp, IdExp, FuncCallExp, TernaryExp, ListExp, TupleExp, MapExp, IndexExp,
+};
+
+using NodeId = int32_t;
+const NodeId NO_NODE = -1;
+
+// a, b, c are fixed children, first/count a run of Ast::children :
+//   AssignStat       a lexp, b exp
+//   MultiAssignStat  first/count lexps, b exp
+//   FuncCallStat     a func, first/count args
+//   WhileStat        a cond, b body
+//   IfStat           a cond, b then, c els (optional)
+//   BlockStat        first/count stats
+//   ReturnStat       a exp (optional)
+//   LexpId, IdExp    str name
+//   LexpIndex        a lexp, b index
+//   IntExp           ival
+//   FloatExp         fval
+//   StringExp        str literal, quotes included
+//   FuncCallExp      a func, first/count args
+//   TernaryExp       a cond, b then, c els
+//   ListExp          first/count elements
+//   TupleExp         first/count elements
+//   MapExp           first/count key, value, key, value...
+//   IndexExp         a exp, b index
+// Operators are calls of an IdExp named after them. Statements keep the
+// line and column of their first token, for the PC to line table.
+struct Node {
+    NodeKind kind;
+    NodeId a, b, c;
+    int32_t first, count;
+    int32_t line, col;
+    union {
+        int32_t ival;
+        float fval;
+        int32_t str;
+    };
+};
+
+class Ast {
+public:
+    vector<Node> nodes;
+    vector<NodeId> children;
+    vector<string> strings;
+
+    const Node &operator[](NodeId id) const { return nodes[id]; }
+    Node &operator[](NodeId id) { return nodes[id]; }
+
+    NodeKind kind(NodeId id) const { return nodes[id].kind; }
+
+    NodeId child(const Node &n, int i) const { return children[n.first+i]; }
+
+    const string &str(NodeId id) const { return strings[nodes[id].str]; }
+
+    NodeId add(NodeKind kind, NodeId a = NO_NODE, NodeId b = NO_NODE, NodeId c = NO_NODE) {
+        Node n;
+        n.kind = kind;
+        n.a = a;
+        n.b = b;
+        n.c = c;
+        n.first = 0;
+        n.count = 0;
+        n.line = 0;
+        n.col = 0;
+        n.ival = 0;
+        nodes.push_back(n);
+        return nodes.size()-1;
+    }
+
+    NodeId add(NodeKind kind, const vector<NodeId> &l, NodeId a = NO_NODE, NodeId b = NO_NODE) {
+        NodeId id = add(kind, a, b);
+        nodes[id].first = children.size();
+        nodes[id].count = l.size();
+        children.insert(children.end(), l.begin(), l.end());
+        return id;
+    }
+
+    NodeId addInt(int value) {
+        NodeId id = add(NodeKind::IntExp);
+        nodes[id].ival = value;
+        return id;
+    }
+
+    NodeId addFloat(float value) {
+        NodeId id = add(NodeKind::FloatExp);
+        nodes[id].fval = value;
+        return id;
+    }
+
+    // IdExp, LexpId or StringExp, equal strings are stored once
+    NodeId addStr(NodeKind kind, const string &s) {
+        NodeId id = add(kind);
+        auto it = stringIds.find(s);
+        if (it == stringIds.end()) {
+            it = stringIds.insert(make_pair(s, (int32_t)strings.size())).first;
+            strings.push_back(s);
+        }
+        nodes[id].str = it->second;
+        return id;
+    }
+
+    NodeId op(const string &name, const vector<NodeId> &args) {
+        return add(NodeKind::FuncCallExp, args, addStr(NodeKind::IdExp, name));
+    }
+
+    // source position, lines from 1 and columns from 0 like the lexers
+    NodeId at(NodeId id, int line, int col) {
+        nodes[id].line = line;
+        nodes[id].col = col;
+        return id;
+    }
+
+private:
+    unordered_map<string, int32_t> stringIds;
+};
 
 class Function {
 public:
     vector<string> args;
-    statp body;
-    expp e;
+    NodeId body;
+    NodeId e;
+    // of the 'function' keyword
+    int32_t line = 0, col = 0;
 };
 
 class File {
 
 public:
     map<string, Function> functions;
-};
-
-
-class Lexp {
-public:
-    virtual ~Lexp() {}
-};
-
-class LexpId : public Lexp {
-public:
-    LexpId(string name) : name(name) {}
-    string name;
-};
-
-class LexpIndex : public Lexp {
-public:
-    LexpIndex(lexpp l,expp e) : l(l), e(e) {}
-    lexpp l;
-    expp e;
-};
-
-
-class Stat {
-
-public:
-    virtual ~Stat() {}
-};
-
-class AssignStat : public Stat {
-
-public:
-    AssignStat(lexpp left, expp right) : left(left), right(right) {}
-    lexpp left;
-    expp right;
-};
-
-class FuncCallStat : public Stat {
-
-public:
-    FuncCallStat(expp func, vector<expp> args) : func(func), args(args) {}
-    expp func;
-    vector<expp> args;
-};
-
-class WhileStat : public Stat {
-
-public:
-    WhileStat(expp cond, statp body) : cond(cond), body(body) {}
-    expp cond;
-    statp body;
-};
-
-class IfStat : public Stat {
-
-public:
-    IfStat(expp cond, statp then, statp els) : cond(cond), then(then), els(els) {}
-    expp cond;
-    statp then;
-    statp els;
-};
-
-class BlockStat : public Stat {
-
-public:
-    BlockStat(vector<statp> stats) : stats(stats) {}
-    vector<statp> stats;
-};
-
-class ReturnStat : public Stat {
-
-public:
-    ReturnStat(expp ret) : ret(ret) {}
-    expp ret;
-};
-
-class Exp {
-
-public:
-    virtual ~Exp() {}
-};
-
-class IntExp : public Exp {
-
-public:
-    IntExp(int value) : value(value) {}
-    int value;
-};
-
-class FloatExp : public Exp {
-
-public:
-    FloatExp(float value) : value(value) {}
-    float value;
-};
-
-class StringExp : public Exp {
-
-public:
-    StringExp(string value) : value(value) {}
-    string value;
-};
-
-class IdExp : public Exp {
-
-public:
-    IdExp(string name) : name(name) {}
-    string name;
-};
-
-class FuncCallExp : public Exp {
-
-public:
-    FuncCallExp(expp func, vector<expp> args) : func(func), args(args) {}
-    expp func;
-    vector<expp> args;
-};
-
-class TernaryExp : public Exp {
-
-public:
-    TernaryExp(expp cond, expp then, expp els) : cond(cond), then(then), els(els) {}
-    expp cond, then, els;
-};
-
-class ListExp : public Exp {
-public:
-    ListExp(vector<expp> elements) : elements(elements) {}
-    vector<expp> elements;
-};
-
-class IndexExp : public Exp {
-public:
-    IndexExp(expp left, expp index) : left(left), index(index) {}
-    expp left;
-    expp index;
-};
\ No newline at end of file
+    Ast ast;
+};
+
+// INT and HEX tokens, wrapping to 32 bits
+inline int intLiteral(const string &text) {
+    if (text.size() > 2 && (text[1] == 'x' || text[1] == 'X'))
+        return (int)strtoull(text.c_str()+2, nullptr, 16);
+    return (int)strtoull(text.c_str(), nullptr, 10);
+}
+
+inline float floatLiteral(const string &text) {
+    stringstream ss;
+    ss << text;
+    float val;
+    ss >> val;
+    return val;
+}
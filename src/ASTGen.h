@@ -7,10 +7,25 @@
 class ASTGen : NorbertBaseVisitor {
 public:
     File gen(NorbertParser::FileContext *ctx) {
-        return File{visit(ctx)};
+        File f;
+        f.functions = visit(ctx).as<map<string, Function>>();
+        f.ast = move(ast);
+        return f;
     }
 
 private:
+    Ast ast;
+
+    NodeId node(antlr4::tree::ParseTree *ctx) {
+        return (ctx)?visit(ctx).as<NodeId>():NO_NODE;
+    }
+
+    // placed at the first token of ctx, as Parser does
+    NodeId at(antlr4::ParserRuleContext *ctx, NodeId id) {
+        auto t = ctx->getStart();
+        return ast.at(id, t->getLine(), t->getCharPositionInLine());
+    }
+
     virtual antlrcpp::Any visitFile(NorbertParser::FileContext *ctx) override {
         map<string, Function> l;
         for (auto s : ctx->function()) 
@@ -21,44 +36,48 @@ private:
     virtual antlrcpp::Any visitFunction(NorbertParser::FunctionContext *ctx) override {
         vector<string> args;
         for (int i=1;i<ctx->ID().size();i++) args.push_back(ctx->ID(i)->getText());
-        return make_pair<string, Function>(
-            ctx->ID(0)->getText(),
-            Function{
-                args,
-                (ctx->stat())?visit(ctx->stat()).as<statp>():nullptr,
-                (ctx->exp())?visit(ctx->exp()).as<expp>():nullptr,
-            }
-        );
+        Function f{
+            args,
+            node(ctx->stat()),
+            node(ctx->exp()),
+        };
+        f.line = ctx->getStart()->getLine();
+        f.col = ctx->getStart()->getCharPositionInLine();
+        return make_pair(ctx->ID(0)->getText(), f);
     }
 
     virtual antlrcpp::Any visitAssignstat(NorbertParser::AssignstatContext *ctx) override {
-        return statp(new AssignStat(
-            visit(ctx->lexp()),
-            visit(ctx->exp())
-        ));
+        NodeId left = node(ctx->lexp());
+        return at(ctx, ast.add(NodeKind::AssignStat, left, node(ctx->exp())));
+    }
+
+    virtual antlrcpp::Any visitMultiassignstat(NorbertParser::MultiassignstatContext *ctx) override {
+        vector<NodeId> l;
+        for (auto e : ctx->lexp()) l.push_back(node(e));
+        return at(ctx, ast.add(NodeKind::MultiAssignStat, l, NO_NODE, node(ctx->exp())));
     }
 
     virtual antlrcpp::Any visitFunccallstat(NorbertParser::FunccallstatContext *ctx) override {
-        return statp(new FuncCallStat(
-            visit(ctx->exp()), visit(ctx->explist())
-        ));
+        NodeId func = node(ctx->exp());
+        return at(ctx, ast.add(NodeKind::FuncCallStat, visitArgs(ctx->explist()), func));
     }
 
     virtual antlrcpp::Any visitWhilestat(NorbertParser::WhilestatContext *ctx) override {
-        return statp(new WhileStat(
-            visit(ctx->exp()),
-            visit(ctx->stat())));
+        NodeId cond = node(ctx->exp());
+        return at(ctx, ast.add(NodeKind::WhileStat, cond, node(ctx->stat())));
     }
 
-    statp visitIfAux(NorbertParser::IfstatContext *ctx, int index) {
-        expp e = visit(ctx->exp(index));
-        statp s = visit(ctx->stat(index));
-        if (index == ctx->exp().size()) {
-            statp els = visit(ctx->els);
-            return statp(new IfStat(e,s,els));
+    // an elseif is placed at its condition
+    NodeId visitIfAux(NorbertParser::IfstatContext *ctx, int index) {
+        NodeId e = node(ctx->exp(index));
+        NodeId s = node(ctx->stat(index));
+        NodeId id;
+        if (index == ctx->exp().size()-1) {
+            id = ast.add(NodeKind::IfStat, e, s, node(ctx->els));
         } else {
-            return statp(new IfStat(e,s,visitIfAux(ctx, index+1)));
+            id = ast.add(NodeKind::IfStat, e, s, visitIfAux(ctx, index+1));
         }
+        return at(index ? (antlr4::ParserRuleContext*)ctx->exp(index) : ctx, id);
     }
 
     virtual antlrcpp::Any visitIfstat(NorbertParser::IfstatContext *ctx) override {
@@ -66,109 +85,99 @@ private:
     }
 
     virtual antlrcpp::Any visitBlockstat(NorbertParser::BlockstatContext *ctx) override {
-        vector<statp> l;
-        for (auto s : ctx->stat()) l.push_back(visit(s));
-        return statp(new BlockStat(l));
+        vector<NodeId> l;
+        for (auto s : ctx->stat()) l.push_back(node(s));
+        return at(ctx, ast.add(NodeKind::BlockStat, l));
     }
 
     virtual antlrcpp::Any visitReturnstat(NorbertParser::ReturnstatContext *ctx) override {
-        return statp(new ReturnStat(visit(ctx->exp()).as<expp>()));
+        return at(ctx, ast.add(NodeKind::ReturnStat, node(ctx->exp())));
     }
 
     virtual antlrcpp::Any visitLexp(NorbertParser::LexpContext *ctx) override {
         if (ctx->ID()) {
-            return lexpp(new LexpId(ctx->ID()->getText()));
+            return ast.addStr(NodeKind::LexpId, ctx->ID()->getText());
         } else {
-            lexpp p = visit(ctx->lexp());
-            expp e = visit(ctx->exp());
-            return lexpp(new LexpIndex(p, e));
+            NodeId p = node(ctx->lexp());
+            return ast.add(NodeKind::LexpIndex, p, node(ctx->exp()));
         }
     }
 
     virtual antlrcpp::Any visitFunccallexp(NorbertParser::FunccallexpContext *ctx) override {
-        return expp(new FuncCallExp(visit(ctx->exp()), visit(ctx->explist())));
+        NodeId func = node(ctx->exp());
+        return ast.add(NodeKind::FuncCallExp, visitArgs(ctx->explist()), func);
+    }
+
+    vector<NodeId> visitArgs(NorbertParser::ExplistContext *ctx) {
+        return (ctx)?visit(ctx).as<vector<NodeId>>():vector<NodeId>();
+    }
+
+    NodeId binary(antlr4::Token *op, NorbertParser::ExpContext *left, NorbertParser::ExpContext *right) {
+        NodeId l = node(left);
+        NodeId r = node(right);
+        return ast.op(op->getText(), {l, r});
     }
 
     virtual antlrcpp::Any visitAndexp(NorbertParser::AndexpContext *ctx) override {
-        return expp(new FuncCallExp(
-            expp(new IdExp(ctx->op->getText())),
-            {visit(ctx->exp(0)), visit(ctx->exp(1))}
-        ));
+        return binary(ctx->op, ctx->exp(0), ctx->exp(1));
     }
 
     virtual antlrcpp::Any visitOrexp(NorbertParser::OrexpContext *ctx) override {
-        return expp(new FuncCallExp(
-            expp(new IdExp(ctx->op->getText())),
-            {visit(ctx->exp(0)), visit(ctx->exp(1))}
-        ));
+        return binary(ctx->op, ctx->exp(0), ctx->exp(1));
     }
 
     virtual antlrcpp::Any visitAdditiveexp(NorbertParser::AdditiveexpContext *ctx) override {
-        return expp(new FuncCallExp(
-            expp(new IdExp(ctx->op->getText())),
-            {visit(ctx->exp(0)), visit(ctx->exp(1))}
-        ));
+        return binary(ctx->op, ctx->exp(0), ctx->exp(1));
     }
 
     virtual antlrcpp::Any visitFloatexp(NorbertParser::FloatexpContext *ctx) override {
-        stringstream ss;
-        ss << ctx->FLOAT()->getText();
-        float val;
-        ss >> val;
-        return expp(new FloatExp(val));
+        return ast.addFloat(floatLiteral(ctx->FLOAT()->getText()));
     }
 
     virtual antlrcpp::Any visitRelationexp(NorbertParser::RelationexpContext *ctx) override {
-        return expp(new FuncCallExp(
-            expp(new IdExp(ctx->op->getText())),
-            {visit(ctx->exp(0)), visit(ctx->exp(1))}
-        ));
+        return binary(ctx->op, ctx->exp(0), ctx->exp(1));
     }
 
     virtual antlrcpp::Any visitUnaryexp(NorbertParser::UnaryexpContext *ctx) override {
-        return expp(new FuncCallExp(
-            expp(new IdExp(ctx->op->getText())),
-            {visit(ctx->exp()).as<expp>()}
-        ));
+        return ast.op(ctx->op->getText(), {node(ctx->exp())});
     }
 
     virtual antlrcpp::Any visitMultiplicativeexp(NorbertParser::MultiplicativeexpContext *ctx) override {
-        return expp(new FuncCallExp(
-            expp(new IdExp(ctx->op->getText())),
-            {visit(ctx->exp(0)), visit(ctx->exp(1))}
-        ));
+        return binary(ctx->op, ctx->exp(0), ctx->exp(1));
     }
 
     virtual antlrcpp::Any visitTrueexp(NorbertParser::TrueexpContext *ctx) override {
-        return expp(new IntExp(1));
+        return ast.addInt(1);
     }
 
     virtual antlrcpp::Any visitIdexp(NorbertParser::IdexpContext *ctx) override {
-        return expp(new IdExp(ctx->ID()->getText()));
+        return ast.addStr(NodeKind::IdExp, ctx->ID()->getText());
     }
 
     virtual antlrcpp::Any visitComparisonexp(NorbertParser::ComparisonexpContext *ctx) override {
-        return expp(new FuncCallExp(
-            expp(new IdExp(ctx->op->getText())),
-            {visit(ctx->exp(0)), visit(ctx->exp(1))}
-        ));
+        return binary(ctx->op, ctx->exp(0), ctx->exp(1));
     }
 
     virtual antlrcpp::Any visitFalseexp(NorbertParser::FalseexpContext *ctx) override {
-        return expp(new IntExp(0));
+        return ast.addInt(0);
     }
 
     virtual antlrcpp::Any visitStringexp(NorbertParser::StringexpContext *ctx) override {
-        auto str = ctx->STRING()->getText();
-        return expp(new StringExp(str));
+        return ast.addStr(NodeKind::StringExp, ctx->STRING()->getText());
     }
 
     virtual antlrcpp::Any visitTernaryexp(NorbertParser::TernaryexpContext *ctx) override {
-        return expp(new TernaryExp(
-            visit(ctx->exp(1)),
-            visit(ctx->exp(0)),
-            visit(ctx->exp(2))
-        ));
+        NodeId then = node(ctx->exp(0));
+        NodeId cond = node(ctx->exp(1));
+        NodeId els = node(ctx->exp(2));
+        return ast.add(NodeKind::TernaryExp, cond, then, els);
+    }
+
+    virtual antlrcpp::Any visitTupleexp(NorbertParser::TupleexpContext *ctx) override {
+        vector<NodeId> l = {node(ctx->exp())};
+        vector<NodeId> rest = visitArgs(ctx->explist());
+        l.insert(l.end(), rest.begin(), rest.end());
+        return ast.add(NodeKind::TupleExp, l);
     }
 
     virtual antlrcpp::Any visitParenexp(NorbertParser::ParenexpContext *ctx) override {
@@ -176,31 +185,30 @@ private:
     }
 
     virtual antlrcpp::Any visitInte(NorbertParser::InteContext *ctx) override {
-        stringstream ss;
-        if (ctx->INT()) ss << ctx->INT()->getText();
-        else ss << ctx->HEX()->getText();
-        int val;
-        ss >> val;
-        return expp(new IntExp(val));
+        if (ctx->INT()) return ast.addInt(intLiteral(ctx->INT()->getText()));
+        else return ast.addInt(intLiteral(ctx->HEX()->getText()));
     }
 
     virtual antlrcpp::Any visitExplist(NorbertParser::ExplistContext *ctx) override {
-        vector<expp> l;
+        vector<NodeId> l;
         for (auto e : ctx->exp()) {
-            l.push_back(visit(e));
+            l.push_back(node(e));
         }
         return l;
     }
 
     virtual antlrcpp::Any visitListexp(NorbertParser::ListexpContext *ctx) override {
-        vector<expp> l = (ctx->explist())?visit(ctx->explist()).as<vector<expp>>():vector<expp>();
-        return expp(new ListExp(l));
+        return ast.add(NodeKind::ListExp, visitArgs(ctx->explist()));
+    }
+
+    virtual antlrcpp::Any visitMapexp(NorbertParser::MapexpContext *ctx) override {
+        vector<NodeId> l;
+        for (auto e : ctx->exp()) l.push_back(node(e));
+        return ast.add(NodeKind::MapExp, l);
     }
 
     virtual antlrcpp::Any visitIndexexp(NorbertParser::IndexexpContext *ctx) override {
-        return expp(new IndexExp(
-            visit(ctx->exp(0)),
-            visit(ctx->exp(1))
-        ));
+        NodeId left = node(ctx->exp(0));
+        return ast.add(NodeKind::IndexExp, left, node(ctx->exp(1)));
     }
 };
\ No newline at end of file
@@ -0,0 +1,141 @@
+#pragma once
+
+#include "AST.h"
+#include <ostream>
+#include <iomanip>
+#include <stdexcept>
+
+// s-expression dump of the AST, used to compare front ends
+class ASTPrint {
+public:
+    ASTPrint(ostream &out) : out(out) {}
+
+    void print(const File &file) {
+        ast = &file.ast;
+        for (auto &f : file.functions) {
+            out << "(function " << f.first << " (";
+            for (size_t i=0;i<f.second.args.size();i++)
+                out << (i?" ":"") << f.second.args[i];
+            out << ") ";
+            if (f.second.body != NO_NODE) print(f.second.body);
+            else print(f.second.e);
+            out << ")" << endl;
+        }
+    }
+
+private:
+    ostream &out;
+    const Ast *ast;
+
+    void print(NodeId id) {
+        if (id == NO_NODE) {
+            out << "nil";
+            return;
+        }
+        const Node &n = (*ast)[id];
+        switch (n.kind) {
+            case NodeKind::AssignStat:
+                node("assign", {n.a, n.b});
+                break;
+            case NodeKind::MultiAssignStat:
+                out << "(massign (";
+                for (int i=0;i<n.count;i++) {
+                    if (i) out << " ";
+                    print(ast->child(n, i));
+                }
+                out << ") ";
+                print(n.b);
+                out << ")";
+                break;
+            case NodeKind::FuncCallStat:
+                out << "(callstat ";
+                print(n.a);
+                children(n);
+                out << ")";
+                break;
+            case NodeKind::WhileStat:
+                node("while", {n.a, n.b});
+                break;
+            case NodeKind::IfStat:
+                node("if", {n.a, n.b, n.c});
+                break;
+            case NodeKind::BlockStat:
+                out << "(block";
+                children(n);
+                out << ")";
+                break;
+            case NodeKind::ReturnStat:
+                node("return", {n.a});
+                break;
+            case NodeKind::LexpId:
+                out << ast->str(id);
+                break;
+            case NodeKind::LexpIndex:
+                node("lindex", {n.a, n.b});
+                break;
+            case NodeKind::IntExp:
+                out << n.ival;
+                break;
+            case NodeKind::FloatExp:
+                out << "(float " << setprecision(9) << n.fval << ")";
+                break;
+            case NodeKind::StringExp:
+                out << ast->str(id);
+                break;
+            case NodeKind::IdExp:
+                out << "(id " << ast->str(id) << ")";
+                break;
+            case NodeKind::FuncCallExp:
+                out << "(call ";
+                print(n.a);
+                children(n);
+                out << ")";
+                break;
+            case NodeKind::TernaryExp:
+                node("ternary", {n.a, n.b, n.c});
+                break;
+            case NodeKind::ListExp:
+                out << "(list";
+                children(n);
+                out << ")";
+                break;
+            case NodeKind::TupleExp:
+                out << "(tuple";
+                children(n);
+                out << ")";
+                break;
+            case NodeKind::MapExp:
+                out << "(map";
+                for (int i=0;i<n.count;i+=2) {
+                    out << " (";
+                    print(ast->child(n, i));
+                    out << " ";
+                    print(ast->child(n, i+1));
+                    out << ")";
+                }
+                out << ")";
+                break;
+            case NodeKind::IndexExp:
+                node("index", {n.a, n.b});
+                break;
+            default:
+                throw runtime_error("Unknown node");
+        }
+    }
+
+    void node(const char *name, initializer_list<NodeId> l) {
+        out << "(" << name;
+        for (auto c : l) {
+            out << " ";
+            print(c);
+        }
+        out << ")";
+    }
+
+    void children(const Node &n) {
+        for (int i=0;i<n.count;i++) {
+            out << " ";
+            print(ast->child(n, i));
+        }
+    }
+};
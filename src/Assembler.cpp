@@ -9,12 +9,9 @@ using namespace antlr4;
 
 using addressmap = std::map<std::string, PTR>;
 
-addressmap stdlib = {
-    {"printf", Printf},
-};
-
+// {length, bytes packed 4 per word...}, zero padded with at least one '\0'
 vmcode stringArrayToCode(std::string str) {
-    vmcode s;
+    std::string s;
     for (int i=1;i<str.size()-1;i++) {
         char c = str[i];
         if (c == '\\') {
@@ -29,8 +26,10 @@ vmcode stringArrayToCode(std::string str) {
             s.push_back(c);
         }
     }
-    s.push_back('\0');
-    return s;
+    vmcode code(1 + (s.size()+sizeof(WORD))/sizeof(WORD), 0);
+    code[0] = s.size();
+    memcpy(&code[1], s.data(), s.size());
+    return code;
 }
 
 class LabelResolve : BytecodeBaseVisitor {
@@ -53,7 +52,7 @@ public:
 
     virtual antlrcpp::Any visitOp(BytecodeParser::OpContext *ctx) override {
         if (ctx->stringarray()) return visit(ctx->stringarray());
-        else if (ctx->funcname) {}
+        else if (ctx->funcname || ctx->srcpos()) {}
         else a += 1;
         return nullptr;
     }
@@ -83,11 +82,10 @@ public:
 
         auto labels = LabelResolve().visitCode(tree).as<addressmap>();
         this->addresses.insert(labels.begin(), labels.end());
-        this->addresses.insert(stdlib.begin(), stdlib.end());
         code.clear();
         visitCode(tree);
 
-        return {code, funcs};
+        return {code, funcs, strings, lines};
     }
 
     virtual antlrcpp::Any visitCode(BytecodeParser::CodeContext *ctx) override {
@@ -142,25 +140,58 @@ public:
             else if (op == "list_access_ptr") i0 = ListAccessPtr;
             else if (op == "list_access") i0 = ListAccess;
             else if (op == "list_length") i0 = ListLength;
+            else if (op == "list_create_local") i0 = ListCreateLocal;
             else if (op == "tuple_create") i0 = TupleCreate;
             else if (op == "tuple_concat") i0 = TupleConcat;
             else if (op == "tuple_access_ptr") i0 = TupleAccessPtr;
             else if (op == "tuple_access") i0 = TupleAccess;
+            else if (op == "tuple_unpack") i0 = TupleUnpack;
             else if (op == "closure_create") i0 = ClosureCreate;
             else if (op == "closure_call") i0 = ClosureCall;
             else if (op == "map_create") i0 = MapCreate;
             else if (op == "map_add") i0 = MapAdd;
             else if (op == "map_access_ptr") i0 = MapAccessPtr;
             else if (op == "map_access") i0 = MapAccess;
+            else if (op == "map_remove") i0 = MapRemove;
+            else if (op == "map_has") i0 = MapHas;
+            else if (op == "add_int") i0 = AddInt;
+            else if (op == "sub_int") i0 = SubInt;
+            else if (op == "mul_int") i0 = MulInt;
+            else if (op == "div_int") i0 = DivInt;
+            else if (op == "mod_int") i0 = ModInt;
+            else if (op == "lt_int") i0 = LtInt;
+            else if (op == "lteq_int") i0 = LteqInt;
+            else if (op == "gt_int") i0 = GtInt;
+            else if (op == "gteq_int") i0 = GteqInt;
+            else if (op == "eq_int") i0 = EqInt;
+            else if (op == "neq_int") i0 = NeqInt;
+            else if (op == "add_float") i0 = AddFloat;
+            else if (op == "sub_float") i0 = SubFloat;
+            else if (op == "mul_float") i0 = MulFloat;
+            else if (op == "div_float") i0 = DivFloat;
+            else if (op == "ifjump_int") i0 = IfJumpInt;
+            else if (op == "ifnjump_int") i0 = IfNJumpInt;
+            else if (op == "list_access_int") i0 = ListAccessInt;
+            else if (op == "list_access_u") i0 = ListAccessU;
+            else if (op == "list_access_ptr_u") i0 = ListAccessPtrU;
+            else if (op == "call_memo") i0 = CallMemo;
 
             WORD i1 = 0;
             if (ctx->intliteral()) i1 = visit(ctx->intliteral());
+            else if (i0 == CallExt) {
+                // natives are called through their dense index
+                string name = visit(ctx->name());
+                int index = natives.find(name);
+                if (index < 0) throw runtime_error("Unknown native function " + name);
+                i1 = index;
+            }
             else if (ctx->name()) i1 = addresses[visit(ctx->name())];
 
             code.push_back(makeInstruction(i0, i1));
 
         } else if (ctx->stringarray()) {
             vmcode s = visit(ctx->stringarray());
+            strings.push_back(code.size());
             code.insert(code.end(), s.begin(), s.end());
         } else if (ctx->intl) {
             code.push_back(visit(ctx->intl).as<WORD>());
@@ -168,6 +199,12 @@ public:
             code.push_back(visit(ctx->floatl).as<WORD>());
         } else if (ctx->funcname) {
             funcs[visit(ctx->funcname).as<string>()] = make_pair(code.size(), visit(ctx->numargs).as<WORD>());
+        } else if (ctx->srcpos()) {
+            auto p = ctx->srcpos();
+            SourcePos pos{(PTR)code.size(), stoi(p->line->getText()), stoi(p->col->getText())};
+            // a statement without code of its own gives way to the next one
+            if (!lines.empty() && lines.back().pc == pos.pc) lines.back() = pos;
+            else lines.push_back(pos);
         }
         return nullptr;
     }
@@ -204,6 +241,8 @@ public:
     addressmap addresses;
     vmcode code;
     std::map<std::string, std::pair<PTR, int>> funcs;
+    std::vector<PTR> strings;
+    std::vector<SourcePos> lines;
 };
 
 vmunit assemble(string assembly) {
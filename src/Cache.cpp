@@ -0,0 +1,163 @@
+#include "Cache.h"
+
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <cstdio>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <utime.h>
+
+using namespace std;
+
+const WORD CACHE_MAGIC = 0x43524f4e; // "NORC"
+const string CACHE_EXT = ".vmu";
+
+uint64_t fnv1a(const string &s, uint64_t h) {
+    for (unsigned char c : s) {
+        h ^= c;
+        h *= 1099511628211ull;
+    }
+    return h;
+}
+
+string cacheKey(string source, string compiler, string flags) {
+    string all = compiler + '\0' + flags + '\0' + source;
+    // two independent 64 bit hashes give a 128 bit name
+    uint64_t h1 = fnv1a(all, 14695981039346656037ull);
+    uint64_t h2 = fnv1a(all, h1 ^ 0x9e3779b97f4a7c15ull);
+    char buf[33];
+    snprintf(buf, sizeof(buf), "%016llx%016llx", (unsigned long long)h1, (unsigned long long)h2);
+    return buf;
+}
+
+string CompileCache::path(string key) {
+    return dir + "/" + key + CACHE_EXT;
+}
+
+void writeWord(ostream &o, WORD w) {
+    o.write((const char*)&w, sizeof(WORD));
+}
+
+WORD readWord(istream &i) {
+    WORD w = 0;
+    i.read((char*)&w, sizeof(WORD));
+    return w;
+}
+
+// counts come from the file, anything a unit can't hold means the entry is corrupt
+bool readCount(istream &i, WORD &n) {
+    n = readWord(i);
+    return i && n <= (WORD)VirtualMachine::CODE_SIZE;
+}
+
+bool CompileCache::load(string key, vmunit &unit) {
+    ifstream in(path(key), ios::binary);
+    if (!in || readWord(in) != CACHE_MAGIC) return false;
+
+    vmunit u;
+    WORD n;
+    if (!readCount(in, n)) return false;
+    u.code.resize(n);
+    in.read((char*)u.code.data(), u.code.size()*sizeof(WORD));
+    WORD numFuncs;
+    if (!readCount(in, numFuncs)) return false;
+    for (WORD i=0;i<numFuncs;i++) {
+        if (!readCount(in, n)) return false;
+        string name(n, '\0');
+        in.read(&name[0], name.size());
+        PTR addr = readWord(in);
+        int numArgs = readWord(in);
+        if (!in) return false;
+        u.funcs[name] = make_pair(addr, numArgs);
+    }
+    if (!readCount(in, n)) return false;
+    u.strings.resize(n);
+    in.read((char*)u.strings.data(), u.strings.size()*sizeof(PTR));
+    if (!readCount(in, n)) return false;
+    u.lines.resize(n);
+    in.read((char*)u.lines.data(), u.lines.size()*sizeof(SourcePos));
+    if (!in) return false;
+
+    // refresh the modification time, eviction drops the oldest entries first
+    utime(path(key).c_str(), nullptr);
+    unit = u;
+    return true;
+}
+
+void CompileCache::store(string key, const vmunit &unit) {
+    mkdir(dir.c_str(), 0755);
+    stringstream tmp;
+    tmp << dir << "/" << key << ".tmp." << getpid();
+
+    {
+        ofstream out(tmp.str(), ios::binary);
+        if (!out) return;
+        writeWord(out, CACHE_MAGIC);
+        writeWord(out, unit.code.size());
+        out.write((const char*)unit.code.data(), unit.code.size()*sizeof(WORD));
+        writeWord(out, unit.funcs.size());
+        for (auto f : unit.funcs) {
+            writeWord(out, f.first.size());
+            out.write(f.first.data(), f.first.size());
+            writeWord(out, f.second.first);
+            writeWord(out, f.second.second);
+        }
+        writeWord(out, unit.strings.size());
+        out.write((const char*)unit.strings.data(), unit.strings.size()*sizeof(PTR));
+        writeWord(out, unit.lines.size());
+        out.write((const char*)unit.lines.data(), unit.lines.size()*sizeof(SourcePos));
+        if (!out) {
+            remove(tmp.str().c_str());
+            return;
+        }
+    }
+    if (rename(tmp.str().c_str(), path(key).c_str()) != 0) remove(tmp.str().c_str());
+    evict();
+}
+
+void CompileCache::evict() {
+    DIR *d = opendir(dir.c_str());
+    if (!d) return;
+    vector<pair<time_t, pair<string, uint64_t>>> entries;
+    uint64_t total = 0;
+    while (auto e = readdir(d)) {
+        string name = e->d_name;
+        if (name.size() < CACHE_EXT.size() || name.compare(name.size()-CACHE_EXT.size(), CACHE_EXT.size(), CACHE_EXT) != 0) continue;
+        struct stat st;
+        string p = dir + "/" + name;
+        if (stat(p.c_str(), &st) != 0) continue;
+        entries.push_back(make_pair(st.st_mtime, make_pair(p, (uint64_t)st.st_size)));
+        total += st.st_size;
+    }
+    closedir(d);
+
+    sort(entries.begin(), entries.end());
+    for (auto &e : entries) {
+        if (total <= maxBytes) break;
+        // another process may have evicted it already
+        remove(e.second.first.c_str());
+        total -= e.second.second;
+    }
+}
+
+void CompileCache::count(bool hit) {
+    string statsPath = dir + "/stats";
+    {
+        ifstream in(statsPath);
+        in >> hits >> misses;
+    }
+    if (hit) hits++;
+    else misses++;
+
+    mkdir(dir.c_str(), 0755);
+    stringstream tmp;
+    tmp << statsPath << ".tmp." << getpid();
+    {
+        ofstream out(tmp.str());
+        out << hits << " " << misses << endl;
+    }
+    // concurrent runs may lose an increment, never corrupt the file
+    rename(tmp.str().c_str(), statsPath.c_str());
+}
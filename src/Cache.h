@@ -0,0 +1,31 @@
+#pragma once
+
+#include "VirtualMachine.h"
+
+#include <string>
+
+// On-disk cache of compiled units, named by a hash of everything that
+// determines the compiler output. Entries are written to a temporary file
+// then renamed, so concurrent writers never expose a partial entry, and the
+// least recently used entries are evicted once the directory exceeds maxBytes.
+class CompileCache {
+public:
+    CompileCache(std::string dir, uint64_t maxBytes) : dir(dir), maxBytes(maxBytes) {}
+
+    bool load(std::string key, vmunit &unit);
+    void store(std::string key, const vmunit &unit);
+
+    // adds this lookup to the counters kept in the cache directory
+    void count(bool hit);
+    int hits = 0;
+    int misses = 0;
+
+private:
+    std::string path(std::string key);
+    void evict();
+
+    std::string dir;
+    uint64_t maxBytes;
+};
+
+std::string cacheKey(std::string source, std::string compiler, std::string flags);
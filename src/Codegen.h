@@ -2,221 +2,688 @@
 
 #include "VirtualMachine.h"
 #include "Assembler.h"
+#include "TypeInference.h"
+#include "LoopOpt.h"
+#include "IR.h"
+#include "IROpt.h"
+#include "IRLower.h"
+#include "Purity.h"
 
 #include <map>
+#include <set>
+#include <thread>
+#include <atomic>
+#include <exception>
 
 using namespace std;
 
-class CodeGen {
+// Assembly of one function, its labels and constants are local to it
+struct FunctionUnit {
+    string code;
+    // (label, kind + literal)
+    vector<pair<string, string>> constants;
+    exception_ptr error;
+    // optimized IR, at -O2
+    string ir;
+};
+
+class FunctionGen {
 public:
-    vmunit gen(File f) {
-        for (auto s : f.functions) {
-            visit(s.first, s.second);
+    // -O0 : generic opcodes. -O1 : type specialization and loop
+    // optimizations. -O2 : the SSA IR, falling back to -O1 for functions it
+    // can't handle. Calls of memoized functions go through their cache.
+    FunctionGen(int index, const map<string, string> &funclbls, const set<string> &memoized, const Ast &ast, int optLevel = 1)
+        : index(index), funclbls(funclbls), memoized(memoized), ast(ast), optLevel(optLevel) {}
+
+    FunctionUnit gen(string name, const Function &f) {
+        for (auto a : f.args) localFor(a);
+
+        findFrameLists(f);
+        if (optLevel >= 1) {
+            types.run(f);
+            loops.run(f);
+        }
+
+        code << funclbls.at(name) << ": function " << name << " " << f.args.size() << endl;
+        string dump;
+        if (optLevel >= 2) {
+            auto saved = make_tuple(locals, localId, lblId, constantLbls, constants);
+            try {
+                code << genIR(name, f, dump);
+                return {str.str(), constants, nullptr, dump};
+            } catch (runtime_error &e) {
+                tie(locals, localId, lblId, constantLbls, constants) = saved;
+                dump = "function " + name + " : " + e.what() + "\n";
+            }
         }
+        position(f.line, f.col);
+        if (f.body != NO_NODE) visit(f.body);
+        else visit(f.e);
         code << "return" << endl;
-        /* DEBUG */
-        cout << str.str() << endl;
-        cout << constantsstr.str() << endl;
-        /*       */
-        return assemble(str.str() + constantsstr.str());
-    }
-
-    void visit(string name, Function f) {
-        string lbl = name + "entry";
-        funclbls[name] = lbl;
-
-        locals.clear();
-        localId = 0;
-        for (auto a : f.args) {
-            locals[a] = localId;
-            localId += 1;
+        return {str.str(), constants, nullptr, dump};
+    }
+
+    void visit(NodeId id) {
+        const Node &n = ast[id];
+        if (n.kind != NodeKind::BlockStat) position(n.line, n.col);
+        switch (n.kind) {
+            case NodeKind::AssignStat:
+                if (ast.kind(n.a) == NodeKind::LexpId) {
+                    auto &name = ast.str(n.a);
+                    int local = localFor(name);
+                    const Node &e = ast[n.b];
+                    if (e.kind == NodeKind::ListExp && frameLists.count(name)) {
+                        for (int i=e.count-1;i>=0;i--) visit(ast.child(e, i));
+                        code << "list_create_local " << e.count << endl;
+                    } else visit(n.b);
+                    code << "store_var " << local << endl;
+                } else {
+                    visit(n.a);
+                    visit(n.b);
+                    code << "store_mem" << endl;
+                }
+                break;
+            case NodeKind::MultiAssignStat:
+                visit(n.b);
+                code << "tuple_unpack " << n.count << endl;
+                for (int i=0;i<n.count;i++) {
+                    NodeId left = ast.child(n, i);
+                    if (ast.kind(left) == NodeKind::LexpId) {
+                        code << "store_var " << localFor(ast.str(left)) << endl;
+                    } else {
+                        int tmp = localId++;
+                        code << "store_var " << tmp << endl;
+                        visit(left);
+                        code << "load_var " << tmp << endl;
+                        code << "store_mem" << endl;
+                    }
+                }
+                break;
+            case NodeKind::WhileStat: {
+                auto startlbl = newlabel();
+                auto endlbl = newlabel();
+                // invariants are kept in temporaries while the frame has room
+                for (auto h : loops.hoisted[id]) {
+                    if (types.numLocals() + (int)hoistedLocals.size() >= VirtualMachine::LOCAL_VARS_SIZE) break;
+                    visit(h);
+                    int tmp = localId++;
+                    code << "store_var " << tmp << endl;
+                    hoistedLocals[h] = tmp;
+                }
+                code << startlbl << ":" << endl;
+                visit(n.a);
+                code << (proven(n.a, StaticType::Int) ? "ifnjump_int " : "ifnjump ") << endlbl << endl;
+                visit(n.b);
+                code << "jump " << startlbl << endl;
+                code << endlbl << ":" << endl;
+                break;
+            }
+            case NodeKind::IfStat:
+            case NodeKind::TernaryExp: {
+                auto condlbl = newlabel();
+                auto endlbl = newlabel();
+                visit(n.a);
+                code << (proven(n.a, StaticType::Int) ? "ifjump_int " : "ifjump ") << condlbl << endl;
+                if (n.c != NO_NODE) visit(n.c);
+                code << "jump " << endlbl << endl;
+                code << condlbl << ":" << endl;
+                visit(n.b);
+                code << endlbl << ":" << endl;
+                break;
+            }
+            case NodeKind::BlockStat:
+                for (int i=0;i<n.count;i++) visit(ast.child(n, i));
+                break;
+            case NodeKind::ReturnStat:
+                if (n.a != NO_NODE) visit(n.a);
+                code << "return" << endl;
+                break;
+            case NodeKind::LexpId: {
+                auto it = locals.find(ast.str(id));
+                if (it == locals.end()) throw runtime_error("Can't find local");
+                code << "load_var_addr " << it->second << endl;
+                break;
+            }
+            case NodeKind::LexpIndex:
+                visit(n.a);
+                code << "load_mem" << endl;
+                visit(n.b);
+                code << (loops.unchecked.count(id) ? "list_access_ptr_u" : "list_access_ptr") << endl;
+                break;
+            case NodeKind::IntExp:
+                code << "load_int " << constant("i", to_string(n.ival)) << endl;
+                break;
+            case NodeKind::FloatExp: {
+                stringstream ss;
+                ss << fixed << n.fval;
+                code << "load_float " << constant("f", ss.str()) << endl;
+                break;
+            }
+            case NodeKind::StringExp:
+                code << "load_str " << constant("s", ast.str(id)) << endl;
+                break;
+            case NodeKind::IdExp: {
+                auto it = locals.find(ast.str(id));
+                if (it != locals.end()) {
+                    code << "load_var " << it->second << endl;
+                    break;
+                }
+                auto f = funclbls.find(ast.str(id));
+                if (f == funclbls.end()) throw runtime_error("Can't find local or function");
+                code << "closure_create " << f->second << endl;
+                break;
+            }
+            case NodeKind::FuncCallStat:
+            case NodeKind::FuncCallExp: {
+                auto h = hoistedLocals.find(id);
+                if (h != hoistedLocals.end()) code << "load_var " << h->second << endl;
+                else visitCall(n);
+                if (n.kind == NodeKind::FuncCallStat && pushesResult(n)) code << "pop" << endl;
+                break;
+            }
+            case NodeKind::ListExp:
+                for (int i=n.count-1;i>=0;i--) visit(ast.child(n, i));
+                code << "list_create " << n.count << endl;
+                break;
+            case NodeKind::TupleExp:
+                for (int i=n.count-1;i>=0;i--) visit(ast.child(n, i));
+                code << "tuple_create " << n.count << endl;
+                break;
+            case NodeKind::MapExp:
+                for (int i=n.count-1;i>=0;i--) visit(ast.child(n, i));
+                code << "map_create " << n.count/2 << endl;
+                break;
+            case NodeKind::IndexExp:
+                visit(n.a);
+                visit(n.b);
+                code << indexOpcode(id) << endl;
+                break;
         }
+    }
 
-        code << lbl << ": function " << name << " " << f.args.size() << endl;
-        if (f.body) visit(f.body);
-        else {
-            visit(f.e);
-            code << "return" << endl;
+    void visitCall(const Node &e) {
+        for (int i=e.count-1;i>=0;i--) {
+            visit(ast.child(e, i));
         }
+        string op = callOpcode(e);
+        if (op.empty()) {
+            visit(e.a);
+            code << "closure_call " << e.count << endl;
+        } else code << op << endl;
     }
 
-    void visit(statp sb) {
-        if (auto s = dynamic_pointer_cast<AssignStat>(sb)) {
-            if (auto l = dynamic_pointer_cast<LexpId>(s->left)) {
-                auto name = l->name;
-                auto it = locals.find(name);
-                int id;
-                if (it == locals.end()) {
-                    locals[name] = localId;
-                    id = localId;
-                    localId += 1;
-                } else id = it->second;
-                visit(s->right);
-                code << "store_var " << id << endl;
-            } else {
-                visit(s->left);
-                visit(s->right);
-                code << "store_mem" << endl;
-            }
-        } else if (auto s = dynamic_pointer_cast<FuncCallStat>(sb)) {
-            visit(expp(new FuncCallExp(s->func, s->args)));
-        } else if (auto s = dynamic_pointer_cast<WhileStat>(sb)) {
-            auto startlbl = newlabel();
-            auto endlbl = newlabel();
-            code << startlbl << ":" << endl;
-            visit(s->cond);
-            code << "ifnjump " << endlbl << endl;
-            visit(s->body);
-            code << "jump " << startlbl << endl;
-            code << endlbl << ":" << endl;
-        } else if (auto s = dynamic_pointer_cast<IfStat>(sb)) {
-            auto condlbl = newlabel();
-            auto endlbl = newlabel();
-            visit(s->cond);
-            code << "ifjump " << condlbl << endl;
-            visit(s->els);
-            code << "jump " << endlbl << endl;
-            visit(s->then);
-            code << endlbl << ":" << endl;
-        } else if (auto s = dynamic_pointer_cast<BlockStat>(sb)) {
-            for (auto s1 : s->stats) visit(s1);
-        } else if (auto s = dynamic_pointer_cast<ReturnStat>(sb)) {
-            visit(s->ret);
-            code << "return" << endl;
+    // opcode of a call of an operator, function or native, "" for a closure
+    string callOpcode(const Node &e) {
+        if (ast.kind(e.a) != NodeKind::IdExp || locals.count(ast.str(e.a))) return "";
+        auto &n = ast.str(e.a);
+        // operands proven ints or floats get the check-free opcodes
+        string suffix = "";
+        if (e.count == 2) {
+            NodeId l = ast.child(e, 0), r = ast.child(e, 1);
+            if (proven(l, StaticType::Int) && proven(r, StaticType::Int)) suffix = "_int";
+            else if (proven(l, StaticType::Float) && proven(r, StaticType::Float)) suffix = "_float";
         }
+        // float comparisons and mod keep the generic opcodes
+        string rel = (suffix == "_int") ? suffix : "";
+        if (n=="-") return (e.count == 1) ? "usub" : "sub" + suffix;
+        if (n=="not" || n=="and" || n=="or") return n;
+        if (n=="*") return "mul" + suffix;
+        if (n=="/") return "div" + suffix;
+        if (n=="%") return "mod" + rel;
+        if (n=="+") return "add" + suffix;
+        if (n=="<=") return "lteq" + rel;
+        if (n=="<") return "lt" + rel;
+        if (n==">") return "gt" + rel;
+        if (n==">=") return "gteq" + rel;
+        if (n=="==") return "eq" + rel;
+        if (n=="!=") return "neq" + rel;
+        if (n=="len") return "list_length";
+        if (n=="remove") return "map_remove";
+        if (n=="has") return "map_has";
+        auto it = funclbls.find(n);
+        if (it != funclbls.end()) return (memoized.count(n) ? "call_memo " : "call ") + it->second;
+        // natives
+        int native = natives.find(n);
+        if (native < 0) throw runtime_error("Unknown function " + n);
+        int numArgs = natives[native].numArgs;
+        if (numArgs >= 0 && numArgs != e.count)
+            throw runtime_error("Wrong number of arguments to " + n);
+        return "call_ext " + n;
     }
 
-    void visit(lexpp lexp) {
-        if (auto l = dynamic_pointer_cast<LexpId>(lexp)) {
-            visitLexpId(l);
-        } else if (auto l = dynamic_pointer_cast<LexpIndex>(lexp)) {
-            visit(l->l);
-            code << "load_mem" << endl;
-            visit(l->e);
-            code << "list_access_ptr" << endl;
+    // operators, map builtins and natives with a result always push one,
+    // what functions and closures leave on the stack isn't known
+    bool pushesResult(const Node &e) {
+        string op = callOpcode(e);
+        if (op.empty() || op.compare(0, 5, "call ") == 0 || op.compare(0, 10, "call_memo ") == 0) return false;
+        if (op.compare(0, 9, "call_ext ") == 0) return natives[natives.find(op.substr(9))].numResults > 0;
+        return true;
+    }
+
+    string indexOpcode(NodeId id) {
+        const Node &n = ast[id];
+        if (loops.unchecked.count(id)) return "list_access_u";
+        if (proven(n.a, StaticType::IntList) && proven(n.b, StaticType::Int)) return "list_access_int";
+        return "list_access";
+    }
+
+private:
+
+    // SSA IR
+
+    string genIR(const string &name, const Function &f, string &dump) {
+        ir.name = name;
+        ir.line = f.line;
+        ir.col = f.col;
+        block = ir.newBlock();
+        ir.seal(block);
+        for (size_t k=0;k<f.args.size();k++) {
+            ValueId p = ir.emit(block, IrOp::Param, "param");
+            ir.values[p].index = k;
+            ir.writeVariable(f.args[k], block, p);
         }
+        if (f.body != NO_NODE) {
+            irStat(f.body);
+            ir.ret(block, NO_VALUE);
+        } else ir.ret(block, irExpr(f.e));
+
+        removeUnreachable(ir);
+        propagateCopies(ir);
+        ValueNumbering(ir).run();
+        propagateCopies(ir);
+        eliminateDead(ir);
+
+        stringstream ss;
+        ir.print(ss);
+        dump = ss.str();
+        return IrLowering(ir, [this]() { return newlabel(); }, VirtualMachine::LOCAL_VARS_SIZE).lower();
     }
 
-    void visitLexpId(shared_ptr<LexpId> l) {
-        auto name = l->name;
-        auto it = locals.find(name);
-        int id;
-        if (it == locals.end()) {
-            throw runtime_error("Can't find local");
-        } else id = it->second;
-        code << "load_var_addr " << id << endl;
-    }
-
-    void visit(expp eb) {
-        if (auto e = dynamic_pointer_cast<IntExp>(eb)) {
-            auto it = intToLbl.find(e->value);
-            string lbl;
-            if (it == intToLbl.end()) {
-                lbl = newlabel();
-                intToLbl[e->value] = lbl;
-                constants << lbl << ": " << e->value << endl;
-            } else {
-                lbl = intToLbl[e->value];
-            }
-            code << "load_int " << lbl << endl;
-        } else if (auto e = dynamic_pointer_cast<FloatExp>(eb)) {
-            auto it = floatToLbl.find(e->value);
-            string lbl;
-            if (it == floatToLbl.end()) {
-                lbl = newlabel();
-                floatToLbl[e->value] = lbl;
-                constants << lbl << ": " << fixed << e->value << endl;
-            } else {
-                lbl = floatToLbl[e->value];
-            }
-            code << "load_float " << lbl << endl;
-        } else if (auto e = dynamic_pointer_cast<StringExp>(eb)) {
-            auto it = strToLbl.find(e->value);
-            string lbl;
-            if (it == strToLbl.end()) {
-                lbl = newlabel();
-                strToLbl[e->value] = lbl;
-                constants << lbl << ": " << e->value << endl;
-            } else {
-                lbl = strToLbl[e->value];
-            }
-            code << "load_str " << lbl << endl;
-        } else if (auto e = dynamic_pointer_cast<IdExp>(eb)) {
-            auto it = locals.find(e->name);
-            if (it == locals.end()) throw runtime_error("Can't find local or function");
-            code << "load_var " << it->second << endl;
-        } else if (auto e = dynamic_pointer_cast<FuncCallExp>(eb)) {
-            for (int i=e->args.size()-1;i>=0;i--) {
-                visit(e->args[i]);
-            }
-            if (auto n0 = dynamic_pointer_cast<IdExp>(e->func)) {
-                auto n = n0->name;
-                if (n=="-") {
-                    if (e->args.size() == 1) code << "usub" << endl;
-                    else code << "sub" << endl;
-                } else if (n=="not" || n=="and" || n=="or") {
-                    code << n << endl;
-                } else if (n=="*") code << "mul" << endl;
-                else if (n=="/") code << "div" << endl;
-                else if (n=="%") code << "mod" << endl;
-                else if (n=="+") code << "add" << endl;
-                else if (n=="<=") code << "lteq" << endl;
-                else if (n=="<") code << "lt" << endl;
-                else if (n==">") code << "gt" << endl;
-                else if (n==">=") code << "gteq" << endl;
-                else if (n=="==") code << "eq" << endl;
-                else if (n=="!=") code << "neq" << endl;
-                else if (n=="len") code << "list_length" << endl;
-                // stdlib
-                else {
-                    auto it = funclbls.find(n);
-                    if (it == funclbls.end()) code << "call_ext " << n << endl;
-                    else code << "call " << it->second << endl;
+    // IR_RESULT for a value, IR_BARRIER for a call whose result is ignored
+    ValueId irInstr(const string &opcode, const vector<ValueId> &args, uint8_t use) {
+        uint8_t flags = (use == IR_BARRIER) ? IR_BARRIER : irFlags(opcode) | use;
+        return ir.emit(block, IrOp::Vm, opcode, args, flags);
+    }
+
+    void irStat(NodeId id) {
+        const Node &n = ast[id];
+        if (n.kind != NodeKind::BlockStat) {
+            ir.line = n.line;
+            ir.col = n.col;
+        }
+        switch (n.kind) {
+            case NodeKind::AssignStat:
+                if (ast.kind(n.a) == NodeKind::LexpId) {
+                    auto &name = ast.str(n.a);
+                    localFor(name);
+                    const Node &e = ast[n.b];
+                    ValueId v = (e.kind == NodeKind::ListExp && frameLists.count(name))
+                        ? irChildren(e, "list_create_local " + to_string(e.count)) : irExpr(n.b);
+                    ir.writeVariable(name, block, v);
+                } else {
+                    ValueId p = irLexp(n.a);
+                    ValueId v = irExpr(n.b);
+                    irInstr("store_mem", {p, v}, 0);
                 }
-            } else {
-                //TODO implement
-                throw;
-            }
-        } else if (auto e = dynamic_pointer_cast<TernaryExp>(eb)) {
-            auto condlbl = newlabel();
-            auto endlbl = newlabel();
-            visit(e->cond);
-            code << "ifjump " << condlbl << endl;
-            visit(e->els);
-            code << "jump " << endlbl << endl;
-            code << condlbl << ":" << endl;
-            visit(e->then);
-            code << endlbl << ":" << endl;
-        } else if (auto e = dynamic_pointer_cast<ListExp>(eb)) {
-            for (int i=e->elements.size()-1;i>=0;i--) visit(e->elements[i]);
-            code << "list_create " << e->elements.size() << endl;
-        } else if (auto e = dynamic_pointer_cast<IndexExp>(eb)) {
-            visit(e->left);
-            visit(e->index);
-            code << "list_access" << endl;
+                break;
+            case NodeKind::MultiAssignStat:
+                throw runtime_error("no IR for multiple assignments");
+            case NodeKind::WhileStat: {
+                for (auto h : loops.hoisted[id]) {
+                    ValueId v = irExpr(h);
+                    hoistedValues[h] = v;
+                }
+                int head = ir.newBlock(), body = ir.newBlock(), exit = ir.newBlock();
+                ir.jump(block, head);
+                block = head;
+                ValueId c = irExpr(n.a);
+                ir.branch(block, c, proven(n.a, StaticType::Int), body, exit);
+                ir.seal(body);
+                ir.seal(exit);
+                block = body;
+                irStat(n.b);
+                ir.jump(block, head);
+                ir.seal(head);
+                block = exit;
+                break;
+            }
+            case NodeKind::IfStat: {
+                ValueId c = irExpr(n.a);
+                int then = ir.newBlock(), els = ir.newBlock(), join = ir.newBlock();
+                ir.branch(block, c, proven(n.a, StaticType::Int), then, els);
+                ir.seal(then);
+                ir.seal(els);
+                block = then;
+                irStat(n.b);
+                ir.jump(block, join);
+                block = els;
+                if (n.c != NO_NODE) irStat(n.c);
+                ir.jump(block, join);
+                ir.seal(join);
+                block = join;
+                break;
+            }
+            case NodeKind::BlockStat:
+                for (int i=0;i<n.count;i++) irStat(ast.child(n, i));
+                break;
+            case NodeKind::ReturnStat:
+                ir.ret(block, (n.a != NO_NODE) ? irExpr(n.a) : NO_VALUE);
+                // anything following is unreachable
+                block = ir.newBlock();
+                ir.seal(block);
+                break;
+            case NodeKind::FuncCallStat:
+                // an unused result is popped when lowered
+                irCall(n, pushesResult(n) ? IR_RESULT : IR_BARRIER);
+                break;
+            default:
+                irExpr(id);
         }
     }
 
+    ValueId irExpr(NodeId id) {
+        const Node &n = ast[id];
+        switch (n.kind) {
+            case NodeKind::IntExp:
+                return ir.emit(block, IrOp::Const, "load_int " + constant("i", to_string(n.ival)));
+            case NodeKind::FloatExp: {
+                stringstream ss;
+                ss << fixed << n.fval;
+                return ir.emit(block, IrOp::Const, "load_float " + constant("f", ss.str()));
+            }
+            case NodeKind::StringExp:
+                return ir.emit(block, IrOp::Const, "load_str " + constant("s", ast.str(id)));
+            case NodeKind::IdExp: {
+                auto &name = ast.str(id);
+                if (locals.count(name)) return ir.readVariable(name, block);
+                auto f = funclbls.find(name);
+                if (f == funclbls.end()) throw runtime_error("Can't find local or function");
+                return irInstr("closure_create " + f->second, {}, IR_RESULT);
+            }
+            case NodeKind::FuncCallStat:
+            case NodeKind::FuncCallExp: {
+                auto h = hoistedValues.find(id);
+                if (h != hoistedValues.end()) return h->second;
+                return irCall(n, IR_RESULT);
+            }
+            case NodeKind::ListExp:
+                return irChildren(n, "list_create " + to_string(n.count));
+            case NodeKind::TupleExp:
+                return irChildren(n, "tuple_create " + to_string(n.count));
+            case NodeKind::MapExp:
+                return irChildren(n, "map_create " + to_string(n.count/2));
+            case NodeKind::IndexExp: {
+                ValueId l = irExpr(n.a);
+                ValueId i = irExpr(n.b);
+                return irInstr(indexOpcode(id), {l, i}, IR_RESULT);
+            }
+            case NodeKind::TernaryExp: {
+                ValueId c = irExpr(n.a);
+                int then = ir.newBlock(), els = ir.newBlock(), join = ir.newBlock();
+                ir.branch(block, c, proven(n.a, StaticType::Int), then, els);
+                ir.seal(then);
+                ir.seal(els);
+                block = then;
+                ValueId t = irExpr(n.b);
+                ir.jump(block, join);
+                block = els;
+                ValueId e = irExpr(n.c);
+                ir.jump(block, join);
+                ir.seal(join);
+                block = join;
+                ValueId phi = ir.emit(join, IrOp::Phi, "phi", {t, e});
+                return ir.tryRemoveTrivialPhi(phi);
+            }
+            default:
+                throw runtime_error("no IR for this expression");
+        }
+    }
 
-private:
+    ValueId irChildren(const Node &n, const string &opcode) {
+        vector<ValueId> args;
+        for (int i=n.count-1;i>=0;i--) args.push_back(irExpr(ast.child(n, i)));
+        return irInstr(opcode, args, IR_RESULT);
+    }
+
+    ValueId irCall(const Node &e, uint8_t use) {
+        vector<ValueId> args;
+        for (int i=e.count-1;i>=0;i--) args.push_back(irExpr(ast.child(e, i)));
+        string op = callOpcode(e);
+        if (op.empty()) {
+            args.push_back(irExpr(e.a));
+            op = "closure_call " + to_string(e.count);
+        }
+        return irInstr(op, args, use);
+    }
+
+    // pointer to the element stored into
+    ValueId irLexp(NodeId id) {
+        const Node &n = ast[id];
+        ValueId list;
+        if (ast.kind(n.a) == NodeKind::LexpId) {
+            auto &name = ast.str(n.a);
+            if (!locals.count(name)) throw runtime_error("Can't find local");
+            list = ir.readVariable(name, block);
+        } else list = irInstr("load_mem", {irLexp(n.a)}, IR_RESULT);
+        ValueId i = irExpr(n.b);
+        return irInstr(loops.unchecked.count(id) ? "list_access_ptr_u" : "list_access_ptr", {list, i}, IR_RESULT);
+    }
+
+    // Allocation sinking : a local that is only ever assigned list literals,
+    // and only indexed or measured, can't let those lists outlive the call.
+    // They are allocated in the frame heap instead.
+    void findFrameLists(const Function &f) {
+        set<string> assigned;
+        set<string> escaping(f.args.begin(), f.args.end());
+        scanEscapes((f.body != NO_NODE) ? f.body : f.e, assigned, escaping);
+        frameLists.clear();
+        for (auto n : assigned)
+            if (!escaping.count(n)) frameLists.insert(n);
+    }
+
+    void scanEscapes(NodeId id, set<string> &assigned, set<string> &escaping) {
+        if (id == NO_NODE) return;
+        const Node &n = ast[id];
+        switch (n.kind) {
+            case NodeKind::AssignStat: {
+                const Node &e = ast[n.b];
+                bool list = e.kind == NodeKind::ListExp;
+                if (ast.kind(n.a) == NodeKind::LexpId) {
+                    if (list) assigned.insert(ast.str(n.a));
+                    else escaping.insert(ast.str(n.a));
+                } else scanEscapes(n.a, assigned, escaping);
+                if (list) for (int i=0;i<e.count;i++) scanEscapes(ast.child(e, i), assigned, escaping);
+                else scanEscapes(n.b, assigned, escaping);
+                break;
+            }
+            case NodeKind::MultiAssignStat:
+                for (int i=0;i<n.count;i++) {
+                    NodeId left = ast.child(n, i);
+                    if (ast.kind(left) == NodeKind::LexpId) escaping.insert(ast.str(left));
+                    else scanEscapes(left, assigned, escaping);
+                }
+                scanEscapes(n.b, assigned, escaping);
+                break;
+            case NodeKind::LexpIndex:
+                scanEscapes(n.a, assigned, escaping);
+                scanEscapes(n.b, assigned, escaping);
+                break;
+            case NodeKind::IdExp:
+                escaping.insert(ast.str(id));
+                break;
+            case NodeKind::IndexExp:
+                if (ast.kind(n.a) != NodeKind::IdExp) scanEscapes(n.a, assigned, escaping);
+                scanEscapes(n.b, assigned, escaping);
+                break;
+            case NodeKind::FuncCallStat:
+            case NodeKind::FuncCallExp: {
+                bool named = ast.kind(n.a) == NodeKind::IdExp;
+                if (named && ast.str(n.a) == "len" && n.count == 1
+                    && ast.kind(ast.child(n, 0)) == NodeKind::IdExp) break;
+                if (!named) scanEscapes(n.a, assigned, escaping);
+                for (int i=0;i<n.count;i++) scanEscapes(ast.child(n, i), assigned, escaping);
+                break;
+            }
+            case NodeKind::LexpId:
+            case NodeKind::IntExp:
+            case NodeKind::FloatExp:
+            case NodeKind::StringExp:
+                break;
+            default:
+                // the remaining kinds only hold statements and expressions
+                scanEscapes(n.a, assigned, escaping);
+                scanEscapes(n.b, assigned, escaping);
+                scanEscapes(n.c, assigned, escaping);
+                for (int i=0;i<n.count;i++) scanEscapes(ast.child(n, i), assigned, escaping);
+        }
+    }
+
+    bool proven(NodeId id, StaticType t) {
+        return types.type(id) == t;
+    }
+
+    int localFor(string name) {
+        auto it = locals.find(name);
+        if (it != locals.end()) return it->second;
+        locals[name] = localId;
+        return localId++;
+    }
+
+    // a .line directive where the statement changes
+    void position(int32_t l, int32_t c) {
+        if (l == 0 || (l == line && c == col)) return;
+        line = l;
+        col = c;
+        code << ".line " << l << " " << c << endl;
+    }
 
     string newlabel() {
         stringstream ss;
-        ss << "lbl" << (lblId++);
+        ss << "f" << index << "_l" << (lblId++);
         return ss.str();
     }
 
+    string constant(string kind, string literal) {
+        auto key = kind + " " + literal;
+        auto it = constantLbls.find(key);
+        if (it != constantLbls.end()) return it->second;
+        auto lbl = newlabel();
+        constantLbls[key] = lbl;
+        constants.push_back(make_pair(lbl, key));
+        return lbl;
+    }
+
+    int index;
     int lblId = 0;
 
-    map<string, string> funclbls;
+    const map<string, string> &funclbls;
+    const set<string> &memoized;
+    const Ast &ast;
     map<string, int32_t> locals;
     int localId = 0;
+    set<string> frameLists;
+    TypeInference types{ast, frameLists};
+    LoopOpt loops{ast, types};
+    map<NodeId, int> hoistedLocals;
+    int optLevel;
+    IrFunction ir;
+    int block = 0;
+    map<NodeId, ValueId> hoistedValues;
     stringbuf str;
-    stringbuf constantsstr;
     ostream code{&str};
-    ostream constants{&constantsstr};
+    // last .line directive
+    int32_t line = 0, col = 0;
+
+    map<string, string> constantLbls;
+    vector<pair<string, string>> constants;
+};
+
+// Functions are generated independently on `threads` workers, then linked in
+// name order. Equal constants of different functions are merged by giving
+// the single copy every function's label, so the output doesn't depend on
+// the number of threads.
+class CodeGen {
+public:
+    CodeGen(int threads = thread::hardware_concurrency(), int optLevel = 1)
+        : threads(max(1, threads)), optLevel(optLevel) {}
+
+    // the IR of every function after optimization, filled by gen at -O2
+    string ir;
+    // what gen passed to the assembler
+    string assembly;
+    // functions to memoize besides the pure tree recursions picked from
+    // -O1 on, they must be pure
+    set<string> memoize;
+    bool autoMemoize = true;
+
+    vmunit gen(const File &f) {
+        vector<pair<string, Function>> functions(f.functions.begin(), f.functions.end());
+        map<string, string> funclbls;
+        for (auto &fn : functions) funclbls[fn.first] = fn.first + "entry";
+        set<string> memoized = memoizable(f);
+
+        vector<FunctionUnit> units(functions.size());
+        atomic<int> next(0);
+        auto worker = [&]() {
+            for (int i = next++; i < (int)functions.size(); i = next++) {
+                try {
+                    units[i] = FunctionGen(i, funclbls, memoized, f.ast, optLevel).gen(functions[i].first, functions[i].second);
+                } catch (...) {
+                    units[i].error = current_exception();
+                }
+            }
+        };
+        vector<thread> pool;
+        for (int t=1;t<min(threads, (int)functions.size());t++) pool.emplace_back(worker);
+        worker();
+        for (auto &t : pool) t.join();
+        for (auto &u : units)
+            if (u.error) rethrow_exception(u.error);
+        ir.clear();
+        for (auto &u : units) ir += u.ir;
+
+        assembly = link(units);
+        return assemble(assembly);
+    }
+
+private:
+    set<string> memoizable(const File &f) {
+        Purity purity(f);
+        purity.run();
+        set<string> l;
+        for (auto &name : memoize) {
+            auto it = f.functions.find(name);
+            if (it == f.functions.end()) throw runtime_error("Can't memoize unknown function " + name);
+            if (!purity.pure.count(name)) throw runtime_error("Can't memoize " + name + ", it isn't pure");
+            if (it->second.args.size() > VirtualMachine::MEMO_MAX_ARGS)
+                throw runtime_error("Can't memoize " + name + ", it has too many arguments");
+            l.insert(name);
+        }
+        if (optLevel < 1 || !autoMemoize) return l;
+        for (auto &name : purity.pure)
+            if (f.functions.at(name).args.size() <= VirtualMachine::MEMO_MAX_ARGS && purity.selfCalls(name) >= 2)
+                l.insert(name);
+        return l;
+    }
+
+    string link(const vector<FunctionUnit> &units) {
+        stringstream ss;
+        vector<string> order;
+        map<string, vector<string>> labels;
+        for (auto &u : units) {
+            ss << u.code;
+            for (auto &c : u.constants) {
+                if (!labels.count(c.second)) order.push_back(c.second);
+                labels[c.second].push_back(c.first);
+            }
+        }
+        for (auto &c : order) {
+            for (auto &l : labels[c]) ss << l << ": ";
+            ss << c.substr(2) << endl;
+        }
+        return ss.str();
+    }
 
-    map<string, string> strToLbl;
-    map<int, string> intToLbl;
-    map<float, string> floatToLbl;
+    int threads;
+    int optLevel;
 };
\ No newline at end of file
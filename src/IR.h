@@ -0,0 +1,263 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <map>
+#include <set>
+#include <ostream>
+#include <stdexcept>
+#include <cstdint>
+
+using namespace std;
+
+// SSA IR built by FunctionGen at -O2, optimized by IROpt.h and lowered back
+// to bytecode by IRLower.h. Values and instructions are the same thing : an
+// instruction is referred to by the ValueId of its result.
+
+using ValueId = int32_t;
+const ValueId NO_VALUE = -1;
+
+enum class IrOp : uint8_t {
+    Param,  // argument, arrives in the slot of its index
+    Undef,  // local read before it is assigned, whatever its slot holds
+    Phi,    // one operand per predecessor
+    Const,  // load of a constant, emitted again at each use
+    Vm,     // a VM instruction
+};
+
+enum IrFlags : uint8_t {
+    IR_PURE      = 1,   // same operands, same result, so it can be numbered
+    IR_REMOVABLE = 2,   // can't throw or write anything, dropped when unused
+    IR_RESULT    = 4,   // pushes one value
+    IR_BARRIER   = 8,   // may leave unknown values on the op stack
+};
+
+struct IrInstr {
+    IrOp op;
+    string opcode;          // mnemonic and immediate : "add_int", "call mainentry"
+    vector<ValueId> args;   // in the order they are pushed
+    int block;
+    uint8_t flags;
+    int index = 0;          // Param : argument index
+    int32_t line = 0, col = 0;  // of the statement it comes from
+    bool dead = false;
+    ValueId replacedBy = NO_VALUE;
+};
+
+enum class IrTerm : uint8_t { None, Jump, Branch, Return };
+
+struct IrBlock {
+    vector<ValueId> instrs;     // phis first
+    vector<int> preds;
+    vector<int> succs;          // Branch : taken when true, then when false
+    IrTerm term = IrTerm::None;
+    ValueId value = NO_VALUE;   // branch condition or returned value
+    bool intCond = false;       // the condition is a proven int
+    int32_t line = 0, col = 0;  // of the terminator
+    bool sealed = false;
+    bool removed = false;
+};
+
+// flags of the VM instructions, by mnemonic
+inline uint8_t irFlags(const string &opcode) {
+    static const set<string> checkFree = {
+        "add_int", "sub_int", "mul_int", "div_int", "add_float", "sub_float", "mul_float", "div_float",
+        "lt_int", "lteq_int", "gt_int", "gteq_int", "eq_int", "neq_int", "usub"};
+    // their result only depends on their operands, but they throw on some
+    static const set<string> throwing = {
+        "mod_int", "mod", "sub", "mul", "div", "lt", "lteq", "gt", "gteq", "eq", "neq", "not", "and", "or"};
+    // fresh allocations and reads of memory that may change
+    static const set<string> reads = {
+        "list_create", "list_create_local", "tuple_create", "map_create", "closure_create",
+        "list_length", "list_access_u"};
+    string mnemonic = opcode.substr(0, opcode.find(' '));
+    if (checkFree.count(mnemonic)) return IR_PURE | IR_REMOVABLE;
+    if (throwing.count(mnemonic)) return IR_PURE;
+    if (reads.count(mnemonic)) return IR_REMOVABLE;
+    return 0;
+}
+
+class IrFunction {
+public:
+    string name;
+    vector<IrInstr> values;
+    vector<IrBlock> blocks;
+    // source position given to what is emitted next
+    int32_t line = 0, col = 0;
+
+    int newBlock() {
+        blocks.push_back(IrBlock());
+        defs.push_back({});
+        incomplete.push_back({});
+        return blocks.size()-1;
+    }
+
+    ValueId emit(int block, IrOp op, const string &opcode, const vector<ValueId> &args = {}, uint8_t flags = 0) {
+        IrInstr i;
+        i.op = op;
+        i.opcode = opcode;
+        i.args = args;
+        i.block = block;
+        i.flags = flags;
+        i.line = line;
+        i.col = col;
+        values.push_back(i);
+        ValueId id = values.size()-1;
+        auto &instrs = blocks[block].instrs;
+        // phis stay in front, they can be added after other instructions
+        if (op == IrOp::Phi) {
+            auto it = instrs.begin();
+            while (it != instrs.end() && values[*it].op == IrOp::Phi) ++it;
+            instrs.insert(it, id);
+        } else instrs.push_back(id);
+        return id;
+    }
+
+    void jump(int block, int to) {
+        blocks[block].term = IrTerm::Jump;
+        place(block);
+        edge(block, to);
+    }
+
+    void branch(int block, ValueId cond, bool intCond, int ifTrue, int ifFalse) {
+        blocks[block].term = IrTerm::Branch;
+        place(block);
+        blocks[block].value = cond;
+        blocks[block].intCond = intCond;
+        edge(block, ifTrue);
+        edge(block, ifFalse);
+    }
+
+    void ret(int block, ValueId v) {
+        blocks[block].term = IrTerm::Return;
+        place(block);
+        blocks[block].value = v;
+    }
+
+    void place(int block) {
+        blocks[block].line = line;
+        blocks[block].col = col;
+    }
+
+    ValueId resolve(ValueId v) const {
+        while (v != NO_VALUE && values[v].replacedBy != NO_VALUE) v = values[v].replacedBy;
+        return v;
+    }
+
+    // SSA construction from "Simple and Efficient Construction of Static
+    // Single Assignment Form", Braun et al. : a read looks for the local's
+    // definition through the predecessors, placing phis where paths join.
+    // Blocks are sealed once all their predecessors are known, reads in
+    // blocks that aren't sealed get an incomplete phi filled in on sealing.
+
+    void writeVariable(const string &var, int block, ValueId v) {
+        defs[block][var] = v;
+    }
+
+    ValueId readVariable(const string &var, int block) {
+        auto it = defs[block].find(var);
+        if (it != defs[block].end()) return resolve(it->second);
+        ValueId v;
+        auto &b = blocks[block];
+        if (!b.sealed) {
+            v = emit(block, IrOp::Phi, "phi");
+            incomplete[block][var] = v;
+        } else if (b.preds.size() == 1) {
+            v = readVariable(var, b.preds[0]);
+        } else if (b.preds.empty()) {
+            v = emit(block, IrOp::Undef, "undef");
+        } else {
+            v = emit(block, IrOp::Phi, "phi");
+            writeVariable(var, block, v);
+            v = addPhiOperands(var, v);
+        }
+        writeVariable(var, block, v);
+        return v;
+    }
+
+    void seal(int block) {
+        for (auto &p : incomplete[block]) addPhiOperands(p.first, p.second);
+        incomplete[block].clear();
+        blocks[block].sealed = true;
+    }
+
+    // a phi whose operands are all the same value, or itself, is that value
+    ValueId tryRemoveTrivialPhi(ValueId phi) {
+        ValueId same = NO_VALUE;
+        for (auto a : values[phi].args) {
+            a = resolve(a);
+            if (a == same || a == phi) continue;
+            if (same != NO_VALUE) return phi;
+            same = a;
+        }
+        if (same == NO_VALUE) same = emit(values[phi].block, IrOp::Undef, "undef");
+        values[phi].replacedBy = same;
+        values[phi].dead = true;
+        for (auto &v : values)
+            if (v.op == IrOp::Phi && !v.dead)
+                for (auto a : v.args)
+                    if (a == phi) {
+                        tryRemoveTrivialPhi(&v - &values[0]);
+                        break;
+                    }
+        return resolve(same);
+    }
+
+    void print(ostream &o) const {
+        o << "function " << name << endl;
+        for (size_t b=0;b<blocks.size();b++) {
+            auto &block = blocks[b];
+            if (block.removed) continue;
+            o << "b" << b << ":";
+            if (!block.preds.empty()) {
+                o << " <-";
+                for (auto p : block.preds) o << " b" << p;
+            }
+            o << endl;
+            for (auto id : block.instrs) {
+                auto &i = values[id];
+                if (i.dead) continue;
+                o << "    ";
+                if (i.op != IrOp::Vm || (i.flags & IR_RESULT)) o << "v" << id << " = ";
+                o << i.opcode;
+                if (i.op == IrOp::Param) o << " " << i.index;
+                for (auto a : i.args) o << " v" << resolve(a);
+                o << endl;
+            }
+            switch (block.term) {
+                case IrTerm::Jump:
+                    o << "    jump b" << block.succs[0] << endl;
+                    break;
+                case IrTerm::Branch:
+                    o << "    branch" << (block.intCond ? "_int" : "") << " v" << resolve(block.value)
+                      << " b" << block.succs[0] << " b" << block.succs[1] << endl;
+                    break;
+                case IrTerm::Return:
+                    o << "    return";
+                    if (block.value != NO_VALUE) o << " v" << resolve(block.value);
+                    o << endl;
+                    break;
+                case IrTerm::None:
+                    break;
+            }
+        }
+    }
+
+private:
+    vector<map<string, ValueId>> defs;
+    vector<map<string, ValueId>> incomplete;
+
+    void edge(int from, int to) {
+        blocks[from].succs.push_back(to);
+        blocks[to].preds.push_back(from);
+    }
+
+    ValueId addPhiOperands(const string &var, ValueId phi) {
+        int block = values[phi].block;
+        for (auto p : blocks[block].preds) {
+            ValueId v = readVariable(var, p);
+            values[phi].args.push_back(v);
+        }
+        return tryRemoveTrivialPhi(phi);
+    }
+};
@@ -0,0 +1,380 @@
+#pragma once
+
+#include "IR.h"
+
+#include <functional>
+#include <sstream>
+#include <algorithm>
+
+// Lowering of the optimized IR back to assembly :
+// - A value used once, by the next instructions of its block, is left on
+//   the op stack for them, as the AST code generator does for expressions.
+// - The others live in local slots. Phi operands share the phi's slot when
+//   their live ranges don't interfere, so most phis need no copy, and the
+//   remaining values are packed into as few slots as the interferences
+//   allow. Arguments keep the slots the call put them in.
+// - Phi copies are made at the end of the predecessors, all operands are
+//   pushed before any is stored so they happen at once.
+class IrLowering {
+public:
+    IrLowering(IrFunction &f, function<string()> newlabel, int maxSlots)
+        : f(f), newlabel(newlabel), maxSlots(maxSlots) {}
+
+    string lower() {
+        for (size_t b=0;b<f.blocks.size();b++)
+            if (!f.blocks[b].removed) layout.push_back(b);
+        countUses();
+        for (auto b : layout) stackify(b);
+        allocateSlots();
+        for (auto b : layout) labels[b] = newlabel();
+        for (size_t k=0;k<layout.size();k++) emitBlock(k);
+        return code.str();
+    }
+
+private:
+    IrFunction &f;
+    function<string()> newlabel;
+    int maxSlots;
+
+    vector<int> layout;
+    vector<int> uses;
+    vector<int> userBlock;
+    vector<bool> phiUse;
+    vector<bool> stacked;
+    vector<int> slot;
+    map<int, string> labels;
+    stringstream code;
+    int32_t line = 0, col = 0;
+
+    bool alive(ValueId v) {
+        return !f.values[v].dead && !f.blocks[f.values[v].block].removed;
+    }
+
+    void countUses() {
+        uses.assign(f.values.size(), 0);
+        userBlock.assign(f.values.size(), -1);
+        phiUse.assign(f.values.size(), false);
+        for (auto b : layout) {
+            for (auto id : f.blocks[b].instrs) {
+                if (!alive(id)) continue;
+                for (auto a : f.values[id].args) {
+                    uses[a]++;
+                    userBlock[a] = b;
+                    if (f.values[id].op == IrOp::Phi) phiUse[a] = true;
+                }
+            }
+            ValueId v = f.blocks[b].value;
+            auto term = f.blocks[b].term;
+            if ((term == IrTerm::Branch || term == IrTerm::Return) && v != NO_VALUE) {
+                uses[v]++;
+                userBlock[v] = b;
+            }
+        }
+    }
+
+    // STACK
+
+    // loads to emit before an instruction, by block and position
+    map<pair<int, int>, vector<ValueId>> preloads;
+
+    // Simulates the op stack over the block. The operands of an instruction
+    // left on the stack must be on top, in order, when it runs. Operands in
+    // slots are loaded when it runs, or, when a stacked operand follows
+    // them, just before the code computing that operand starts. Nothing may
+    // be left above a stacked value by a call whose result isn't used. A
+    // value breaking this is given a slot and the block is simulated again.
+    void stackify(int b) {
+        auto &block = f.blocks[b];
+        stacked.resize(f.values.size(), false);
+        for (auto id : block.instrs) {
+            auto &i = f.values[id];
+            stacked[id] = alive(id) && i.op == IrOp::Vm && (i.flags & IR_RESULT)
+                && uses[id] == 1 && !phiUse[id] && userBlock[id] == b;
+        }
+        map<ValueId, int> position;
+        for (size_t k=0;k<block.instrs.size();k++) position[block.instrs[k]] = k;
+        while (true) {
+            vector<ValueId> stack;
+            map<ValueId, int> start;
+            map<pair<int, int>, vector<ValueId>> loads;
+            int barrier = -1;
+            // returns a value to demote, or NO_VALUE
+            auto consume = [&](const vector<ValueId> &args) {
+                vector<ValueId> onStack;
+                for (auto a : args)
+                    if (stacked[a]) onStack.push_back(a);
+                if (stack.size() < onStack.size()) return onStack[0];
+                for (size_t j=0;j<onStack.size();j++)
+                    if (stack[stack.size()-onStack.size()+j] != onStack[j]) return stack.back();
+                // loads of the operands preceding a stacked one
+                vector<ValueId> pending;
+                for (auto a : args) {
+                    if (!stacked[a]) {
+                        pending.push_back(a);
+                        continue;
+                    }
+                    if (pending.empty()) continue;
+                    int at = start[a];
+                    if (barrier >= at) return a;
+                    for (auto l : pending) {
+                        auto &v = f.values[l];
+                        if (v.op == IrOp::Vm && v.block == b && position[l] >= at) return a;
+                    }
+                    auto &before = loads[{b, at}];
+                    before.insert(before.begin(), pending.begin(), pending.end());
+                    pending.clear();
+                }
+                stack.resize(stack.size()-onStack.size());
+                return NO_VALUE;
+            };
+            auto treeStart = [&](const vector<ValueId> &args, int k) {
+                for (auto a : args)
+                    if (stacked[a]) return start[a];
+                return k;
+            };
+            ValueId demote = NO_VALUE;
+            for (size_t k=0;k<block.instrs.size();k++) {
+                ValueId id = block.instrs[k];
+                auto &i = f.values[id];
+                if (!alive(id) || i.op != IrOp::Vm) continue;
+                demote = consume(i.args);
+                if (demote != NO_VALUE) break;
+                start[id] = treeStart(i.args, k);
+                if (i.flags & IR_BARRIER) {
+                    if (!stack.empty()) {
+                        demote = stack.back();
+                        break;
+                    }
+                    barrier = k;
+                }
+                if (stacked[id]) stack.push_back(id);
+            }
+            if (demote == NO_VALUE && block.value != NO_VALUE
+                && (block.term == IrTerm::Branch || block.term == IrTerm::Return))
+                demote = consume({block.value});
+            if (demote == NO_VALUE) {
+                preloads.insert(loads.begin(), loads.end());
+                return;
+            }
+            stacked[demote] = false;
+        }
+    }
+
+    // SLOTS
+
+    bool slotted(ValueId v) {
+        if (v == NO_VALUE || !alive(v) || uses[v] == 0) return false;
+        auto op = f.values[v].op;
+        return op == IrOp::Param || op == IrOp::Undef || op == IrOp::Phi || (op == IrOp::Vm && !stacked[v]);
+    }
+
+    vector<set<ValueId>> interferes;
+
+    // live values at the start of b from those live at its end, phis,
+    // arguments and undefined values are all defined on entry at once
+    set<ValueId> walk(int b, set<ValueId> live, bool interfere) {
+        auto &block = f.blocks[b];
+        auto def = [&](ValueId d) {
+            if (interfere)
+                for (auto l : live)
+                    if (l != d) {
+                        interferes[d].insert(l);
+                        interferes[l].insert(d);
+                    }
+        };
+        if ((block.term == IrTerm::Branch || block.term == IrTerm::Return) && slotted(block.value))
+            live.insert(block.value);
+        vector<ValueId> entry;
+        for (auto it = block.instrs.rbegin(); it != block.instrs.rend(); ++it) {
+            auto &i = f.values[*it];
+            if (!alive(*it)) continue;
+            if (i.op != IrOp::Vm) {
+                if (slotted(*it)) entry.push_back(*it);
+                continue;
+            }
+            if (slotted(*it)) {
+                def(*it);
+                live.erase(*it);
+            }
+            for (auto a : i.args)
+                if (slotted(a)) live.insert(a);
+        }
+        live.insert(entry.begin(), entry.end());
+        for (auto d : entry) def(d);
+        for (auto d : entry) live.erase(d);
+        return live;
+    }
+
+    set<ValueId> liveOut(int b, const vector<set<ValueId>> &liveIn) {
+        set<ValueId> out;
+        for (auto s : f.blocks[b].succs) {
+            out.insert(liveIn[s].begin(), liveIn[s].end());
+            size_t k = find(f.blocks[s].preds.begin(), f.blocks[s].preds.end(), b) - f.blocks[s].preds.begin();
+            for (auto id : f.blocks[s].instrs) {
+                auto &i = f.values[id];
+                if (alive(id) && i.op == IrOp::Phi && slotted(i.args[k])) out.insert(i.args[k]);
+            }
+        }
+        return out;
+    }
+
+    vector<ValueId> parent;
+
+    ValueId root(ValueId v) {
+        while (parent[v] != v) v = parent[v] = parent[parent[v]];
+        return v;
+    }
+
+    void allocateSlots() {
+        vector<set<ValueId>> liveIn(f.blocks.size());
+        bool changed = true;
+        while (changed) {
+            changed = false;
+            for (auto it = layout.rbegin(); it != layout.rend(); ++it) {
+                auto in = walk(*it, liveOut(*it, liveIn), false);
+                if (in != liveIn[*it]) {
+                    liveIn[*it] = in;
+                    changed = true;
+                }
+            }
+        }
+        interferes.assign(f.values.size(), {});
+        for (auto b : layout) walk(b, liveOut(b, liveIn), true);
+
+        // classes of values sharing a slot, an argument fixes its class's slot
+        parent.resize(f.values.size());
+        vector<vector<ValueId>> members(f.values.size());
+        vector<int> fixed(f.values.size(), -1);
+        for (size_t v=0;v<f.values.size();v++) {
+            parent[v] = v;
+            members[v] = {(ValueId)v};
+            if (slotted(v) && f.values[v].op == IrOp::Param) fixed[v] = f.values[v].index;
+        }
+        auto conflict = [&](ValueId a, ValueId b) {
+            for (auto m : members[a])
+                for (auto n : interferes[m])
+                    if (root(n) == b) return true;
+            return false;
+        };
+        for (auto b : layout)
+            for (auto id : f.blocks[b].instrs) {
+                auto &i = f.values[id];
+                if (!slotted(id) || i.op != IrOp::Phi) continue;
+                for (auto a : i.args) {
+                    if (!slotted(a)) continue;
+                    ValueId x = root(id), y = root(a);
+                    if (x == y || (fixed[x] >= 0 && fixed[y] >= 0) || conflict(x, y)) continue;
+                    if (fixed[x] < 0) swap(x, y);
+                    parent[y] = x;
+                    members[x].insert(members[x].end(), members[y].begin(), members[y].end());
+                }
+            }
+
+        // arguments first, then in order of definition
+        slot.assign(f.values.size(), -1);
+        vector<ValueId> order;
+        for (size_t v=0;v<f.values.size();v++)
+            if (slotted(v) && root(v) == (ValueId)v) order.push_back(v);
+        stable_sort(order.begin(), order.end(), [&](ValueId a, ValueId b) { return fixed[a] > fixed[b]; });
+        for (auto c : order) {
+            int s = fixed[c];
+            if (s < 0) {
+                set<int> taken;
+                for (auto m : members[c])
+                    for (auto n : interferes[m])
+                        if (slot[root(n)] >= 0) taken.insert(slot[root(n)]);
+                s = 0;
+                while (taken.count(s)) s++;
+            }
+            if (s >= maxSlots) throw runtime_error("Too many locals in " + f.name);
+            slot[c] = s;
+        }
+    }
+
+    int slotOf(ValueId v) {
+        return slot[root(v)];
+    }
+
+    // EMISSION
+
+    void push(ValueId v) {
+        auto &i = f.values[v];
+        if (stacked[v]) return;
+        if (i.op == IrOp::Const) code << i.opcode << endl;
+        else code << "load_var " << slotOf(v) << endl;
+    }
+
+    // a .line directive where the statement changes
+    void position(int32_t l, int32_t c) {
+        if (l == 0 || (l == line && c == col)) return;
+        line = l;
+        col = c;
+        code << ".line " << l << " " << c << endl;
+    }
+
+    void emitBlock(size_t k) {
+        int b = layout[k];
+        int next = (k+1 < layout.size()) ? layout[k+1] : -1;
+        auto &block = f.blocks[b];
+        if (b != 0 || !block.preds.empty()) code << labels[b] << ":" << endl;
+        for (size_t k=0;k<block.instrs.size();k++) {
+            ValueId id = block.instrs[k];
+            auto &i = f.values[id];
+            auto pre = preloads.find({b, (int)k});
+            if (pre != preloads.end())
+                for (auto l : pre->second) push(l);
+            if (!alive(id) || i.op != IrOp::Vm) continue;
+            position(i.line, i.col);
+            // operands before the last stacked one were loaded earlier
+            size_t last = 0;
+            for (size_t j=0;j<i.args.size();j++)
+                if (stacked[i.args[j]]) last = j+1;
+            for (size_t j=last;j<i.args.size();j++) push(i.args[j]);
+            code << i.opcode << endl;
+            if (!(i.flags & IR_RESULT) || stacked[id]) continue;
+            if (uses[id] > 0) code << "store_var " << slotOf(id) << endl;
+            else code << "pop" << endl;
+        }
+        position(block.line, block.col);
+        switch (block.term) {
+            case IrTerm::Jump: {
+                int s = block.succs[0];
+                copyPhis(b, s);
+                if (s != next) code << "jump " << labels[s] << endl;
+                break;
+            }
+            case IrTerm::Branch: {
+                int t = block.succs[0], e = block.succs[1];
+                string suffix = block.intCond ? "_int " : " ";
+                push(block.value);
+                if (t == next) code << "ifnjump" << suffix << labels[e] << endl;
+                else {
+                    code << "ifjump" << suffix << labels[t] << endl;
+                    if (e != next) code << "jump " << labels[e] << endl;
+                }
+                break;
+            }
+            case IrTerm::Return:
+                if (block.value != NO_VALUE) push(block.value);
+                code << "return" << endl;
+                break;
+            case IrTerm::None:
+                throw runtime_error("Unterminated block in " + f.name);
+        }
+    }
+
+    void copyPhis(int b, int s) {
+        auto &preds = f.blocks[s].preds;
+        size_t k = find(preds.begin(), preds.end(), b) - preds.begin();
+        vector<ValueId> dests;
+        for (auto id : f.blocks[s].instrs) {
+            auto &i = f.values[id];
+            if (!slotted(id) || i.op != IrOp::Phi) continue;
+            ValueId src = i.args[k];
+            if (slotted(src) && slotOf(src) == slotOf(id)) continue;
+            push(src);
+            dests.push_back(id);
+        }
+        for (auto it = dests.rbegin(); it != dests.rend(); ++it) code << "store_var " << slotOf(*it) << endl;
+    }
+};
@@ -0,0 +1,205 @@
+#pragma once
+
+#include "IR.h"
+
+#include <algorithm>
+#include <sstream>
+
+// Optimization passes over the SSA IR, run in this order by FunctionGen :
+// unreachable blocks, copy propagation, value numbering, copy propagation
+// again for the values it replaced, then dead code.
+
+// blocks after a return, phis lose the operands coming from them
+inline void removeUnreachable(IrFunction &f) {
+    vector<bool> reached(f.blocks.size(), false);
+    vector<int> work = {0};
+    reached[0] = true;
+    while (!work.empty()) {
+        int b = work.back();
+        work.pop_back();
+        for (auto s : f.blocks[b].succs)
+            if (!reached[s]) {
+                reached[s] = true;
+                work.push_back(s);
+            }
+    }
+    for (size_t b=0;b<f.blocks.size();b++) {
+        auto &block = f.blocks[b];
+        if (!reached[b]) {
+            block.removed = true;
+            for (auto id : block.instrs) f.values[id].dead = true;
+            continue;
+        }
+        for (int k=block.preds.size()-1;k>=0;k--) {
+            if (reached[block.preds[k]]) continue;
+            block.preds.erase(block.preds.begin()+k);
+            for (auto id : block.instrs)
+                if (f.values[id].op == IrOp::Phi) f.values[id].args.erase(f.values[id].args.begin()+k);
+        }
+    }
+}
+
+// Assignments of a local to another never made copies, what remains are
+// phis merging a single value and values replaced by numbering. Operands
+// are rewritten to the values they stand for.
+inline void propagateCopies(IrFunction &f) {
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (size_t id=0;id<f.values.size();id++) {
+            auto &i = f.values[id];
+            if (i.dead || i.op != IrOp::Phi) continue;
+            ValueId same = NO_VALUE;
+            bool trivial = true;
+            for (auto a : i.args) {
+                a = f.resolve(a);
+                if (a == same || a == (ValueId)id) continue;
+                if (same != NO_VALUE) trivial = false;
+                same = a;
+            }
+            if (!trivial || same == NO_VALUE) continue;
+            i.replacedBy = same;
+            i.dead = true;
+            changed = true;
+        }
+    }
+    for (auto &i : f.values)
+        for (auto &a : i.args) a = f.resolve(a);
+    for (auto &b : f.blocks) b.value = f.resolve(b.value);
+}
+
+// DOMINATORS
+// "A Simple, Fast Dominance Algorithm", Cooper, Harvey and Kennedy
+
+inline vector<int> reversePostorder(const IrFunction &f) {
+    vector<int> order;
+    vector<bool> seen(f.blocks.size(), false);
+    // iterative dfs, (block, next successor)
+    vector<pair<int, size_t>> stack = {{0, 0}};
+    seen[0] = true;
+    while (!stack.empty()) {
+        auto &top = stack.back();
+        auto &succs = f.blocks[top.first].succs;
+        if (top.second < succs.size()) {
+            int s = succs[top.second++];
+            if (!seen[s]) {
+                seen[s] = true;
+                stack.push_back({s, 0});
+            }
+        } else {
+            order.push_back(top.first);
+            stack.pop_back();
+        }
+    }
+    reverse(order.begin(), order.end());
+    return order;
+}
+
+inline vector<int> dominators(const IrFunction &f, const vector<int> &rpo) {
+    vector<int> number(f.blocks.size(), -1);
+    for (size_t k=0;k<rpo.size();k++) number[rpo[k]] = k;
+    vector<int> idom(f.blocks.size(), -1);
+    idom[0] = 0;
+    auto intersect = [&](int a, int b) {
+        while (a != b) {
+            while (number[a] > number[b]) a = idom[a];
+            while (number[b] > number[a]) b = idom[b];
+        }
+        return a;
+    };
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (size_t k=1;k<rpo.size();k++) {
+            int b = rpo[k];
+            int dom = -1;
+            for (auto p : f.blocks[b].preds) {
+                if (idom[p] < 0) continue;
+                dom = (dom < 0) ? p : intersect(p, dom);
+            }
+            if (idom[b] != dom) {
+                idom[b] = dom;
+                changed = true;
+            }
+        }
+    }
+    return idom;
+}
+
+// GLOBAL VALUE NUMBERING
+// Walks the dominator tree with a scoped table : a pure instruction, a
+// constant or a phi equal to one in a dominating position is replaced by it.
+
+class ValueNumbering {
+public:
+    ValueNumbering(IrFunction &f) : f(f) {}
+
+    void run() {
+        auto rpo = reversePostorder(f);
+        auto idom = dominators(f, rpo);
+        children.assign(f.blocks.size(), {});
+        for (auto b : rpo)
+            if (b != 0) children[idom[b]].push_back(b);
+        number(0);
+    }
+
+private:
+    IrFunction &f;
+    vector<vector<int>> children;
+    map<string, ValueId> table;
+
+    void number(int b) {
+        vector<string> added;
+        for (auto id : f.blocks[b].instrs) {
+            auto &i = f.values[id];
+            if (i.dead) continue;
+            bool numbered = i.op == IrOp::Const || i.op == IrOp::Phi
+                || (i.op == IrOp::Vm && (i.flags & IR_PURE) && (i.flags & IR_RESULT));
+            if (!numbered) continue;
+            stringstream key;
+            key << i.opcode;
+            if (i.op == IrOp::Phi) key << " b" << b;
+            for (auto a : i.args) key << " " << f.resolve(a);
+            auto it = table.find(key.str());
+            if (it != table.end()) {
+                i.replacedBy = it->second;
+                i.dead = true;
+            } else {
+                table[key.str()] = id;
+                added.push_back(key.str());
+            }
+        }
+        for (auto c : children[b]) number(c);
+        for (auto &k : added) table.erase(k);
+    }
+};
+
+// DEAD CODE
+// Everything that isn't removable is kept with the values it uses, the
+// rest goes. Stores to locals need no pass of their own : a value nothing
+// reads is never stored to a slot.
+inline void eliminateDead(IrFunction &f) {
+    vector<bool> live(f.values.size(), false);
+    vector<ValueId> work;
+    auto mark = [&](ValueId v) {
+        v = f.resolve(v);
+        if (v == NO_VALUE || live[v]) return;
+        live[v] = true;
+        work.push_back(v);
+    };
+    for (auto &b : f.blocks) {
+        if (b.removed) continue;
+        for (auto id : b.instrs) {
+            auto &i = f.values[id];
+            if (!i.dead && i.op == IrOp::Vm && !(i.flags & IR_REMOVABLE)) mark(id);
+        }
+        if (b.term == IrTerm::Branch || b.term == IrTerm::Return) mark(b.value);
+    }
+    while (!work.empty()) {
+        ValueId v = work.back();
+        work.pop_back();
+        for (auto a : f.values[v].args) mark(a);
+    }
+    for (size_t id=0;id<f.values.size();id++)
+        if (!live[id]) f.values[id].dead = true;
+}
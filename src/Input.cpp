@@ -0,0 +1,252 @@
+#include "VirtualMachine.h"
+
+#include <stdexcept>
+#include <cmath>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+
+// from VirtualMachine.cpp
+DWORD makeValue(Type t, WORD d);
+WORD asint(float a);
+PTR asPtr(int32_t a);
+tuple<Type, int32_t> extract(DWORD a);
+
+// Input builtins :
+//   input_open(path)      -> handle
+//   input_close(h)
+//   input_line(h)         -> 1 and moves to the next line, 0 at the end
+//   line_bytes(h)         -> the current line as a list of bytes
+//   line_text(h)          -> the current line as a string
+//   line_int(h, i)        -> the i-th number of the current line
+//   line_float(h, i)
+//   line_ints(h)          -> the numbers of the current line as a list
+//   line_floats(h)
+//   input_ints(h, n)      -> the next n numbers, fewer at the end, across lines
+//   input_ints(h, l)      -> len(l) numbers read into l, a new shorter list at the end
+//   input_floats(h, n|l)
+// Numbers are separated by anything that can't start one. Lists aren't
+// freed when a variable is assigned again, so a loop over a large input
+// refills one list or reads single numbers.
+
+VirtualMachine::InputMap::~InputMap() {
+    if (data) munmap((void*)data, size);
+}
+
+static bool isDigit(char c) { return c >= '0' && c <= '9'; }
+
+static bool startsNumber(const char *s, const char *end, bool floats) {
+    if (*s == '-' || *s == '+') s++;
+    if (s == end) return false;
+    if (isDigit(*s)) return true;
+    return floats && *s == '.' && s+1 < end && isDigit(s[1]);
+}
+
+static const char *parseInt(const char *s, const char *end, WORD &out) {
+    bool neg = *s == '-';
+    if (*s == '-' || *s == '+') s++;
+    uint32_t v = 0;
+    for (; s < end && isDigit(*s); s++) v = v*10 + (*s-'0');
+    out = neg ? -v : v;
+    return s;
+}
+
+// decimal mantissa and exponent, rounded once to double then to float
+static const char *parseFloat(const char *s, const char *end, WORD &out) {
+    bool neg = *s == '-';
+    if (*s == '-' || *s == '+') s++;
+    const uint64_t MAX_MANTISSA = 100000000000000000ull;
+    uint64_t mantissa = 0;
+    int exp = 0;
+    for (; s < end && isDigit(*s); s++) {
+        if (mantissa < MAX_MANTISSA) mantissa = mantissa*10 + (*s-'0');
+        else exp++;
+    }
+    if (s < end && *s == '.') {
+        for (s++; s < end && isDigit(*s); s++) {
+            if (mantissa < MAX_MANTISSA) {
+                mantissa = mantissa*10 + (*s-'0');
+                exp--;
+            }
+        }
+    }
+    if (s+1 < end && (*s == 'e' || *s == 'E')) {
+        const char *e = s+1;
+        bool negExp = *e == '-';
+        if (*e == '-' || *e == '+') e++;
+        if (e < end && isDigit(*e)) {
+            int x = 0;
+            for (; e < end && isDigit(*e); e++) if (x < 1000) x = x*10 + (*e-'0');
+            exp += negExp ? -x : x;
+            s = e;
+        }
+    }
+    double v = mantissa;
+    if (exp > 0) v *= pow(10.0, exp);
+    else if (exp < 0) v /= pow(10.0, -exp);
+    out = asint(neg ? -v : v);
+    return s;
+}
+
+// reads at most max numbers from [s, e) into out, or skips them if out is
+// null, returns where it stopped
+static const char *parseNumbers(const char *s, const char *e, bool floats, WORD *out, size_t max, size_t &count) {
+    count = 0;
+    while (count < max) {
+        while (s < e && !startsNumber(s, e, floats)) s++;
+        if (s == e) break;
+        WORD v;
+        s = floats ? parseFloat(s, e, v) : parseInt(s, e, v);
+        if (out) out[count] = v;
+        count++;
+    }
+    return s;
+}
+
+// a pass over a large input doesn't keep all of it resident, pages read
+// again later are faulted back in from the file
+void VirtualMachine::input_release(Input &in, size_t pos) {
+    static const size_t page = sysconf(_SC_PAGESIZE);
+    pos -= pos % page;
+    if (pos < in.released + INPUT_RELEASE_BYTES) return;
+    madvise((void*)(in.map->data + in.released), pos - in.released, MADV_DONTNEED);
+    in.released = pos;
+}
+
+VirtualMachine::Input &VirtualMachine::input_handle(DWORD h) {
+    Type t; int32_t d;
+    tie(t,d) = extract(h);
+    if (t != Int || d < 0 || d >= (int)inputs.size() || !inputs[d].map) throw runtime_error("Invalid input handle");
+    return inputs[d];
+}
+
+void VirtualMachine::input_open() {
+    Type t; int32_t d;
+    tie(t,d) = extract(popOpStack());
+    if (t != String) throw runtime_error("input_open expects a path");
+    string path = string_value(asPtr(d));
+
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) throw runtime_error("Can't open input " + path);
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        throw runtime_error("Can't open input " + path);
+    }
+    shared_ptr<InputMap> map(new InputMap());
+    // an empty file can't be mapped, it has no lines anyway
+    if (st.st_size > 0) {
+        void *m = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (m == MAP_FAILED) {
+            close(fd);
+            throw runtime_error("Can't map input " + path);
+        }
+        // read front to back : read ahead, and pages behind can be dropped early
+        madvise(m, st.st_size, MADV_SEQUENTIAL);
+        map->data = (const char*)m;
+        map->size = st.st_size;
+    }
+    close(fd);
+
+    Input in;
+    in.map = map;
+    inputs.push_back(in);
+    pushOpStack(makeValue(Int, inputs.size()-1));
+}
+
+void VirtualMachine::input_close() {
+    input_handle(popOpStack()).map = nullptr;
+}
+
+void VirtualMachine::input_line() {
+    Input &in = input_handle(popOpStack());
+    if (in.pos >= in.map->size) {
+        in.lineBegin = in.lineEnd = in.pos;
+        pushOpStack(makeValue(Int, 0));
+        return;
+    }
+    const char *data = in.map->data;
+    auto nl = (const char*)memchr(data + in.pos, '\n', in.map->size - in.pos);
+    in.lineBegin = in.pos;
+    in.lineEnd = nl ? nl - data : in.map->size;
+    in.pos = nl ? in.lineEnd + 1 : in.lineEnd;
+    if (in.lineEnd > in.lineBegin && data[in.lineEnd-1] == '\r') in.lineEnd--;
+    input_release(in, in.lineBegin);
+    pushOpStack(makeValue(Int, 1));
+}
+
+void VirtualMachine::line_bytes() {
+    Input &in = input_handle(popOpStack());
+    size_t n = in.lineEnd - in.lineBegin;
+    auto bytes = (const unsigned char*)in.map->data + in.lineBegin;
+    auto addr = list_alloc(n, Int);
+    for (size_t i=0;i<n;i++) memory[addr+2+i] = bytes[i];
+    pushOpStack(makeValue(List, addr));
+}
+
+// interned like every string, so it stays in the heap : lines that don't
+// repeat are better read with line_bytes or parsed
+void VirtualMachine::line_text() {
+    Input &in = input_handle(popOpStack());
+    string s(in.map->data + in.lineBegin, in.lineEnd - in.lineBegin);
+    pushOpStack(makeValue(String, string_intern(s)));
+}
+
+void VirtualMachine::line_number(bool floats) {
+    Input &in = input_handle(popOpStack());
+    Type t; int32_t i;
+    tie(t,i) = extract(popOpStack());
+    if (t != Int || i < 0) throw runtime_error("Invalid number index");
+    const char *s = in.map->data + in.lineBegin, *e = in.map->data + in.lineEnd;
+    size_t count;
+    s = parseNumbers(s, e, floats, nullptr, i, count);
+    WORD v;
+    parseNumbers(s, e, floats, &v, 1, count);
+    if (count == 0) throw runtime_error("Line has no number " + to_string(i));
+    pushOpStack(makeValue(floats ? Float : Int, v));
+}
+
+void VirtualMachine::line_numbers(bool floats) {
+    Input &in = input_handle(popOpStack());
+    const char *s = in.map->data + in.lineBegin, *e = in.map->data + in.lineEnd;
+    size_t count;
+    parseNumbers(s, e, floats, nullptr, SIZE_MAX, count);
+    auto addr = list_alloc(count, floats ? Float : Int);
+    parseNumbers(s, e, floats, &memory[addr+2], count, count);
+    pushOpStack(makeValue(List, addr));
+}
+
+void VirtualMachine::input_numbers(bool floats) {
+    Input &in = input_handle(popOpStack());
+    Type t; int32_t d;
+    tie(t,d) = extract(popOpStack());
+    Type type = floats ? Float : Int;
+    const char *data = in.map->data;
+    size_t count;
+    if (t == Int && d >= 0) {
+        PTR p = list_alloc(d, type);
+        in.pos = parseNumbers(data + in.pos, data + in.map->size, floats, &memory[p+2], d, count) - data;
+        memory[p] = count;
+        input_release(in, in.pos);
+        pushOpStack(makeValue(List, p));
+        return;
+    }
+    if (t != List) throw runtime_error("Expected a count or a list to read numbers into");
+    PTR p = list_resolve(asPtr(d));
+    if (Type(memory[p+1]) != type) throw runtime_error(string("Can't read ") + (floats ? "floats" : "ints") + " into this list");
+
+    // lists never change length, the compiler relies on it : a list is only
+    // refilled when there are enough numbers left, the rest comes in a new one
+    numberBuffer.resize(memory[p]);
+    in.pos = parseNumbers(data + in.pos, data + in.map->size, floats, numberBuffer.data(), memory[p], count) - data;
+    input_release(in, in.pos);
+    if (count < memory[p]) {
+        p = list_alloc(count, type);
+        d = p;
+    }
+    if (count) memcpy(&memory[p+2], numberBuffer.data(), count*sizeof(WORD));
+    pushOpStack(makeValue(List, d));
+}
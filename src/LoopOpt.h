@@ -0,0 +1,232 @@
+#pragma once
+
+#include "AST.h"
+#include "TypeInference.h"
+
+#include <set>
+
+// Loop optimizations over one function, applied by FunctionGen :
+// - Invariant code motion : len() of a proven list and arithmetic on proven
+//   ints or floats are computed once before the outermost loop they are
+//   invariant in. Lists never change length, and these never fail, so they
+//   can run even when the loop doesn't. len() of anything else stays put.
+// - Bounds check elimination : in `while i < len(x)`, x[i] is known to be
+//   in range until i changes, when x is a list and i counts up from a
+//   non-negative literal by small steps.
+class LoopOpt {
+public:
+    LoopOpt(const Ast &ast, const TypeInference &types) : ast(ast), types(types) {}
+
+    void run(const Function &f) {
+        if (f.body != NO_NODE) stat(f.body, NO_NODE, 0);
+    }
+
+    // expressions computed before each loop
+    map<NodeId, vector<NodeId>> hoisted;
+    // list accesses, reads or store targets, that need no checks
+    set<NodeId> unchecked;
+
+private:
+    const Ast &ast;
+    const TypeInference &types;
+    set<NodeId> hoistedNodes;
+
+    const int MAX_INDEX_STEP = 1 << 16;
+
+    void stat(NodeId id, NodeId block, int pos) {
+        if (id == NO_NODE) return;
+        const Node &n = ast[id];
+        if (n.kind == NodeKind::BlockStat) {
+            for (int i=0;i<n.count;i++) stat(ast.child(n, i), id, i);
+            return;
+        }
+        if (n.kind == NodeKind::WhileStat) {
+            set<string> assigned;
+            scanAssigned(id, assigned);
+            hoist(id, n.a, assigned);
+            hoist(id, n.b, assigned);
+            eliminateChecks(n, block, pos, assigned);
+            stat(n.b, NO_NODE, 0);
+            return;
+        }
+        if (n.kind == NodeKind::IfStat) {
+            stat(n.b, NO_NODE, 0);
+            stat(n.c, NO_NODE, 0);
+        }
+    }
+
+    // INVARIANT CODE MOTION
+
+    void hoist(NodeId loop, NodeId id, const set<string> &assigned) {
+        if (id == NO_NODE || hoistedNodes.count(id)) return;
+        const Node &n = ast[id];
+        if (n.kind == NodeKind::FuncCallExp && isInvariant(id, assigned)) {
+            hoisted[loop].push_back(id);
+            hoistedNodes.insert(id);
+            return;
+        }
+        if (n.kind == NodeKind::IdExp || n.kind == NodeKind::IntExp
+            || n.kind == NodeKind::FloatExp || n.kind == NodeKind::StringExp) return;
+        hoist(loop, n.a, assigned);
+        hoist(loop, n.b, assigned);
+        hoist(loop, n.c, assigned);
+        for (int i=0;i<n.count;i++) hoist(loop, ast.child(n, i), assigned);
+    }
+
+    bool isInvariant(NodeId id, const set<string> &assigned) {
+        const Node &n = ast[id];
+        StaticType t = types.type(id);
+        switch (n.kind) {
+            case NodeKind::IntExp:
+            case NodeKind::FloatExp:
+                return true;
+            case NodeKind::IdExp:
+                return !assigned.count(ast.str(id)) && t != StaticType::Undef && t != StaticType::Any;
+            case NodeKind::FuncCallExp: {
+                if (ast.kind(n.a) != NodeKind::IdExp || types.isLocal(ast.str(n.a))) return false;
+                auto &name = ast.str(n.a);
+                if (name == "len" && n.count == 1) {
+                    NodeId x = ast.child(n, 0);
+                    if (ast.kind(x) != NodeKind::IdExp || assigned.count(ast.str(x))) return false;
+                    return isList(types.type(x));
+                }
+                // % traps on zero, it can't be moved where it may not have run
+                bool arith = name == "+" || name == "-" || name == "*" || name == "/";
+                if (!arith || (t != StaticType::Int && t != StaticType::Float)) return false;
+                for (int i=0;i<n.count;i++)
+                    if (!isInvariant(ast.child(n, i), assigned)) return false;
+                return true;
+            }
+            default:
+                return false;
+        }
+    }
+
+    // locals rebound, storing into an element doesn't rebind the list
+    void scanAssigned(NodeId id, set<string> &assigned) {
+        if (id == NO_NODE) return;
+        const Node &n = ast[id];
+        if (n.kind == NodeKind::LexpId) assigned.insert(ast.str(id));
+        if (n.kind == NodeKind::LexpIndex) {
+            if (ast.kind(n.a) != NodeKind::LexpId) scanAssigned(n.a, assigned);
+            scanAssigned(n.b, assigned);
+            return;
+        }
+        if (n.kind == NodeKind::IdExp || n.kind == NodeKind::IntExp
+            || n.kind == NodeKind::FloatExp || n.kind == NodeKind::StringExp) return;
+        scanAssigned(n.a, assigned);
+        scanAssigned(n.b, assigned);
+        scanAssigned(n.c, assigned);
+        for (int i=0;i<n.count;i++) scanAssigned(ast.child(n, i), assigned);
+    }
+
+    // BOUNDS CHECK ELIMINATION
+
+    void eliminateChecks(const Node &loop, NodeId block, int pos, const set<string> &assigned) {
+        string i, x;
+        if (!boundedBy(loop.a, i, x) || assigned.count(x)) return;
+        if (!countsUp(loop.b, i) || !startsNonNegative(block, pos, i)) return;
+
+        // accesses before the first statement that changes i
+        vector<NodeId> body;
+        if (ast.kind(loop.b) == NodeKind::BlockStat)
+            for (int k=0;k<ast[loop.b].count;k++) body.push_back(ast.child(ast[loop.b], k));
+        else body.push_back(loop.b);
+        for (auto s : body) {
+            set<string> changed;
+            scanAssigned(s, changed);
+            if (!changed.count(i)) {
+                findAccesses(s, i, x);
+                continue;
+            }
+            const Node &n = ast[s];
+            if (n.kind == NodeKind::AssignStat && ast.kind(n.a) == NodeKind::LexpId)
+                findAccesses(n.b, i, x);
+            break;
+        }
+    }
+
+    // i < len(x) or len(x) > i
+    bool boundedBy(NodeId cond, string &i, string &x) {
+        const Node &n = ast[cond];
+        if (n.kind != NodeKind::FuncCallExp || n.count != 2 || ast.kind(n.a) != NodeKind::IdExp) return false;
+        auto &op = ast.str(n.a);
+        if (types.isLocal(op)) return false;
+        NodeId index, length;
+        if (op == "<") {
+            index = ast.child(n, 0);
+            length = ast.child(n, 1);
+        } else if (op == ">") {
+            index = ast.child(n, 1);
+            length = ast.child(n, 0);
+        } else return false;
+        const Node &l = ast[length];
+        if (ast.kind(index) != NodeKind::IdExp || l.kind != NodeKind::FuncCallExp || l.count != 1
+            || ast.kind(l.a) != NodeKind::IdExp || ast.str(l.a) != "len" || types.isLocal("len")) return false;
+        NodeId list = ast.child(l, 0);
+        if (ast.kind(list) != NodeKind::IdExp || !isList(types.type(list))) return false;
+        i = ast.str(index);
+        x = ast.str(list);
+        return true;
+    }
+
+    // every assignment of i in the loop is i = i + k, 0 <= k <= MAX_INDEX_STEP
+    bool countsUp(NodeId id, const string &i) {
+        if (id == NO_NODE) return true;
+        const Node &n = ast[id];
+        if (n.kind == NodeKind::MultiAssignStat) {
+            for (int k=0;k<n.count;k++) {
+                NodeId left = ast.child(n, k);
+                if (ast.kind(left) == NodeKind::LexpId && ast.str(left) == i) return false;
+            }
+        }
+        if (n.kind == NodeKind::AssignStat && ast.kind(n.a) == NodeKind::LexpId && ast.str(n.a) == i) {
+            const Node &e = ast[n.b];
+            if (e.kind != NodeKind::FuncCallExp || e.count != 2 || ast.kind(e.a) != NodeKind::IdExp
+                || ast.str(e.a) != "+" || types.isLocal("+")) return false;
+            NodeId l = ast.child(e, 0), r = ast.child(e, 1);
+            if (ast.kind(l) == NodeKind::IntExp) swap(l, r);
+            if (ast.kind(l) != NodeKind::IdExp || ast.str(l) != i || ast.kind(r) != NodeKind::IntExp) return false;
+            int step = ast[r].ival;
+            return step >= 0 && step <= MAX_INDEX_STEP;
+        }
+        if (n.kind == NodeKind::IdExp || n.kind == NodeKind::IntExp
+            || n.kind == NodeKind::FloatExp || n.kind == NodeKind::StringExp) return true;
+        if (!countsUp(n.a, i) || !countsUp(n.b, i) || !countsUp(n.c, i)) return false;
+        for (int k=0;k<n.count;k++)
+            if (!countsUp(ast.child(n, k), i)) return false;
+        return true;
+    }
+
+    // the last statement before the loop that assigns i sets it to a literal >= 0
+    bool startsNonNegative(NodeId block, int pos, const string &i) {
+        if (block == NO_NODE) return false;
+        const Node &b = ast[block];
+        for (int k=pos-1;k>=0;k--) {
+            NodeId s = ast.child(b, k);
+            set<string> changed;
+            scanAssigned(s, changed);
+            if (!changed.count(i)) continue;
+            const Node &n = ast[s];
+            return n.kind == NodeKind::AssignStat && ast.kind(n.a) == NodeKind::LexpId
+                && ast.kind(n.b) == NodeKind::IntExp && ast[n.b].ival >= 0;
+        }
+        return false;
+    }
+
+    void findAccesses(NodeId id, const string &i, const string &x) {
+        if (id == NO_NODE) return;
+        const Node &n = ast[id];
+        if (n.kind == NodeKind::IdExp || n.kind == NodeKind::IntExp
+            || n.kind == NodeKind::FloatExp || n.kind == NodeKind::StringExp) return;
+        if ((n.kind == NodeKind::IndexExp || n.kind == NodeKind::LexpIndex)
+            && ast.kind(n.b) == NodeKind::IdExp && ast.str(n.b) == i
+            && (ast.kind(n.a) == NodeKind::IdExp || ast.kind(n.a) == NodeKind::LexpId)
+            && ast.str(n.a) == x && isList(types.type(n.a)))
+            unchecked.insert(id);
+        findAccesses(n.a, i, x);
+        findAccesses(n.b, i, x);
+        findAccesses(n.c, i, x);
+        for (int k=0;k<n.count;k++) findAccesses(ast.child(n, k), i, x);
+    }
+};
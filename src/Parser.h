@@ -0,0 +1,434 @@
+#pragma once
+
+#include "AST.h"
+#include <stdexcept>
+#include <cstring>
+
+// Hand-written front end for Norbert.g4, building the same AST as ASTGen
+// without going through the antlr runtime. The grammar stays the reference :
+// `make conformance` diffs both front ends over the example corpus.
+
+enum class TokenKind {
+    End, Id, Int, Hex, Float, String, Sym, Other
+};
+
+struct Token {
+    TokenKind kind;
+    int start, len;
+    int line, col;
+};
+
+class Lexer {
+public:
+    Lexer(const string &src) : src(src) {}
+
+    vector<Token> tokens() {
+        vector<Token> l;
+        int line = 1, lineStart = 0;
+        size_t i = 0, n = src.size();
+        while (true) {
+            // SPACE and COMMENT are skipped
+            while (i < n) {
+                char c = src[i];
+                if (c == '\n') { line++; lineStart = i+1; i++; }
+                else if (c == ' ' || c == '\t' || c == '\r') i++;
+                else if (c == '/' && i+1 < n && src[i+1] == '/') {
+                    while (i < n && src[i] != '\r' && src[i] != '\n') i++;
+                }
+                else break;
+            }
+            Token t{TokenKind::End, (int)i, 0, line, (int)i-lineStart};
+            if (i >= n) { l.push_back(t); break; }
+
+            char c = src[i];
+            size_t j = i;
+            if (isIdStart(c)) {
+                while (j < n && isIdChar(src[j])) j++;
+                t.kind = isKeyword(i, j-i) ? TokenKind::Sym : TokenKind::Id;
+                // 'function ' includes its space and so beats ID on length
+                if (j-i == 8 && j < n && src[j] == ' ' && src.compare(i, 8, "function") == 0) {
+                    t.kind = TokenKind::Sym;
+                    j++;
+                }
+            } else if (isDigit(c) || (c == '.' && i+1 < n && isDigit(src[i+1]))) {
+                if (c == '0' && i+2 < n && (src[i+1] == 'x' || src[i+1] == 'X') && isHexDigit(src[i+2])) {
+                    j = i+2;
+                    while (j < n && isHexDigit(src[j])) j++;
+                    t.kind = TokenKind::Hex;
+                } else {
+                    while (j < n && isDigit(src[j])) j++;
+                    t.kind = TokenKind::Int;
+                    if (j < n && src[j] == '.') {
+                        j++;
+                        while (j < n && isDigit(src[j])) j++;
+                        t.kind = TokenKind::Float;
+                    }
+                }
+            } else if (c == '"' || c == '\'') {
+                j = src.find(c, i+1);
+                if (j == string::npos) {
+                    j = i+1;
+                    t.kind = TokenKind::Other;
+                } else {
+                    j++;
+                    t.kind = TokenKind::String;
+                }
+            } else {
+                static const char *syms[] = {
+                    "<=", ">=", "==", "!=",
+                    "(", ")", "[", "]", "{", "}", ",", ":", "=",
+                    "-", "+", "*", "/", "%", "<", ">",
+                };
+                t.kind = TokenKind::Other;
+                j = i+1;
+                for (auto s : syms) {
+                    size_t len = strlen(s);
+                    if (src.compare(i, len, s) == 0) {
+                        t.kind = TokenKind::Sym;
+                        j = i+len;
+                        break;
+                    }
+                }
+            }
+            t.len = j-i;
+            l.push_back(t);
+            for (size_t k=i;k<j;k++) {
+                if (src[k] == '\n') { line++; lineStart = k+1; }
+            }
+            i = j;
+        }
+        return l;
+    }
+
+private:
+    const string &src;
+
+    static bool isDigit(char c) { return c >= '0' && c <= '9'; }
+    static bool isHexDigit(char c) { return isDigit(c) || (c >= 'a' && c <= 'f') || (c >= 'A' && c <= 'F'); }
+    static bool isIdStart(char c) { return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_'; }
+    static bool isIdChar(char c) { return isIdStart(c) || isDigit(c); }
+
+    bool isKeyword(size_t start, size_t len) {
+        static const char *keywords[] = {
+            "true", "false", "while", "if", "elseif", "else", "return", "not", "and", "or",
+        };
+        for (auto k : keywords) {
+            if (strlen(k) == len && src.compare(start, len, k) == 0) return true;
+        }
+        return false;
+    }
+};
+
+class Parser {
+public:
+    Parser(const string &src) : src(src), toks(Lexer(src).tokens()) {
+        ast.nodes.reserve(toks.size());
+        ast.children.reserve(toks.size()/2);
+    }
+
+    File parse() {
+        File f;
+        while (peek().kind != TokenKind::End) f.functions.insert(function());
+        f.ast = move(ast);
+        return f;
+    }
+
+private:
+    const string &src;
+    vector<Token> toks;
+    size_t pos = 0;
+    Ast ast;
+    // (exp) yields the inner node, but lexp and funccallstat must not look through it
+    vector<bool> parens;
+
+    enum Prec {
+        Lowest, Ternary, Or, And, Comparison, Relation, Additive, Multiplicative, Unary
+    };
+
+    // position to backtrack to, nodes built since are dropped
+    struct Mark {
+        size_t pos, nodes, children;
+    };
+
+    Mark mark() { return {pos, ast.nodes.size(), ast.children.size()}; }
+
+    void reset(Mark m) {
+        pos = m.pos;
+        ast.nodes.resize(m.nodes);
+        ast.children.resize(m.children);
+        if (parens.size() > m.nodes) parens.resize(m.nodes);
+    }
+
+    bool isParen(NodeId id) { return (size_t)id < parens.size() && parens[id]; }
+
+    const Token &peek() { return toks[pos]; }
+
+    string text(const Token &t) { return src.substr(t.start, t.len); }
+
+    bool is(const char *s) {
+        const Token &t = peek();
+        return t.kind == TokenKind::Sym && (size_t)t.len == strlen(s) && src.compare(t.start, t.len, s) == 0;
+    }
+
+    bool accept(const char *s) {
+        if (!is(s)) return false;
+        pos++;
+        return true;
+    }
+
+    [[noreturn]] void error(string msg) {
+        const Token &t = peek();
+        string found = (t.kind == TokenKind::End) ? "<EOF>" : text(t);
+        throw runtime_error(
+            to_string(t.line) + ":" + to_string(t.col) + " " + msg + " at '" + found + "'");
+    }
+
+    void expect(const char *s) {
+        if (!accept(s)) error(string("expected '") + s + "'");
+    }
+
+    string ident() {
+        if (peek().kind != TokenKind::Id) error("expected identifier");
+        return text(toks[pos++]);
+    }
+
+    pair<string, Function> function() {
+        const Token &t = peek();
+        expect("function ");
+        string name = ident();
+        vector<string> args;
+        expect("(");
+        if (!is(")")) {
+            do args.push_back(ident()); while (accept(","));
+        }
+        expect(")");
+        Function f{args, NO_NODE, NO_NODE};
+        if (accept("=")) f.e = exp();
+        else f.body = stat();
+        f.line = t.line;
+        f.col = t.col;
+        return make_pair(name, f);
+    }
+
+    NodeId stat() {
+        const Token &t = peek();
+        return ast.at(statement(), t.line, t.col);
+    }
+
+    NodeId statement() {
+        if (accept("while")) {
+            NodeId cond = exp();
+            return ast.add(NodeKind::WhileStat, cond, stat());
+        }
+        if (accept("if")) return ifRest();
+        if (accept("{")) {
+            vector<NodeId> l;
+            while (!accept("}")) l.push_back(stat());
+            return ast.add(NodeKind::BlockStat, l);
+        }
+        if (accept("return")) {
+            if (!startsExp()) return ast.add(NodeKind::ReturnStat);
+            // the expression is optional, so it may be the start of the next statement
+            Mark m = mark();
+            NodeId e = exp();
+            if (is("=") || is(",")) {
+                reset(m);
+                return ast.add(NodeKind::ReturnStat);
+            }
+            return ast.add(NodeKind::ReturnStat, e);
+        }
+
+        NodeId e = exp();
+        if (is("=") || is(",")) {
+            vector<NodeId> l = {lexp(e)};
+            while (accept(",")) l.push_back(lexp(exp()));
+            expect("=");
+            NodeId right = exp();
+            if (l.size() == 1) return ast.add(NodeKind::AssignStat, l[0], right);
+            return ast.add(NodeKind::MultiAssignStat, l, NO_NODE, right);
+        }
+        return callStat(e);
+    }
+
+    // an elseif is placed at its condition
+    NodeId ifRest() {
+        const Token &t = peek();
+        NodeId cond = exp();
+        NodeId then = stat();
+        NodeId els = NO_NODE;
+        if (accept("elseif")) els = ifRest();
+        else if (accept("else")) els = stat();
+        return ast.at(ast.add(NodeKind::IfStat, cond, then, els), t.line, t.col);
+    }
+
+    // IdExp and IndexExp chains are retagged in place
+    NodeId lexp(NodeId e) {
+        if (!isParen(e)) {
+            Node &n = ast[e];
+            if (n.kind == NodeKind::IdExp) {
+                n.kind = NodeKind::LexpId;
+                return e;
+            }
+            if (n.kind == NodeKind::IndexExp) {
+                lexp(n.a);
+                ast[e].kind = NodeKind::LexpIndex;
+                return e;
+            }
+        }
+        error("invalid assignment target");
+    }
+
+    // exp '(' explist? ')' : the call is the rightmost postfix of the
+    // expression, so `a + f(x)` calls `a + f`
+    NodeId callStat(NodeId e) {
+        NodeId root = e;
+        NodeId *slot = &root;
+        while (!isParen(*slot)) {
+            Node &n = ast[*slot];
+            if (n.kind == NodeKind::TernaryExp) {
+                slot = &n.c;
+                continue;
+            }
+            if (n.kind != NodeKind::FuncCallExp) break;
+            if (isOperator(n)) {
+                slot = &ast.children[n.first+n.count-1];
+                continue;
+            }
+            NodeId call = *slot;
+            *slot = n.a;
+            ast[call].kind = NodeKind::FuncCallStat;
+            ast[call].a = root;
+            return call;
+        }
+        error("expected statement");
+    }
+
+    bool isOperator(const Node &call) {
+        if (ast.kind(call.a) != NodeKind::IdExp) return false;
+        const string &name = ast.str(call.a);
+        char c = name[0];
+        return !(c == '_' || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z'))
+            || name == "not" || name == "and" || name == "or";
+    }
+
+    bool startsExp() {
+        TokenKind k = peek().kind;
+        if (k == TokenKind::Id || k == TokenKind::Int || k == TokenKind::Hex || k == TokenKind::Float || k == TokenKind::String)
+            return true;
+        return is("true") || is("false") || is("[") || is("{") || is("(") || is("-") || is("not");
+    }
+
+    int binaryPrec() {
+        const Token &t = peek();
+        if (t.kind != TokenKind::Sym) return -1;
+        if (is("or")) return Or;
+        if (is("and")) return And;
+        if (is("==") || is("!=")) return Comparison;
+        if (is("<=") || is("<") || is(">") || is(">=")) return Relation;
+        if (is("+") || is("-")) return Additive;
+        if (is("*") || is("/") || is("%")) return Multiplicative;
+        return -1;
+    }
+
+    NodeId exp(int minPrec = Lowest) {
+        NodeId left = primary();
+        while (true) {
+            if (accept("[")) {
+                left = ast.add(NodeKind::IndexExp, left, exp());
+                expect("]");
+            } else if (accept("(")) {
+                left = ast.add(NodeKind::FuncCallExp, explist(")"), left);
+                expect(")");
+            } else if (is("if") && minPrec <= Ternary) {
+                // exp 'if' exp 'else' exp, unless this 'if' starts a statement
+                Mark m = mark();
+                pos++;
+                NodeId cond;
+                try {
+                    cond = exp();
+                } catch (runtime_error &) {
+                    cond = NO_NODE;
+                }
+                if (cond == NO_NODE || !accept("else")) {
+                    reset(m);
+                    return left;
+                }
+                NodeId els = exp(Ternary+1);
+                left = ast.add(NodeKind::TernaryExp, cond, left, els);
+            } else {
+                int prec = binaryPrec();
+                if (prec < 0 || prec < minPrec) return left;
+                string op = text(toks[pos++]);
+                NodeId right = exp(prec+1);
+                left = ast.op(op, {left, right});
+            }
+        }
+    }
+
+    NodeId primary() {
+        const Token &t = peek();
+        switch (t.kind) {
+            case TokenKind::Int:
+            case TokenKind::Hex:
+                pos++;
+                return ast.addInt(intLiteral(text(t)));
+            case TokenKind::Float:
+                pos++;
+                return ast.addFloat(floatLiteral(text(t)));
+            case TokenKind::String:
+                pos++;
+                return ast.addStr(NodeKind::StringExp, text(t));
+            case TokenKind::Id:
+                pos++;
+                return ast.addStr(NodeKind::IdExp, text(t));
+            default:
+                break;
+        }
+        if (accept("true")) return ast.addInt(1);
+        if (accept("false")) return ast.addInt(0);
+        if (is("-") || is("not")) {
+            string op = text(toks[pos++]);
+            return ast.op(op, {exp(Unary)});
+        }
+        if (accept("[")) {
+            NodeId e = ast.add(NodeKind::ListExp, explist("]"));
+            expect("]");
+            return e;
+        }
+        if (accept("{")) {
+            vector<NodeId> l;
+            if (!is("}")) {
+                do {
+                    l.push_back(exp());
+                    expect(":");
+                    l.push_back(exp());
+                } while (accept(","));
+            }
+            expect("}");
+            return ast.add(NodeKind::MapExp, l);
+        }
+        if (accept("(")) {
+            NodeId e = exp();
+            if (accept(",")) {
+                vector<NodeId> l = {e};
+                vector<NodeId> rest = explist(")");
+                l.insert(l.end(), rest.begin(), rest.end());
+                expect(")");
+                return ast.add(NodeKind::TupleExp, l);
+            }
+            expect(")");
+            if (parens.size() <= (size_t)e) parens.resize(e+1);
+            parens[e] = true;
+            return e;
+        }
+        error("expected expression");
+    }
+
+    // explist? before the closing token
+    vector<NodeId> explist(const char *close) {
+        vector<NodeId> l;
+        if (is(close)) return l;
+        do l.push_back(exp()); while (accept(","));
+        return l;
+    }
+};
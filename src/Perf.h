@@ -0,0 +1,294 @@
+#pragma once
+
+#include <map>
+#include <ostream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define PERF_USER_READ
+#endif
+#endif
+
+enum PerfEvent {
+    TaskClock,      // ns on the cpu, always there when perf_event_open is
+    Cycles,
+    Instructions,
+    BranchMisses,
+    L1dMisses,      // reads
+    LLCMisses,      // reads
+    PERF_EVENTS
+};
+
+struct PerfCounts {
+    uint64_t steps = 0;             // VM instructions
+    uint64_t counts[PERF_EVENTS] = {};
+
+    void add(const PerfCounts &c) {
+        steps += c.steps;
+        for (int i=0;i<PERF_EVENTS;i++) counts[i] += c.counts[i];
+    }
+};
+
+// The counters of one thread, read together as a group. Hardware events the
+// CPU or the hypervisor doesn't expose are left out, the task clock leads.
+// Each read returns what was counted since the thread's previous read, less
+// the cost of a read, so VMs sharing a thread each get their own share.
+// Where the kernel allows rdpmc, reads don't leave user space : the
+// hardware counters come from rdpmc and the task clock from the running
+// time published in their mmap'd pages. Otherwise each read is a read()
+// syscall, whose effects on caches and branch predictors are counted too.
+class PerfGroup {
+public:
+    // opened on first use by each thread
+    static PerfGroup &thread() {
+        thread_local PerfGroup g;
+        return g;
+    }
+
+    // why the group couldn't be opened, empty if it counts
+    std::string error;
+    bool available[PERF_EVENTS] = {};
+    // the counters are read with rdpmc rather than read()
+    bool userRead = false;
+
+    void read(PerfCounts &delta) {
+        uint64_t now[PERF_EVENTS];
+        read_counts(now);
+        for (int i=0;i<PERF_EVENTS;i++) {
+            // the rdpmc and read() task clocks can be a few ns apart
+            uint64_t d = now[i] > last[i] ? now[i] - last[i] : 0;
+            delta.counts[i] = d > overhead[i] ? d - overhead[i] : 0;
+            last[i] = now[i];
+        }
+    }
+
+    ~PerfGroup() {
+#ifdef PERF_USER_READ
+        unmap_pages();
+#endif
+#ifdef __linux__
+        for (int fd : fds) close(fd);
+#endif
+    }
+
+private:
+    std::vector<int> fds;
+#ifdef PERF_USER_READ
+    perf_event_mmap_page *pages[PERF_EVENTS] = {};
+#endif
+    int order[PERF_EVENTS];     // index in the group read, -1 if not available
+    uint64_t last[PERF_EVENTS] = {};
+    uint64_t overhead[PERF_EVENTS] = {};
+
+    PerfGroup() {
+        std::fill(order, order+PERF_EVENTS, -1);
+#ifdef __linux__
+        for (int e=0;e<PERF_EVENTS;e++) {
+            int fd = open_event(PerfEvent(e), fds.empty() ? -1 : fds[0]);
+            if (fd < 0) {
+                if (e == TaskClock) {
+                    error = std::string("perf_event_open : ") + strerror(errno);
+                    return;
+                }
+                continue;
+            }
+            order[e] = fds.size();
+            available[e] = true;
+            fds.push_back(fd);
+        }
+        ioctl_group(PERF_EVENT_IOC_RESET);
+        ioctl_group(PERF_EVENT_IOC_ENABLE);
+#ifdef PERF_USER_READ
+        map_pages();
+#endif
+
+        // back to back reads measure what a read itself adds
+        uint64_t prev[PERF_EVENTS], now[PERF_EVENTS];
+        std::fill(overhead, overhead+PERF_EVENTS, UINT64_MAX);
+        read_counts(prev);
+        for (int n=0;n<64;n++) {
+            read_counts(now);
+            for (int i=0;i<PERF_EVENTS;i++) overhead[i] = std::min(overhead[i], now[i] - prev[i]);
+            std::copy(now, now+PERF_EVENTS, prev);
+        }
+        std::copy(now, now+PERF_EVENTS, last);
+#else
+        error = "hardware counters need Linux perf_event_open";
+#endif
+    }
+
+#ifdef __linux__
+    static int open_event(PerfEvent e, int leader) {
+        perf_event_attr a;
+        memset(&a, 0, sizeof(a));
+        a.size = sizeof(a);
+        a.type = PERF_TYPE_HARDWARE;
+        a.exclude_kernel = 1;
+        a.exclude_hv = 1;
+        a.read_format = PERF_FORMAT_GROUP;
+        a.disabled = leader < 0;
+        auto cacheReadMiss = [](uint64_t cache) {
+            return cache | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+        };
+        switch (e) {
+            case TaskClock: a.type = PERF_TYPE_SOFTWARE; a.config = PERF_COUNT_SW_TASK_CLOCK; break;
+            case Cycles: a.config = PERF_COUNT_HW_CPU_CYCLES; break;
+            case Instructions: a.config = PERF_COUNT_HW_INSTRUCTIONS; break;
+            case BranchMisses: a.config = PERF_COUNT_HW_BRANCH_MISSES; break;
+            case L1dMisses: a.type = PERF_TYPE_HW_CACHE; a.config = cacheReadMiss(PERF_COUNT_HW_CACHE_L1D); break;
+            case LLCMisses: a.type = PERF_TYPE_HW_CACHE; a.config = cacheReadMiss(PERF_COUNT_HW_CACHE_LL); break;
+            default: return -1;
+        }
+        return syscall(SYS_perf_event_open, &a, 0, -1, leader, 0);
+    }
+
+    void ioctl_group(unsigned long request) {
+        ioctl(fds[0], request, PERF_IOC_FLAG_GROUP);
+    }
+#endif
+
+#ifdef PERF_USER_READ
+    // every hardware counter must allow rdpmc and publish its running time
+    void map_pages() {
+        size_t size = sysconf(_SC_PAGESIZE);
+        for (int e=0;e<PERF_EVENTS;e++) {
+            if (order[e] < 0 || e == TaskClock) continue;
+            void *p = mmap(nullptr, size, PROT_READ, MAP_SHARED, fds[order[e]], 0);
+            if (p == MAP_FAILED) break;
+            pages[e] = (perf_event_mmap_page*)p;
+            userRead = pages[e]->cap_user_rdpmc && pages[e]->cap_user_time;
+            if (!userRead) break;
+        }
+        if (!userRead) unmap_pages();
+    }
+
+    void unmap_pages() {
+        size_t size = sysconf(_SC_PAGESIZE);
+        for (auto &p : pages) {
+            if (p) munmap(p, size);
+            p = nullptr;
+        }
+        userRead = false;
+    }
+
+    // count and running time of one event as the kernel documents it in
+    // perf_event_mmap_page, false while the event isn't on a counter
+    static bool read_page(perf_event_mmap_page *pc, uint64_t &count, uint64_t &running) {
+        uint32_t seq;
+        do {
+            seq = pc->lock;
+            __asm__ __volatile__("" ::: "memory");
+            uint32_t index = pc->index;
+            if (!index) return false;
+            uint32_t lo, hi;
+            __asm__ __volatile__("rdpmc" : "=a"(lo), "=d"(hi) : "c"(index-1));
+            int shift = 64 - pc->pmc_width;
+            count = pc->offset + (uint64_t)((int64_t)(((uint64_t)hi << 32 | lo) << shift) >> shift);
+            uint64_t cycles = __rdtsc();
+            uint64_t quot = cycles >> pc->time_shift;
+            uint64_t rem = cycles & (((uint64_t)1 << pc->time_shift) - 1);
+            running = pc->time_running + pc->time_offset + quot*pc->time_mult + ((rem*pc->time_mult) >> pc->time_shift);
+            __asm__ __volatile__("" ::: "memory");
+        } while (pc->lock != seq);
+        return true;
+    }
+
+    // the hardware counters run with the task clock as one group, so their
+    // running time is the task clock
+    bool read_pages(uint64_t now[PERF_EVENTS]) {
+        for (int e=0;e<PERF_EVENTS;e++) {
+            if (!pages[e]) continue;
+            uint64_t running;
+            if (!read_page(pages[e], now[e], running)) return false;
+            now[TaskClock] = running;
+        }
+        return true;
+    }
+#endif
+
+    void read_counts(uint64_t now[PERF_EVENTS]) {
+        std::fill(now, now+PERF_EVENTS, 0);
+#ifdef PERF_USER_READ
+        if (userRead && read_pages(now)) return;
+        std::fill(now, now+PERF_EVENTS, 0);
+#endif
+#ifdef __linux__
+        // {nr, values...} in the order the events joined the group
+        uint64_t buf[1+PERF_EVENTS];
+        if (::read(fds[0], buf, sizeof(buf)) <= 0) return;
+        for (int e=0;e<PERF_EVENTS;e++)
+            if (order[e] >= 0 && (uint64_t)order[e] < buf[0]) now[e] = buf[1+order[e]];
+#endif
+    }
+};
+
+// counts by function and by opcode, from VirtualMachine::perf_profile
+struct PerfProfile {
+    bool available[PERF_EVENTS] = {};
+    bool userRead = false;
+    std::map<std::string, PerfCounts> functions;
+    std::map<std::string, PerfCounts> opcodes;
+
+    // a table per key, most time first
+    void print(std::ostream &o) const {
+        const char *names[PERF_EVENTS] = {"ms", "cycles", "instrs", "br-miss", "L1d-miss", "LLC-miss"};
+        auto table = [&](const char *title, const std::map<std::string, PerfCounts> &rows) {
+            std::vector<std::pair<std::string, PerfCounts>> sorted(rows.begin(), rows.end());
+            std::sort(sorted.begin(), sorted.end(), [](const std::pair<std::string, PerfCounts> &a, const std::pair<std::string, PerfCounts> &b) {
+                return a.second.counts[TaskClock] > b.second.counts[TaskClock];
+            });
+            char buf[64];
+            std::string line = pad(title, 20) + pad("steps", 12);
+            for (int e=0;e<PERF_EVENTS;e++) {
+                line += pad(names[e], 14);
+                if (e == Instructions) line += pad("IPC", 7);
+            }
+            end_line(o, line);
+            for (auto &r : sorted) {
+                const PerfCounts &c = r.second;
+                line = pad(r.first, 20) + pad(std::to_string(c.steps), 12);
+                for (int e=0;e<PERF_EVENTS;e++) {
+                    if (!available[e]) line += pad("-", 14);
+                    else if (e == TaskClock) {
+                        snprintf(buf, sizeof(buf), "%.3f", c.counts[e] / 1e6);
+                        line += pad(buf, 14);
+                    } else line += pad(std::to_string(c.counts[e]), 14);
+                    if (e == Instructions) {
+                        if (available[Cycles] && available[Instructions] && c.counts[Cycles]) {
+                            snprintf(buf, sizeof(buf), "%.2f", (double)c.counts[Instructions] / c.counts[Cycles]);
+                            line += pad(buf, 7);
+                        } else line += pad("-", 7);
+                    }
+                }
+                end_line(o, line);
+            }
+        };
+        if (userRead) o << "counters read with rdpmc" << std::endl;
+        else o << "counters read with a read() syscall after each instruction, the counts include its effects" << std::endl;
+        table("function", functions);
+        o << std::endl;
+        table("opcode", opcodes);
+    }
+
+private:
+    static std::string pad(const std::string &s, size_t width) {
+        return s.size() >= width ? s + " " : s + std::string(width - s.size(), ' ');
+    }
+
+    static void end_line(std::ostream &o, const std::string &line) {
+        o << line.substr(0, line.find_last_not_of(' ')+1) << std::endl;
+    }
+};
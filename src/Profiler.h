@@ -0,0 +1,85 @@
+#pragma once
+
+#include <map>
+#include <ostream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+
+// Call stacks sampled on SIGPROF. The handler runs on the thread it
+// interrupts and only copies words into storage reserved up front; a full
+// buffer drops the samples that don't fit.
+struct StackSamples {
+    // per sample : frames, the pc, then the return address of each frame
+    std::vector<uint32_t> words;
+    size_t used = 0;
+    uint64_t taken = 0;
+    uint64_t dropped = 0;
+
+    explicit StackSamples(size_t size) : words(size) {}
+
+    // async signal safe
+    void add(uint32_t pc, const uint32_t *returns, int frames) {
+        size_t n = 2 + frames;
+        if (frames < 0 || used + n > words.size()) {
+            dropped++;
+            return;
+        }
+        words[used] = frames;
+        words[used+1] = pc;
+        std::copy(returns, returns+frames, &words[used+2]);
+        used += n;
+        taken++;
+    }
+};
+
+// samples by call stack and by source line, from VirtualMachine::sample_profile
+struct SampleProfile {
+    uint64_t samples = 0;
+    uint64_t dropped = 0;
+    // "main:3;f:12" innermost last, as flamegraph.pl reads them
+    std::map<std::string, uint64_t> stacks;
+    // line running, and line anywhere on the stack
+    std::map<int32_t, uint64_t> self;
+    std::map<int32_t, uint64_t> total;
+
+    // collapsed stacks, one per line, under an optional root frame
+    void write_folded(std::ostream &o, const std::string &root = "") const {
+        for (auto &s : stacks)
+            o << (root.empty() ? "" : root + ";") << s.first << " " << s.second << std::endl;
+    }
+
+    // the source with the share of samples of each line
+    void print_lines(std::ostream &o, const std::string &source) const {
+        char buf[32];
+        o << "  self   total   line" << std::endl;
+        int32_t line = 1;
+        size_t start = 0;
+        while (start < source.size()) {
+            size_t end = source.find('\n', start);
+            if (end == std::string::npos) end = source.size();
+            std::string text = source.substr(start, end-start);
+            if (!text.empty() && text.back() == '\r') text.pop_back();
+            std::string l = percent(self, line) + percent(total, line);
+            snprintf(buf, sizeof(buf), "%5d | ", line);
+            l += buf + text;
+            o << l.substr(0, l.find_last_not_of(' ')+1) << std::endl;
+            start = end+1;
+            line++;
+        }
+        o << samples << " samples";
+        if (dropped) o << ", " << dropped << " dropped";
+        o << std::endl;
+    }
+
+private:
+    std::string percent(const std::map<int32_t, uint64_t> &counts, int32_t line) const {
+        auto it = counts.find(line);
+        if (it == counts.end() || !samples) return std::string(8, ' ');
+        char buf[32];
+        snprintf(buf, sizeof(buf), "%5.1f%%  ", 100.0 * it->second / samples);
+        return buf;
+    }
+};
@@ -0,0 +1,124 @@
+#pragma once
+
+#include "AST.h"
+
+#include <set>
+
+// Purity inference over a whole file, run by CodeGen before the functions
+// are generated. A pure function can only compute its result : it calls
+// operators, pure natives and pure functions by name, never a closure,
+// and never stores into a list or map through one of its arguments. With
+// no globals, its arguments are all it reads, so equal arguments that
+// aren't lists, tuples or maps give equal results.
+class Purity {
+public:
+    Purity(const File &file) : file(file), ast(file.ast) {}
+
+    set<string> pure;
+
+    void run() {
+        // every function is pure until it calls something that isn't
+        for (auto &f : file.functions) pure.insert(f.first);
+        bool changed = true;
+        while (changed) {
+            changed = false;
+            for (auto &f : file.functions) {
+                if (!pure.count(f.first) || isPure(f.second)) continue;
+                pure.erase(f.first);
+                changed = true;
+            }
+        }
+    }
+
+    // calls of the function by itself, a tree recursion like fib computes
+    // the same results over and over
+    int selfCalls(const string &name) const {
+        const Function &f = file.functions.at(name);
+        set<string> locals = localsOf(f);
+        return f.body != NO_NODE ? countCalls(f.body, name, locals) : countCalls(f.e, name, locals);
+    }
+
+private:
+    const File &file;
+    const Ast &ast;
+
+    static bool isOperator(const string &name) {
+        static const set<string> ops = {"-", "+", "*", "/", "%", "<", "<=", ">", ">=", "==", "!=",
+                                        "not", "and", "or", "len", "has"};
+        return ops.count(name);
+    }
+
+    // natives whose result only depends on their arguments
+    static bool isPureNative(const string &name) {
+        static const set<string> natives = {"min", "max", "sqrt", "sum", "format"};
+        return natives.count(name);
+    }
+
+    // arguments and assigned names, calls of them are closure calls
+    set<string> localsOf(const Function &f) const {
+        set<string> locals(f.args.begin(), f.args.end());
+        assigned(f.body, locals);
+        return locals;
+    }
+
+    void assigned(NodeId id, set<string> &names) const {
+        if (id == NO_NODE) return;
+        const Node &n = ast[id];
+        if (n.kind == NodeKind::LexpId) names.insert(ast.str(id));
+        assigned(n.a, names);
+        assigned(n.b, names);
+        assigned(n.c, names);
+        for (int i=0;i<n.count;i++) assigned(ast.child(n, i), names);
+    }
+
+    bool isPure(const Function &f) const {
+        set<string> args(f.args.begin(), f.args.end());
+        set<string> locals = localsOf(f);
+        return f.body != NO_NODE ? isPure(f.body, args, locals) : isPure(f.e, args, locals);
+    }
+
+    bool isPure(NodeId id, const set<string> &args, const set<string> &locals) const {
+        if (id == NO_NODE) return true;
+        const Node &n = ast[id];
+        switch (n.kind) {
+            case NodeKind::LexpIndex: {
+                NodeId root = n.a;
+                while (ast.kind(root) == NodeKind::LexpIndex) root = ast[root].a;
+                if (args.count(ast.str(root))) return false;
+                break;
+            }
+            case NodeKind::FuncCallStat:
+            case NodeKind::FuncCallExp: {
+                if (ast.kind(n.a) != NodeKind::IdExp) return false;
+                auto &name = ast.str(n.a);
+                // remove() stores into a map
+                if (locals.count(name) || name == "remove") return false;
+                if (isOperator(name)) break;
+                if (file.functions.count(name)) {
+                    if (!pure.count(name)) return false;
+                    break;
+                }
+                if (!isPureNative(name)) return false;
+                break;
+            }
+            default:
+                break;
+        }
+        if (!isPure(n.a, args, locals) || !isPure(n.b, args, locals) || !isPure(n.c, args, locals)) return false;
+        for (int i=0;i<n.count;i++)
+            if (!isPure(ast.child(n, i), args, locals)) return false;
+        return true;
+    }
+
+    int countCalls(NodeId id, const string &name, const set<string> &locals) const {
+        if (id == NO_NODE) return 0;
+        const Node &n = ast[id];
+        int count = 0;
+        if ((n.kind == NodeKind::FuncCallExp || n.kind == NodeKind::FuncCallStat)
+            && ast.kind(n.a) == NodeKind::IdExp && ast.str(n.a) == name && !locals.count(name))
+            count++;
+        count += countCalls(n.a, name, locals) + countCalls(n.b, name, locals) + countCalls(n.c, name, locals);
+        for (int i=0;i<n.count;i++) count += countCalls(ast.child(n, i), name, locals);
+        return count;
+    }
+};
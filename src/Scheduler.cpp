@@ -0,0 +1,72 @@
+#include "Scheduler.h"
+
+#include <thread>
+
+using namespace std;
+
+int Scheduler::add(unique_ptr<VirtualMachine> vm, chrono::nanoseconds limit, const string &then) {
+    Job job;
+    job.vm = move(vm);
+    job.limit = limit;
+    job.then = then;
+    jobs.push_back(move(job));
+    ready.push_back(jobs.size()-1);
+    return jobs.size()-1;
+}
+
+int Scheduler::add_failed(unique_ptr<VirtualMachine> vm, const string &error) {
+    Job job;
+    job.vm = move(vm);
+    job.status = RunStatus::Error;
+    job.error = error;
+    jobs.push_back(move(job));
+    return jobs.size()-1;
+}
+
+void Scheduler::run() {
+    vector<thread> pool;
+    for (int t=1;t<min(threads, (int)jobs.size());t++) pool.emplace_back(&Scheduler::worker, this);
+    worker();
+    for (auto &t : pool) t.join();
+}
+
+void Scheduler::worker() {
+    unique_lock<mutex> l(lock);
+    while (true) {
+        // done once nothing is queued and no running job can queue itself again
+        changed.wait(l, [&]() { return !ready.empty() || running == 0; });
+        if (ready.empty()) break;
+        int i = ready.front();
+        ready.pop_front();
+        running++;
+        l.unlock();
+
+        Job &job = jobs[i];
+        auto begin = chrono::steady_clock::now();
+        if (job.limit.count()) job.vm->timeLimit = begin + (job.limit - job.used);
+        job.status = job.vm->run_for(slice);
+        job.used += chrono::steady_clock::now() - begin;
+        job.slices++;
+        // the next phase counts against the same limit
+        if (job.status == RunStatus::Finished && !job.then.empty()) {
+            try {
+                job.vm->start(job.then);
+                job.status = RunStatus::Yielded;
+            } catch (runtime_error &e) {
+                job.vm->error = e.what();
+                job.status = RunStatus::Error;
+            }
+            job.then.clear();
+        }
+        if (job.status == RunStatus::Error) job.error = job.vm->error;
+        else if (job.status == RunStatus::Yielded && job.limit.count() && job.used >= job.limit) {
+            job.status = RunStatus::Error;
+            job.error = "Time limit exceeded";
+        }
+
+        l.lock();
+        running--;
+        if (job.status == RunStatus::Yielded) ready.push_back(i);
+        changed.notify_all();
+    }
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include "VirtualMachine.h"
+
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+
+// Interleaves started VMs on a few threads : a job runs for at most `slice`
+// instructions, then goes to the back of the queue. A job that has used up
+// its time limit fails instead of being queued again, so a script that
+// loops forever only costs its own slices.
+class Scheduler {
+public:
+    Scheduler(int threads, uint64_t slice = 1 << 14) : threads(std::max(1, threads)), slice(slice) {}
+
+    struct Job {
+        std::unique_ptr<VirtualMachine> vm;
+        RunStatus status = RunStatus::Yielded;
+        std::string error;
+        // time spent running, and the most it may spend, zero for no limit
+        std::chrono::nanoseconds used{0};
+        std::chrono::nanoseconds limit{0};
+        int slices = 0;
+        // entry function started once the first one finishes, on its results
+        std::string then;
+    };
+
+    // vm must have been started, returns the job's index in jobs
+    int add(std::unique_ptr<VirtualMachine> vm, std::chrono::nanoseconds limit = std::chrono::nanoseconds(0),
+            const std::string &then = "");
+    // a job that failed before it could start, reported with the others
+    int add_failed(std::unique_ptr<VirtualMachine> vm, const std::string &error);
+
+    // returns once every job has finished or failed
+    void run();
+
+    std::vector<Job> jobs;
+
+private:
+    void worker();
+
+    int threads;
+    uint64_t slice;
+    std::deque<int> ready;
+    int running = 0;
+    std::mutex lock;
+    std::condition_variable changed;
+};
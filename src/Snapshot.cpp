@@ -0,0 +1,192 @@
+#include "VirtualMachine.h"
+
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <cstdio>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+
+// Snapshot file : {magic, memory words, memory offset, op stack frame,
+// frame heap top, functions, source lines, interned strings, heap tree},
+// then the whole memory at a page aligned offset so it can be mapped
+// directly.
+
+const WORD SNAPSHOT_MAGIC = 0x53524f4e; // "NORS"
+
+static void putWord(ostream &o, WORD w) {
+    o.write((const char*)&w, sizeof(WORD));
+}
+
+static WORD getWord(istream &i) {
+    WORD w = 0;
+    i.read((char*)&w, sizeof(WORD));
+    return w;
+}
+
+static void putString(ostream &o, const string &s) {
+    putWord(o, s.size());
+    o.write(s.data(), s.size());
+}
+
+// counts come from the file : n items of at least `size` bytes must fit in
+// what is left of the header before `end`
+static WORD getCount(istream &i, size_t end, size_t size) {
+    WORD n = getWord(i);
+    streamoff pos = i.tellg();
+    if (!i || pos < 0 || (size_t)pos > end || n > (end - pos) / size) throw runtime_error("Corrupt snapshot");
+    return n;
+}
+
+static string getString(istream &i, size_t end) {
+    string s(getCount(i, end, 1), '\0');
+    i.read(&s[0], s.size());
+    return s;
+}
+
+// preorder, one byte per node : bit 0 allocated, bit 1 split
+void VirtualMachine::heap_save(ostream &o, HeapTree *tree) {
+    o.put((tree->allocated ? 1 : 0) | (tree->left ? 2 : 0));
+    if (tree->left) {
+        heap_save(o, tree->left.get());
+        heap_save(o, tree->right.get());
+    }
+}
+
+void VirtualMachine::heap_restore(istream &i, HeapTree *tree) {
+    int flags = i.get();
+    if (flags == EOF) throw runtime_error("Truncated snapshot");
+    tree->allocated = flags & 1;
+    tree->left = nullptr;
+    tree->right = nullptr;
+    if (flags & 2) {
+        if (tree->size/2 < SMALLEST_ALLOC) throw runtime_error("Corrupt snapshot");
+        tree->left  = shared_ptr<HeapTree>(new HeapTree{tree->start             , tree->size/2, false, nullptr, nullptr, tree});
+        tree->right = shared_ptr<HeapTree>(new HeapTree{tree->start+tree->size/2, tree->size/2, false, nullptr, nullptr, tree});
+        heap_restore(i, tree->left.get());
+        heap_restore(i, tree->right.get());
+    }
+}
+
+void VirtualMachine::snapshot(const string &path) {
+    if (stackFrame != 0) throw runtime_error("Can't snapshot a running VM");
+    if (epochStart != NULLPTR) throw runtime_error("Can't snapshot during an epoch");
+
+    stringstream header;
+    putWord(header, opStackFrame);
+    putWord(header, frameHeapTop);
+    putWord(header, funcNames.size());
+    for (auto &f : funcNames) {
+        putString(header, f.first);
+        putWord(header, f.second);
+        putWord(header, funcNumArgs[f.second]);
+    }
+    putWord(header, sourceLines.size());
+    header.write((const char*)sourceLines.data(), sourceLines.size()*sizeof(SourcePos));
+    putWord(header, internedStrings.size());
+    for (auto &s : internedStrings) {
+        putString(header, s.first);
+        putWord(header, s.second);
+    }
+    heap_save(header, &heaproot);
+
+    string h = header.str();
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t offset = (3*sizeof(WORD) + h.size() + page-1) / page * page;
+    size_t pad = offset - 3*sizeof(WORD) - h.size();
+
+    string tmp = path + ".tmp." + to_string(getpid());
+    {
+        ofstream out(tmp, ios::binary);
+        putWord(out, SNAPSHOT_MAGIC);
+        putWord(out, TOTAL_SIZE);
+        putWord(out, offset);
+        out.write(h.data(), h.size());
+        out.write(string(pad, '\0').data(), pad);
+        out.write((const char*)memory, TOTAL_SIZE*sizeof(WORD));
+        if (!out) {
+            remove(tmp.c_str());
+            throw runtime_error("Can't write snapshot " + path);
+        }
+    }
+    if (rename(tmp.c_str(), path.c_str()) != 0) {
+        remove(tmp.c_str());
+        throw runtime_error("Can't write snapshot " + path);
+    }
+}
+
+void VirtualMachine::restore(const string &path) {
+    ifstream in(path, ios::binary);
+    if (!in || getWord(in) != SNAPSHOT_MAGIC) throw runtime_error("Not a snapshot : " + path);
+    if (getWord(in) != TOTAL_SIZE) throw runtime_error("Snapshot was made with another memory layout");
+    WORD offset = getWord(in);
+    in.seekg(0, ios::end);
+    streamoff size = in.tellg();
+    in.seekg(3*sizeof(WORD));
+    if (!in || size < 0 || (size_t)size < offset + TOTAL_SIZE*sizeof(WORD)) throw runtime_error("Truncated snapshot");
+
+    // everything is read before the VM is touched, a bad file leaves it as it was
+    WORD opFrame = getWord(in);
+    WORD frameTop = getWord(in);
+    if (opFrame > MAX_OP_STACK_SIZE || frameTop < FRAME_HEAP_START || frameTop > FRAME_HEAP_END)
+        throw runtime_error("Corrupt snapshot");
+    map<string, PTR> names;
+    map<PTR, int> numArgs;
+    WORD numFuncs = getCount(in, offset, 3*sizeof(WORD));
+    for (WORD i=0;i<numFuncs;i++) {
+        string name = getString(in, offset);
+        PTR addr = getWord(in);
+        if (addr >= CODE_END) throw runtime_error("Corrupt snapshot");
+        names[name] = addr;
+        numArgs[addr] = getWord(in);
+    }
+    vector<SourcePos> lines(getCount(in, offset, sizeof(SourcePos)));
+    in.read((char*)lines.data(), lines.size()*sizeof(SourcePos));
+    unordered_map<string, PTR> strings;
+    WORD numStrings = getCount(in, offset, 2*sizeof(WORD));
+    for (WORD i=0;i<numStrings;i++) {
+        string s = getString(in, offset);
+        strings[s] = getWord(in);
+    }
+    HeapTree heap;
+    heap_restore(in, &heap);
+    if (!in) throw runtime_error("Truncated snapshot");
+
+    // pages are shared with every other process restoring the same file
+    // until one of them writes
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) throw runtime_error("Can't open snapshot " + path);
+    void *m = mmap(nullptr, TOTAL_SIZE*sizeof(WORD), PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, offset);
+    close(fd);
+    if (m == MAP_FAILED) throw runtime_error("Can't map snapshot " + path);
+
+    release_memory();
+    memory = (WORD*)m;
+    mappedMemory = true;
+    stackFrame = 0;
+    opStackFrame = opFrame;
+    frameHeapTop = frameTop;
+    funcNames = names;
+    funcNumArgs = numArgs;
+    sourceLines = lines;
+    internedStrings = strings;
+    heap_copy(&heaproot, &heap);
+    // the code of a snapshot isn't verified again, it runs with checks
+    verified = false;
+    funcOpStackWords.clear();
+    // mapped inputs aren't part of a snapshot, their handles are invalid
+    inputs.clear();
+    memo.clear();
+    memoCalls.clear();
+}
+
+void VirtualMachine::release_memory() {
+    if (mappedMemory) munmap(memory, TOTAL_SIZE*sizeof(WORD));
+    else delete[] memory;
+    memory = nullptr;
+    mappedMemory = false;
+}
@@ -0,0 +1,120 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstdio>
+
+enum class TraceKind : uint8_t {
+    Enter,      // arg : function address
+    Exit,
+    Alloc,      // arg : address, size : words
+    Free,       // arg : address, size : words
+    HeapFull,   // size : words that couldn't be allocated
+};
+
+struct TraceEvent {
+    uint64_t ns;
+    uint32_t arg;
+    uint32_t size;
+    uint16_t pid;   // VM
+    uint16_t tid;   // 0 for the VM itself, worker index + 1 for pmap and preduce workers
+    TraceKind kind;
+};
+
+// Fixed-size ring of events shared by any number of VMs on any threads :
+// writers claim a slot with one atomic increment and never wait, and once
+// the ring is full the oldest events are overwritten. Read it with
+// write_json once every VM writing to it is idle.
+class TraceBuffer {
+public:
+    // capacity is rounded up to a power of two
+    TraceBuffer(size_t capacity = 1 << 20) {
+        size_t n = 1;
+        while (n < capacity) n <<= 1;
+        events.resize(n);
+        mask = n-1;
+    }
+
+    void record(TraceKind kind, uint16_t pid, uint16_t tid, uint32_t arg = 0, uint32_t size = 0) {
+        uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - origin).count();
+        uint64_t i = next.fetch_add(1, std::memory_order_relaxed);
+        events[i & mask] = {ns, arg, size, pid, tid, kind};
+    }
+
+    // names of the functions of a VM, by address
+    void name_functions(uint16_t pid, const std::map<std::string, uint32_t> &funcs) {
+        std::lock_guard<std::mutex> l(namesLock);
+        for (auto &f : funcs) names[pid][f.second] = f.first;
+    }
+
+    uint64_t recorded() const { return next.load(std::memory_order_relaxed); }
+    uint64_t dropped() const { return recorded() > events.size() ? recorded() - events.size() : 0; }
+
+    // Chrome Trace Event format, as read by Perfetto or chrome://tracing :
+    // calls are duration events, heap operations instant events, and the
+    // words allocated since the oldest event kept a counter per VM
+    void write_json(std::ostream &o) const {
+        uint64_t end = recorded(), begin = dropped();
+        std::map<uint16_t, int64_t> heap;
+        o << "{\"traceEvents\":[";
+        const char *sep = "\n";
+        for (uint64_t i=begin;i<end;i++) {
+            const TraceEvent &e = events[i & mask];
+            o << sep << "{\"pid\":" << e.pid << ",\"tid\":" << e.tid << ",\"ts\":" << micros(e.ns);
+            switch (e.kind) {
+                case TraceKind::Enter:
+                    o << ",\"ph\":\"B\",\"name\":\"" << function_name(e.pid, e.arg) << "\"}";
+                    break;
+                case TraceKind::Exit:
+                    o << ",\"ph\":\"E\"}";
+                    break;
+                case TraceKind::Alloc:
+                case TraceKind::Free: {
+                    bool alloc = e.kind == TraceKind::Alloc;
+                    o << ",\"ph\":\"i\",\"s\":\"t\",\"name\":\"" << (alloc ? "alloc" : "free")
+                      << "\",\"args\":{\"addr\":" << e.arg << ",\"size\":" << e.size << "}},";
+                    heap[e.pid] += alloc ? e.size : -(int64_t)e.size;
+                    o << "\n{\"pid\":" << e.pid << ",\"ts\":" << micros(e.ns) << ",\"ph\":\"C\",\"name\":\"heap\",\"args\":{\"words\":" << heap[e.pid] << "}}";
+                    break;
+                }
+                case TraceKind::HeapFull:
+                    o << ",\"ph\":\"i\",\"s\":\"p\",\"name\":\"heap full\",\"args\":{\"size\":" << e.size << "}}";
+                    break;
+            }
+            sep = ",\n";
+        }
+        o << "\n],\"displayTimeUnit\":\"ns\",\"otherData\":{\"dropped\":" << dropped() << "}}" << std::endl;
+    }
+
+private:
+    std::vector<TraceEvent> events;
+    uint64_t mask;
+    std::atomic<uint64_t> next{0};
+    std::chrono::steady_clock::time_point origin = std::chrono::steady_clock::now();
+
+    std::mutex namesLock;
+    std::map<uint16_t, std::map<uint32_t, std::string>> names;
+
+    // timestamps are in microseconds
+    static std::string micros(uint64_t ns) {
+        char buf[32];
+        snprintf(buf, sizeof(buf), "%llu.%03llu", (unsigned long long)(ns/1000), (unsigned long long)(ns%1000));
+        return buf;
+    }
+
+    std::string function_name(uint16_t pid, uint32_t addr) const {
+        auto vm = names.find(pid);
+        if (vm != names.end()) {
+            auto f = vm->second.find(addr);
+            if (f != vm->second.end()) return f->second;
+        }
+        return "@" + std::to_string(addr);
+    }
+};
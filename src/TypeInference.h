@@ -0,0 +1,218 @@
+#pragma once
+
+#include "AST.h"
+
+#include <set>
+#include <unordered_map>
+
+// Undef : a local that isn't assigned on every path yet, its slot may hold
+// anything. IntList : a list only ever holding ints, stored unboxed.
+enum class StaticType : uint8_t { Undef, Int, Float, IntList, List, Any };
+
+inline bool isList(StaticType t) {
+    return t == StaticType::IntList || t == StaticType::List;
+}
+
+inline StaticType join(StaticType a, StaticType b) {
+    if (a == b) return a;
+    if (isList(a) && isList(b)) return StaticType::List;
+    return StaticType::Any;
+}
+
+// Flow-sensitive type inference over one function : locals get a type per
+// program point, loops are iterated until their entry state is stable, and
+// every expression is given the join of its types over all the states it
+// was evaluated in. A local is only an IntList when nothing but itself can
+// reach the list, so only frame lists qualify. Any local can be a List :
+// lists never change length or become something else.
+class TypeInference {
+public:
+    using Env = map<string, StaticType>;
+
+    TypeInference(const Ast &ast, const set<string> &frameLists) : ast(ast), frameLists(frameLists) {}
+
+    void run(const Function &f) {
+        NodeId body = (f.body != NO_NODE) ? f.body : f.e;
+        assigned.insert(f.args.begin(), f.args.end());
+        scanAssigned(body);
+        Env env;
+        for (auto &a : f.args) env[a] = StaticType::Any;
+        if (f.body != NO_NODE) stat(body, env);
+        else expr(body, env);
+    }
+
+    StaticType type(NodeId id) const {
+        auto it = types.find(id);
+        return (it == types.end()) ? StaticType::Any : it->second;
+    }
+
+    // args and assigned names, calls of those are closure calls
+    bool isLocal(const string &name) const { return assigned.count(name); }
+    int numLocals() const { return assigned.size(); }
+
+private:
+    const Ast &ast;
+    const set<string> &frameLists;
+    set<string> assigned;
+    unordered_map<NodeId, StaticType> types;
+
+    void scanAssigned(NodeId id) {
+        if (id == NO_NODE) return;
+        const Node &n = ast[id];
+        if (n.kind == NodeKind::LexpId) assigned.insert(ast.str(id));
+        if (n.kind == NodeKind::IntExp || n.kind == NodeKind::FloatExp
+            || n.kind == NodeKind::StringExp || n.kind == NodeKind::IdExp) return;
+        scanAssigned(n.a);
+        scanAssigned(n.b);
+        scanAssigned(n.c);
+        for (int i=0;i<n.count;i++) scanAssigned(ast.child(n, i));
+    }
+
+    static StaticType lookup(const Env &env, const string &name) {
+        auto it = env.find(name);
+        return (it == env.end()) ? StaticType::Undef : it->second;
+    }
+
+    static Env joinEnv(const Env &a, const Env &b) {
+        Env res = a;
+        for (auto &v : b) res[v.first] = join(lookup(a, v.first), v.second);
+        for (auto &v : a)
+            if (!b.count(v.first)) res[v.first] = join(v.second, StaticType::Undef);
+        return res;
+    }
+
+    StaticType record(NodeId id, StaticType t) {
+        auto it = types.find(id);
+        if (it == types.end()) types[id] = t;
+        else it->second = join(it->second, t);
+        return t;
+    }
+
+    void stat(NodeId id, Env &env) {
+        if (id == NO_NODE) return;
+        const Node &n = ast[id];
+        switch (n.kind) {
+            case NodeKind::AssignStat: {
+                StaticType t = expr(n.b, env);
+                if (ast.kind(n.a) == NodeKind::LexpId) {
+                    auto &name = ast.str(n.a);
+                    if (t == StaticType::IntList && !frameLists.count(name)) t = StaticType::List;
+                    env[name] = t;
+                } else store(n.a, t, env);
+                break;
+            }
+            case NodeKind::MultiAssignStat:
+                expr(n.b, env);
+                for (int i=0;i<n.count;i++) {
+                    NodeId left = ast.child(n, i);
+                    if (ast.kind(left) == NodeKind::LexpId) env[ast.str(left)] = StaticType::Any;
+                    else store(left, StaticType::Any, env);
+                }
+                break;
+            case NodeKind::FuncCallStat:
+                expr(id, env);
+                break;
+            case NodeKind::WhileStat: {
+                // the state at the condition joins the entry and every back edge
+                while (true) {
+                    Env head = env;
+                    expr(n.a, env);
+                    stat(n.b, env);
+                    env = joinEnv(head, env);
+                    if (env == head) break;
+                }
+                expr(n.a, env);
+                break;
+            }
+            case NodeKind::IfStat: {
+                expr(n.a, env);
+                Env els = env;
+                stat(n.b, env);
+                stat(n.c, els);
+                env = joinEnv(env, els);
+                break;
+            }
+            case NodeKind::BlockStat:
+                for (int i=0;i<n.count;i++) stat(ast.child(n, i), env);
+                break;
+            case NodeKind::ReturnStat:
+                if (n.a != NO_NODE) expr(n.a, env);
+                break;
+            default:
+                expr(id, env);
+        }
+    }
+
+    // an indexed store keeps an IntList only when it stores an int directly
+    // into it, anything deeper may change its element type
+    void store(NodeId lexp, StaticType t, Env &env) {
+        const Node &n = ast[lexp];
+        StaticType index = expr(n.b, env);
+        NodeId base = n.a;
+        while (ast.kind(base) == NodeKind::LexpIndex) {
+            expr(ast[base].b, env);
+            base = ast[base].a;
+        }
+        auto &name = ast.str(base);
+        if (record(base, lookup(env, name)) != StaticType::IntList) return;
+        bool direct = n.a == base && index == StaticType::Int;
+        if (!direct || t != StaticType::Int) env[name] = StaticType::List;
+    }
+
+    StaticType expr(NodeId id, const Env &env) {
+        if (id == NO_NODE) return StaticType::Any;
+        const Node &n = ast[id];
+        switch (n.kind) {
+            case NodeKind::IntExp: return record(id, StaticType::Int);
+            case NodeKind::FloatExp: return record(id, StaticType::Float);
+            case NodeKind::IdExp: return record(id, lookup(env, ast.str(id)));
+            case NodeKind::FuncCallStat:
+            case NodeKind::FuncCallExp: {
+                vector<StaticType> args(n.count);
+                for (int i=0;i<n.count;i++) args[i] = expr(ast.child(n, i), env);
+                if (ast.kind(n.a) != NodeKind::IdExp || assigned.count(ast.str(n.a))) {
+                    expr(n.a, env);
+                    return record(id, StaticType::Any);
+                }
+                return record(id, call(ast.str(n.a), args));
+            }
+            case NodeKind::TernaryExp: {
+                expr(n.a, env);
+                StaticType t = expr(n.b, env);
+                return record(id, join(t, expr(n.c, env)));
+            }
+            case NodeKind::ListExp: {
+                StaticType t = StaticType::IntList;
+                for (int i=0;i<n.count;i++)
+                    if (expr(ast.child(n, i), env) != StaticType::Int) t = StaticType::List;
+                return record(id, t);
+            }
+            case NodeKind::IndexExp: {
+                StaticType l = expr(n.a, env);
+                StaticType i = expr(n.b, env);
+                bool ints = l == StaticType::IntList && i == StaticType::Int;
+                return record(id, ints ? StaticType::Int : StaticType::Any);
+            }
+            default:
+                for (int i=0;i<n.count;i++) expr(ast.child(n, i), env);
+                return record(id, StaticType::Any);
+        }
+    }
+
+    // result of an operator or builtin, following the generic opcodes
+    static StaticType call(const string &name, const vector<StaticType> &args) {
+        auto numeric = [](StaticType t) { return t == StaticType::Int || t == StaticType::Float; };
+        if (name == "-" && args.size() == 1)
+            return numeric(args[0]) ? args[0] : StaticType::Any;
+        if (name == "<" || name == "<=" || name == ">" || name == ">=" || name == "==" || name == "!="
+            || name == "not" || name == "and" || name == "or" || name == "len")
+            return StaticType::Int;
+        if (args.size() != 2) return StaticType::Any;
+        if (name == "+" || name == "-" || name == "*" || name == "/") {
+            if (args[0] == StaticType::Int && args[1] == StaticType::Int) return StaticType::Int;
+            if (numeric(args[0]) && numeric(args[1])) return StaticType::Float;
+        }
+        if (name == "%" && args[0] == StaticType::Int && args[1] == StaticType::Int) return StaticType::Int;
+        return StaticType::Any;
+    }
+};
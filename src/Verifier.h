@@ -0,0 +1,432 @@
+#pragma once
+
+#include "VirtualMachine.h"
+
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+#include <stdexcept>
+
+// Checks a unit's bytecode before it runs, by abstract interpretation of
+// every function from its entry. The operand stack is tracked as a list of
+// values, so a verified program never pops below the values of its own frame,
+// reads a local outside the frame, jumps or calls anywhere but the start of
+// an instruction, or loads and stores through something that isn't a
+// pointer. The result is the most op stack words each function uses, which
+// VirtualMachine::newStack checks once per call instead of on every push.
+// Throws runtime_error with the reason when the program can't be proven.
+class Verifier {
+public:
+    Verifier(const vmunit &program) : program(program) {}
+
+    std::map<PTR, int> run() {
+        if (program.code.size() > (size_t)VirtualMachine::CODE_SIZE) fail("code doesn't fit in memory");
+        for (auto s : program.strings) {
+            if (s >= program.code.size()) fail("string out of the code");
+            PTR end = s+1+(program.code[s]+4)/4;
+            if (end > program.code.size()) fail("string out of the code");
+            strings.insert(s);
+            for (PTR a=s;a<end;a++) data.insert(a);
+        }
+        for (auto &f : program.funcs) {
+            if (f.second.first >= program.code.size()) fail("function " + f.first + " out of the code");
+            if (f.second.second > VirtualMachine::LOCAL_VARS_SIZE) fail("function " + f.first + " has too many arguments");
+            entries[f.second.first] = f.second.second;
+        }
+        for (auto w : program.code)
+            if (Instruction((w>>24) & 0xff) == LoadVarAddr) addressed.insert(w & 0xffffff);
+
+        // calls continue with the values their callee returns, so functions
+        // are analyzed again until no return changes. Paths through a call
+        // whose callee hasn't been seen returning yet are left for later.
+        std::map<PTR, int> words;
+        bool changed = true;
+        while (changed) {
+            changed = false;
+            for (auto &e : entries) {
+                int w = function(e.first, changed);
+                words[e.first] = w;
+            }
+        }
+        for (auto pc : code)
+            if (data.count(pc)) fail("constant executed as code", pc);
+        return words;
+    }
+
+private:
+    // what is known of a value on the op stack
+    enum class Shape : uint8_t {
+        Scalar, // one word, not a tuple
+        Word,   // one word, maybe a boxed tuple
+        Ptr,    // a pointer
+        Str,    // a constant string, n is its address
+        Tuple,  // an inline tuple of n elements
+        Any,    // maybe an inline tuple
+    };
+
+    struct Value {
+        Shape shape;
+        PTR n;
+        bool operator==(const Value &o) const { return shape == o.shape && n == o.n; }
+        bool operator!=(const Value &o) const { return !(*this == o); }
+    };
+    using Stack = std::vector<Value>;
+
+    // the op stack, and the locals of the frame, which never hold inline tuples
+    struct State {
+        Stack stack;
+        Stack locals;
+    };
+
+    // how an instruction takes a value off the op stack
+    enum class Take {
+        Whole,  // with the elements of an inline tuple
+        Word,   // its top word, the instruction fails on a tuple
+        Single, // its top word, must not be an inline tuple
+    };
+
+    const vmunit &program;
+    std::map<PTR, int> entries;
+    std::set<PTR> strings;
+    std::set<PTR> data;
+    std::set<PTR> code;
+    std::set<PTR> closures;
+    // locals written through pointers, in any function
+    std::set<uint32_t> addressed;
+    std::map<PTR, Stack> returns;
+    PTR current;    // entry of the function analyzed
+
+    [[noreturn]] void fail(const std::string &why, PTR pc = ENDPC) {
+        if (pc == ENDPC) throw std::runtime_error("Can't verify : " + why);
+        throw std::runtime_error("Can't verify : " + why + " at " + std::to_string(pc));
+    }
+
+    static int words(const Value &v) {
+        if (v.shape == Shape::Tuple) return 1 + v.n;
+        if (v.shape == Shape::Any) return 1 + VirtualMachine::MAX_INLINE_TUPLE;
+        return 1;
+    }
+
+    static bool single(const Value &v) { return v.shape != Shape::Tuple && v.shape != Shape::Any; }
+
+    static Value join(const Value &a, const Value &b) {
+        if (a == b) return a;
+        if (!single(a) || !single(b)) return {Shape::Any, 0};
+        if (a.shape == Shape::Word || b.shape == Shape::Word) return {Shape::Word, 0};
+        return {Shape::Scalar, 0};
+    }
+
+    // joins s into into, true when it changed
+    static bool merge(Stack &into, const Stack &s) {
+        bool changed = false;
+        for (size_t i=0;i<s.size();i++) {
+            Value v = join(into[i], s[i]);
+            if (v != into[i]) {
+                into[i] = v;
+                changed = true;
+            }
+        }
+        return changed;
+    }
+
+    // the state of pc joins s, true when it changed
+    bool merge(std::map<PTR, State> &states, PTR pc, const State &s) {
+        auto it = states.find(pc);
+        if (it == states.end()) {
+            states[pc] = s;
+            return true;
+        }
+        if (it->second.stack.size() != s.stack.size()) fail("op stack depth differs between paths", pc);
+        bool changed = merge(it->second.stack, s.stack);
+        return merge(it->second.locals, s.locals) || changed;
+    }
+
+    Value take(Stack &s, Take how, PTR pc) {
+        if (s.empty()) fail("op stack underflow", pc);
+        Value v = s.back();
+        s.pop_back();
+        if (how == Take::Single && !single(v)) fail("inline tuple used as a single value", pc);
+        return v;
+    }
+
+    void target(PTR to, PTR pc) {
+        if (to >= program.code.size()) fail("jump out of the code", pc);
+    }
+
+    void local(uint32_t index, PTR pc) {
+        if (index >= (uint32_t)VirtualMachine::LOCAL_VARS_SIZE) fail("local out of the frame", pc);
+    }
+
+    PTR entry(PTR addr, PTR pc) {
+        if (!entries.count(addr)) fail("call of something that isn't a function", pc);
+        return addr;
+    }
+
+    // the values a call of addr leaves, false while it isn't known to return
+    bool result(PTR addr, Stack &s) {
+        auto it = returns.find(addr);
+        if (it == returns.end()) return false;
+        s.insert(s.end(), it->second.begin(), it->second.end());
+        return true;
+    }
+
+    // values popped by printf and format, after the format string
+    int formatArgs(PTR addr) {
+        const char *s = (const char*)&program.code[addr+1];
+        const char *end = s + program.code[addr];
+        int n = 0;
+        while (s < end) {
+            auto c = (const char*)memchr(s, '%', end-s);
+            if (!c || c+1 >= end) break;
+            char c1 = c[1];
+            if (c1 == 'd' || c1 == 'i' || c1 == 'f' || c1 == 'g' || c1 == 's') n++;
+            s = c+2;
+        }
+        return n;
+    }
+
+    // returns the most op stack words the function uses
+    int function(PTR start, bool &changed) {
+        current = start;
+        std::map<PTR, State> states;
+        std::vector<PTR> work = {start};
+        states[start] = {{}, Stack(VirtualMachine::LOCAL_VARS_SIZE, {Shape::Word, 0})};
+        int most = 0;
+        while (!work.empty()) {
+            PTR pc = work.back();
+            work.pop_back();
+            if (pc >= program.code.size()) fail("execution runs off the code", pc);
+            code.insert(pc);
+            State s = states[pc];
+            std::vector<PTR> next;
+            bool falls = instruction(pc, s.stack, s.locals, next, changed);
+            if (falls) next.push_back(pc+1);
+            int w = 0;
+            for (auto &v : s.stack) w += words(v);
+            most = std::max(most, w);
+            for (auto n : next)
+                if (merge(states, n, s)) work.push_back(n);
+        }
+        return most;
+    }
+
+    // the effect of the instruction at pc on s, jump targets go to next,
+    // false when it doesn't continue with the next instruction
+    bool instruction(PTR pc, Stack &s, Stack &locals, std::vector<PTR> &next, bool &changed) {
+        Instruction i0 = Instruction((program.code[pc]>>24) & 0xff);
+        uint32_t i1 = program.code[pc] & 0xffffff;
+        const Value scalar = {Shape::Scalar, 0}, word = {Shape::Word, 0}, ptr = {Shape::Ptr, 0};
+        auto pops = [&](int n, Take how) {
+            for (int i=0;i<n;i++) take(s, how, pc);
+        };
+
+        switch (i0) {
+            case Noop: break;
+            case LoadInt:
+            case LoadFloat:
+                if (i1 >= program.code.size()) fail("constant out of the code", pc);
+                data.insert(i1);
+                s.push_back(scalar);
+                break;
+            case LoadStr:
+                if (!strings.count(i1)) fail("load_str of something that isn't a string", pc);
+                s.push_back({Shape::Str, i1});
+                break;
+            case LoadVarAddr:
+                local(i1, pc);
+                s.push_back(ptr);
+                break;
+            case LoadVar:
+                local(i1, pc);
+                s.push_back(addressed.count(i1) ? word : locals[i1]);
+                break;
+            case LoadMem:
+                if (take(s, Take::Word, pc).shape != Shape::Ptr) fail("load_mem from a non-pointer", pc);
+                s.push_back(word);
+                break;
+            case StoreMem:
+                take(s, Take::Whole, pc);
+                if (take(s, Take::Word, pc).shape != Shape::Ptr) fail("store_mem to a non-pointer", pc);
+                break;
+            case StoreVar: {
+                local(i1, pc);
+                // inline tuples are boxed
+                Value v = take(s, Take::Whole, pc);
+                locals[i1] = single(v) ? v : word;
+                break;
+            }
+            case Call:
+            case CallMemo:
+                pops(entries[entry(i1, pc)], Take::Whole);
+                if (!result(i1, s)) return false;
+                break;
+            case CallExt: {
+                if (i1 >= natives.size()) fail("unknown native", pc);
+                const Native &n = natives[i1];
+                if (i1 == Printf || i1 == Format) {
+                    Value f = take(s, Take::Word, pc);
+                    if (f.shape != Shape::Str) fail("format string isn't a constant", pc);
+                    pops(formatArgs(f.n), Take::Word);
+                } else if (n.numArgs < 0) fail("variadic native " + n.name, pc);
+                else pops(n.numArgs, Take::Whole);
+                for (int i=0;i<n.numResults;i++) s.push_back(word);
+                break;
+            }
+            case Pop: take(s, Take::Whole, pc); break;
+            case Return: {
+                auto it = returns.find(current);
+                if (it == returns.end()) {
+                    returns[current] = s;
+                    changed = true;
+                } else {
+                    if (it->second.size() != s.size()) fail("returns with different op stack depths", pc);
+                    for (size_t i=0;i<s.size();i++) {
+                        Value v = join(it->second[i], s[i]);
+                        if (v != it->second[i]) {
+                            it->second[i] = v;
+                            changed = true;
+                        }
+                    }
+                }
+                return false;
+            }
+            case IfJump:
+            case IfNJump:
+                take(s, Take::Word, pc);
+                target(i1, pc);
+                next.push_back(i1);
+                break;
+            case IfJumpInt:
+            case IfNJumpInt:
+                take(s, Take::Single, pc);
+                target(i1, pc);
+                next.push_back(i1);
+                break;
+            case Jump:
+                target(i1, pc);
+                next.push_back(i1);
+                return false;
+            case Not:
+                take(s, Take::Word, pc);
+                s.push_back(scalar);
+                break;
+            case And: case Or:
+            case Mul: case Div: case Mod: case Sub:
+            case Lteq: case Lt: case Gt: case Gteq: case Eq: case Neq:
+                pops(2, Take::Word);
+                s.push_back(scalar);
+                break;
+            case Usub:
+                take(s, Take::Single, pc);
+                s.push_back(scalar);
+                break;
+            case Add: {
+                // a tuple on top is concatenated, into an inline tuple if it's small
+                Value top = take(s, Take::Whole, pc);
+                take(s, Take::Whole, pc);
+                bool tuple = top.shape == Shape::Word || !single(top);
+                s.push_back(tuple ? Value{Shape::Any, 0} : scalar);
+                break;
+            }
+            case Inc:
+                local(i1, pc);
+                take(s, Take::Word, pc);
+                locals[i1] = scalar;
+                break;
+            case ListCreate:
+            case ListCreateLocal:
+                pops(i1, Take::Whole);
+                s.push_back(scalar);
+                break;
+            case ListAccessPtr:
+            case ListAccess:
+                pops(2, Take::Whole);
+                s.push_back(i0 == ListAccessPtr ? ptr : word);
+                break;
+            case ListLength:
+                take(s, Take::Single, pc);
+                s.push_back(scalar);
+                break;
+            case TupleCreate:
+                pops(i1, Take::Whole);
+                if (i1 <= (uint32_t)VirtualMachine::MAX_INLINE_TUPLE) s.push_back({Shape::Tuple, i1});
+                else s.push_back(word);
+                break;
+            case TupleConcat:
+                pops(2, Take::Whole);
+                s.push_back({Shape::Any, 0});
+                break;
+            case TupleAccessPtr:
+                take(s, Take::Whole, pc);
+                s.push_back(ptr);
+                break;
+            case TupleAccess:
+                take(s, Take::Whole, pc);
+                s.push_back(word);
+                break;
+            case TupleUnpack:
+                if (i1 > (uint32_t)VirtualMachine::MAX_OP_STACK_SIZE) fail("tuple_unpack of too many values", pc);
+                take(s, Take::Whole, pc);
+                for (uint32_t i=0;i<i1;i++) s.push_back(word);
+                break;
+            case ClosureCreate:
+                if (closures.insert(entry(i1, pc)).second) changed = true;
+                s.push_back(scalar);
+                break;
+            case ClosureCall: {
+                take(s, Take::Word, pc);
+                pops(i1, Take::Whole);
+                // any function made into a closure with as many arguments
+                Stack res;
+                bool known = false;
+                for (auto c : closures) {
+                    Stack r;
+                    if (entries[c] != (int)i1 || !result(c, r)) continue;
+                    if (!known) res = r;
+                    else if (r.size() != res.size()) fail("closures return different numbers of values", pc);
+                    else for (size_t i=0;i<r.size();i++) res[i] = join(res[i], r[i]);
+                    known = true;
+                }
+                if (!known) return false;
+                s.insert(s.end(), res.begin(), res.end());
+                break;
+            }
+            case MapCreate:
+                pops(2*i1, Take::Whole);
+                s.push_back(scalar);
+                break;
+            case MapAdd:
+                pops(2, Take::Whole);
+                if (s.empty()) fail("op stack underflow", pc);
+                break;
+            case MapAccessPtr:
+            case MapAccess:
+                take(s, Take::Whole, pc);
+                take(s, Take::Word, pc);
+                s.push_back(i0 == MapAccessPtr ? ptr : word);
+                break;
+            case MapRemove:
+            case MapHas:
+                take(s, Take::Word, pc);
+                take(s, Take::Whole, pc);
+                s.push_back(scalar);
+                break;
+            case AddInt: case SubInt: case MulInt: case DivInt: case ModInt:
+            case LtInt: case LteqInt: case GtInt: case GteqInt: case EqInt: case NeqInt:
+            case AddFloat: case SubFloat: case MulFloat: case DivFloat:
+            case ListAccessInt:
+                pops(2, Take::Single);
+                s.push_back(scalar);
+                break;
+            case ListAccessU:
+            case ListAccessPtrU:
+                pops(2, Take::Single);
+                s.push_back(i0 == ListAccessPtrU ? ptr : word);
+                break;
+            default:
+                fail("unknown opcode", pc);
+        }
+        return true;
+    }
+};
@@ -1,6 +1,13 @@
 #include "VirtualMachine.h"
+#include "Verifier.h"
 
 #include <tuple>
+#include <sstream>
+#include <atomic>
+#include <exception>
+#include <cmath>
+#include <csignal>
+#include <sys/time.h>
 
 using namespace std;
 
@@ -16,6 +23,16 @@ DWORD makeValue(Type t, WORD d) {
     return DWORD(t) << 32 | d;
 }
 
+// set on a tuple header whose elements are stored right below it on the op stack
+const DWORD INLINE_TUPLE = DWORD(1) << 40;
+
+bool isInlineTuple(DWORD v) {
+    return (v & INLINE_TUPLE) && Type((v>>32) & 0xff) == Tuple;
+}
+
+// set on the length word of a duplicate string constant, the rest is the interned address
+const WORD STRING_FORWARD = WORD(1) << 31;
+
 tuple<Type, int32_t> extract(DWORD a) {
     WORD b = (a >> 0) & 0xffffffff;
     return make_tuple(
@@ -33,7 +50,22 @@ tuple<Instruction, uint32_t> decode(WORD i) {
         uint32_t((i >> 0) & 0xffffff));
 }
 
-void VirtualMachine::step() {
+template<typename F>
+void VirtualMachine::intOp(F f) {
+    PTR top = OP_STACK_START+2*(--opStackFrame);
+    int32_t d = getDword(top), d2 = getDword(top-2);
+    setDword(top-2, makeValue(Int, f(d, d2)));
+}
+
+template<typename F>
+void VirtualMachine::floatOp(F f) {
+    PTR top = OP_STACK_START+2*(--opStackFrame);
+    float d = asfloat(getDword(top)), d2 = asfloat(getDword(top-2));
+    setDword(top-2, makeValue(Float, asint(f(d, d2))));
+}
+
+template<typename P>
+void VirtualMachine::exec() {
     Instruction i0; uint32_t i1;
     tie(i0, i1) = decode(memory[PC]);
     PC++;
@@ -43,83 +75,87 @@ void VirtualMachine::step() {
 
     switch (i0) {
         case Noop: break;
-        case LoadInt: pushOpStack(makeValue(Int, memory[i1])); break;
-        case LoadFloat: pushOpStack(makeValue(Float, memory[i1])); break;
-        case LoadStr: pushOpStack(makeValue(String, i1)); break;
+        case LoadInt: pushOpStack<P>(makeValue(Int, memory[i1])); break;
+        case LoadFloat: pushOpStack<P>(makeValue(Float, memory[i1])); break;
+        case LoadStr:
+            if (memory[i1] & STRING_FORWARD) i1 = asPtr(memory[i1]);
+            pushOpStack<P>(makeValue(String, i1));
+            break;
         case LoadVarAddr: 
-            pushOpStack(makeValue(Pointer, getStackPtr(i1))); break;
+            pushOpStack<P>(makeValue(Pointer, getStackPtr<P>(i1))); break;
         case LoadVar:
-            pushOpStack(getDword(getStackPtr(i1))); break;
+            pushOpStack<P>(getDword(getStackPtr<P>(i1))); break;
         case LoadMem :
-            tie(t,d) = extract(popOpStack());
-            if (t != Pointer) throw runtime_error("Can't read from memory from a non-pointer");
-            pushOpStack(getDword(asPtr(d)));
+            v = popOpStack<P>();
+            if (P::checks && get<0>(extract(v)) != Pointer) throw runtime_error("Can't read from memory from a non-pointer");
+            pushOpStack<P>(load_ptr(v));
             break;
-        case StoreMem:
-            v = popOpStack();
-            tie(t,d) = extract(popOpStack());
-            if (t != Pointer) throw runtime_error("Can't write to memory with a non-pointer");
-            deepFree(getDword(asPtr(d)));
-            setDword(asPtr(d), v);
+        case StoreMem: {
+            v = popValue<P>();
+            DWORD ptr = popOpStack<P>();
+            if (P::checks && get<0>(extract(ptr)) != Pointer) throw runtime_error("Can't write to memory with a non-pointer");
+            store_ptr(ptr, v);
             break;
+        }
         case StoreVar:
-            deepFree(getStackPtr(i1));
-            setDword(getStackPtr(i1), popOpStack()); break;
+            deepFree(getStackPtr<P>(i1));
+            setDword(getStackPtr<P>(i1), popValue<P>()); break;
         case Call: {
             auto addr = asPtr(i1);
-            if (addr >= CODE_START && addr < CODE_END) { 
-                newStack(PC);
+            if (!P::checks || (addr >= CODE_START && addr < CODE_END)) {
+                newStack(PC, addr);
                 for (int i=0;i<funcNumArgs[addr];i++)
-                    setDword(getStackPtr(i), popOpStack());
+                    setDword(getStackPtr<P>(i), popValue<P>());
                 PC = addr;
             }
             break;
         }
+        case CallMemo: call_memo<P>(asPtr(i1)); break;
         case CallExt: {
-            auto func = stdlib[(ReservedFuncs)i1];
-            (this->*func)();
+            auto &n = natives[i1];
+            n.thunk(*this, n.fn);
             break;
         }
         case Return: PC = popStack(); break;
-        case Pop: popOpStack(); break;
+        case Pop: dropValue(); break;
         case IfJump: {
-            tie(t,d) = extract(popOpStack());
+            tie(t,d) = extract(popOpStack<P>());
             if (t != Int) throw runtime_error("Can't evaluate a non-int");
             if (d) PC = asPtr(i1);
             break;
         }
         case IfNJump: {
-            tie(t,d) = extract(popOpStack());
+            tie(t,d) = extract(popOpStack<P>());
             if (t != Int) throw runtime_error("Can't evaluate a non-int");
             if (!d) PC = asPtr(i1);
             break;
         }
         case Jump: PC = asPtr(i1); break;
         case Not: {
-            tie(t,d) = extract(popOpStack());
+            tie(t,d) = extract(popOpStack<P>());
             if (t != Int) throw runtime_error("Can't `not` with non-int");
-            pushOpStack(makeValue(Int, !d));
+            pushOpStack<P>(makeValue(Int, !d));
             break;
         }
         case And: {
-            tie(t,d) = extract(popOpStack());
-            tie(t2,d2) = extract(popOpStack());
+            tie(t,d) = extract(popOpStack<P>());
+            tie(t2,d2) = extract(popOpStack<P>());
             if (t != Int || t2 != Int) throw runtime_error("Can't `and` with non-int");
-            pushOpStack(makeValue(Int, d && d2));
+            pushOpStack<P>(makeValue(Int, d && d2));
             break;
         }
         case Or: {
-            tie(t,d) = extract(popOpStack());
-            tie(t2,d2) = extract(popOpStack());
+            tie(t,d) = extract(popOpStack<P>());
+            tie(t2,d2) = extract(popOpStack<P>());
             if (t != Int || t2 != Int) throw runtime_error("Can't `and` with non-int");
-            pushOpStack(makeValue(Int, d || d2));
+            pushOpStack<P>(makeValue(Int, d || d2));
             break;
         }
         case Usub: {
-            tie(t,d) = extract(popOpStack());
+            tie(t,d) = extract(popOpStack<P>());
             int32_t neg = -d;
             if (t == Float) neg = asint(-asfloat(d));
-            pushOpStack(makeValue(t, neg));
+            pushOpStack<P>(makeValue(t, neg));
             break;
         }
         case Mul:
@@ -127,18 +163,25 @@ void VirtualMachine::step() {
         case Div:
             binOp([](float a, float b){return a/b;},[](float a, float b){return a/b;});break;
         case Mod: {
-            tie(t,d) = extract(popOpStack());
-            tie(t2,d2) = extract(popOpStack());
+            tie(t,d) = extract(popOpStack<P>());
+            tie(t2,d2) = extract(popOpStack<P>());
             if (t2 == Float && t == Float) throw runtime_error("Cant' `mod` with non-int");
-            pushOpStack(makeValue(t, d%d2));
+            if (t == Tuple || t2 == Tuple) throw runtime_error("Can't `mod` with a tuple");
+            pushOpStack<P>(makeValue(t, d%d2));
             break;
         }
         case Add: {
-            tie(t,d) = extract(popOpStack());
-            auto v = popOpStack();
+            if (get<0>(extract(peekOpStack<P>())) == Tuple) {
+                tuple_concat();
+                break;
+            }
+            tie(t,d) = extract(popOpStack<P>());
+            auto v = popValue<P>();
             tie(t2,d2) = extract(v); 
 
-            if (t == List) {
+            if (t == String || t2 == String) {
+                pushOpStack<P>(makeValue(String, string_intern(to_text(makeValue(t, d)) + to_text(v))));
+            } else if (t == List) {
                 if (t2 == List) list_concat(d,d2);
                 else list_add(d, v);
             } else {
@@ -150,7 +193,7 @@ void VirtualMachine::step() {
                     if (t2 == Float) res = asint((float)d+asfloat(d2));
                     else res = d+d2;
                 }
-                pushOpStack(makeValue((t==Int && t2==Int)?Int:Float, res));
+                pushOpStack<P>(makeValue((t==Int && t2==Int)?Int:Float, res));
             }
             break;
         }
@@ -169,36 +212,312 @@ void VirtualMachine::step() {
         case Neq:
             binOpRel([](int32_t a, int32_t b){return a!=b;},[](float a, float b){return a!=b;}); break;
         case Inc:
-            tie(t,d) = extract(getDword(getStackPtr(i1)));
-            tie(t2,d2) = extract(popOpStack());
+            tie(t,d) = extract(getDword(getStackPtr<P>(i1)));
+            tie(t2,d2) = extract(popOpStack<P>());
             if (t == Int && t2 == Int) {
-                setDword(getStackPtr(i1),makeValue(Int, d+d2));
+                setDword(getStackPtr<P>(i1),makeValue(Int, d+d2));
             } else throw runtime_error("inc supported only for ints");
             break;
         case ListCreate: list_create(i1); break;
         case ListAccessPtr: list_access_ptr(); break;
         case ListAccess: list_access(); break;
         case ListLength: list_length(); break;
+        case ListCreateLocal: list_create_local(i1); break;
+        case TupleCreate: tuple_create(i1); break;
+        case TupleConcat: tuple_concat(); break;
+        case TupleAccessPtr: tuple_access_ptr(i1); break;
+        case TupleAccess: tuple_access(i1); break;
+        case TupleUnpack: tuple_unpack(i1); break;
+        case MapCreate: map_create(i1); break;
+        case MapAdd: map_add(); break;
+        case MapAccessPtr: map_access_ptr(); break;
+        case MapAccess: map_access(); break;
+        case MapRemove: map_remove(); break;
+        case MapHas: map_has(); break;
+        case ClosureCreate: closure_create(asPtr(i1)); break;
+        case ClosureCall: closure_call(i1); break;
+        case AddInt: intOp([](int32_t a, int32_t b){return a+b;}); break;
+        case SubInt: intOp([](int32_t a, int32_t b){return a-b;}); break;
+        case MulInt: intOp([](int32_t a, int32_t b){return (int32_t)((float)a*(float)b);}); break;
+        case DivInt: intOp([](int32_t a, int32_t b){return (int32_t)((float)a/(float)b);}); break;
+        case ModInt: intOp([](int32_t a, int32_t b){return a%b;}); break;
+        case LtInt: intOp([](int32_t a, int32_t b){return a<b;}); break;
+        case LteqInt: intOp([](int32_t a, int32_t b){return a<=b;}); break;
+        case GtInt: intOp([](int32_t a, int32_t b){return a>b;}); break;
+        case GteqInt: intOp([](int32_t a, int32_t b){return a>=b;}); break;
+        case EqInt: intOp([](int32_t a, int32_t b){return a==b;}); break;
+        case NeqInt: intOp([](int32_t a, int32_t b){return a!=b;}); break;
+        case AddFloat: floatOp([](float a, float b){return a+b;}); break;
+        case SubFloat: floatOp([](float a, float b){return a-b;}); break;
+        case MulFloat: floatOp([](float a, float b){return a*b;}); break;
+        case DivFloat: floatOp([](float a, float b){return a/b;}); break;
+        case IfJumpInt:
+            if (int32_t(popOpStack<P>())) PC = asPtr(i1);
+            break;
+        case IfNJumpInt:
+            if (!int32_t(popOpStack<P>())) PC = asPtr(i1);
+            break;
+        case ListAccessInt: {
+            d2 = popOpStack<P>();
+            PTR p = list_resolve(asPtr(popOpStack<P>()));
+            if (d2 < 0 || d2 >= (int)memory[p]) throw runtime_error("Access out of bounds");
+            pushOpStack<P>(makeValue(Int, memory[p+2+d2]));
+            break;
+        }
+        case ListAccessU: list_access_u(); break;
+        case ListAccessPtrU: list_access_ptr_u(); break;
         default: throw runtime_error("Unsupported opcode");
     }
 }
 
+void VirtualMachine::step() {
+    if (perf) perf_step();
+    else if (checkFree) exec<CheckFree>();
+    else exec<Checked>();
+    // PC, stackFrame and the address stack are in memory between
+    // instructions, where the sampler reads them
+    if (samples) atomic_signal_fence(memory_order_seq_cst);
+}
+
+template<typename P>
+void VirtualMachine::exec_until_done() {
+    if (cacheTop) exec_cached<P>(UINT64_MAX);
+    else while (!finished() && (P::checks || checkFree)) exec<P>();
+}
+
+// opStackFrame counts the cached value, its slot in memory is stale until
+// it is spilled
+template<typename P>
+uint64_t VirtualMachine::exec_cached(uint64_t n) {
+    DWORD tos = 0;
+    bool cached = false;
+    auto spill = [&]() {
+        if (cached) setDword(OP_STACK_START+2*(opStackFrame-1), tos);
+        cached = false;
+    };
+    auto push = [&](DWORD v) {
+        if (P::checks && opStackFrame == MAX_OP_STACK_SIZE-1) throw runtime_error("Operand stack overflow");
+        spill();
+        tos = v;
+        cached = true;
+        opStackFrame++;
+    };
+    auto top = [&]() -> DWORD& {
+        if (!cached) {
+            if (P::checks && opStackFrame == 0) throw runtime_error("Operand stack underflow");
+            tos = getDword(OP_STACK_START+2*(opStackFrame-1));
+            cached = true;
+        }
+        return tos;
+    };
+    auto pop = [&]() {
+        DWORD v = top();
+        cached = false;
+        opStackFrame--;
+        return v;
+    };
+    // the result replaces the second operand
+    auto intOp = [&](int32_t (*f)(int32_t, int32_t)) {
+        int32_t d = pop();
+        DWORD &d2 = top();
+        d2 = makeValue(Int, f(d, int32_t(d2)));
+    };
+    auto floatOp = [&](float (*f)(float, float)) {
+        float d = asfloat(pop());
+        DWORD &d2 = top();
+        d2 = makeValue(Float, asint(f(d, asfloat(d2))));
+    };
+    // a generic op on two ints gives the same result as its typed form
+    auto ints = [&]() {
+        return opStackFrame >= 2 && get<0>(extract(top())) == Int
+            && get<0>(extract(getDword(OP_STACK_START+2*(opStackFrame-2)))) == Int;
+    };
+
+    uint64_t done = 0;
+    while (done < n && !finished() && (P::checks || checkFree)) {
+        done++;
+        Instruction i0; uint32_t i1;
+        tie(i0, i1) = decode(memory[PC]);
+        PC++;
+        Type t,t2; int32_t d,d2;
+
+        switch (i0) {
+            case Noop: break;
+            case LoadInt: push(makeValue(Int, memory[i1])); break;
+            case LoadFloat: push(makeValue(Float, memory[i1])); break;
+            case LoadVar: push(getDword(getStackPtr<P>(i1))); break;
+            case StoreVar:
+                // inline tuples are boxed by exec
+                if (isInlineTuple(top())) goto fallback;
+                deepFree(getStackPtr<P>(i1));
+                setDword(getStackPtr<P>(i1), pop());
+                break;
+            case Jump: PC = asPtr(i1); break;
+            case IfJump:
+            case IfNJump:
+                tie(t,d) = extract(pop());
+                if (t != Int) throw runtime_error("Can't evaluate a non-int");
+                if ((d != 0) == (i0 == IfJump)) PC = asPtr(i1);
+                break;
+            case IfJumpInt:
+                if (int32_t(pop())) PC = asPtr(i1);
+                break;
+            case IfNJumpInt:
+                if (!int32_t(pop())) PC = asPtr(i1);
+                break;
+            case Inc:
+                tie(t,d) = extract(getDword(getStackPtr<P>(i1)));
+                tie(t2,d2) = extract(pop());
+                if (t == Int && t2 == Int) {
+                    setDword(getStackPtr<P>(i1), makeValue(Int, d+d2));
+                } else throw runtime_error("inc supported only for ints");
+                break;
+            // generic ops fall through to their typed form when both operands are ints
+            case Add: if (!ints()) goto fallback;
+            case AddInt: intOp([](int32_t a, int32_t b){return a+b;}); break;
+            case Sub: if (!ints()) goto fallback;
+            case SubInt: intOp([](int32_t a, int32_t b){return a-b;}); break;
+            case Mul: if (!ints()) goto fallback;
+            case MulInt: intOp([](int32_t a, int32_t b){return (int32_t)((float)a*(float)b);}); break;
+            case Div: if (!ints()) goto fallback;
+            case DivInt: intOp([](int32_t a, int32_t b){return (int32_t)((float)a/(float)b);}); break;
+            case Mod: if (!ints()) goto fallback;
+            case ModInt: intOp([](int32_t a, int32_t b){return a%b;}); break;
+            case Lt: if (!ints()) goto fallback;
+            case LtInt: intOp([](int32_t a, int32_t b){return (int32_t)(a<b);}); break;
+            case Lteq: if (!ints()) goto fallback;
+            case LteqInt: intOp([](int32_t a, int32_t b){return (int32_t)(a<=b);}); break;
+            case Gt: if (!ints()) goto fallback;
+            case GtInt: intOp([](int32_t a, int32_t b){return (int32_t)(a>b);}); break;
+            case Gteq: if (!ints()) goto fallback;
+            case GteqInt: intOp([](int32_t a, int32_t b){return (int32_t)(a>=b);}); break;
+            case Eq: if (!ints()) goto fallback;
+            case EqInt: intOp([](int32_t a, int32_t b){return (int32_t)(a==b);}); break;
+            case Neq: if (!ints()) goto fallback;
+            case NeqInt: intOp([](int32_t a, int32_t b){return (int32_t)(a!=b);}); break;
+            case AddFloat: floatOp([](float a, float b){return a+b;}); break;
+            case SubFloat: floatOp([](float a, float b){return a-b;}); break;
+            case MulFloat: floatOp([](float a, float b){return a*b;}); break;
+            case DivFloat: floatOp([](float a, float b){return a/b;}); break;
+            case ListAccessInt: {
+                d2 = pop();
+                PTR p = list_resolve(asPtr(top()));
+                if (d2 < 0 || d2 >= (int)memory[p]) throw runtime_error("Access out of bounds");
+                tos = makeValue(Int, memory[p+2+d2]);
+                break;
+            }
+            default:
+            fallback:
+                PC--;
+                spill();
+                exec<P>();
+                // yield ends run_for and run_until, the next call resumes
+                if (yielded) return done;
+        }
+    }
+    spill();
+    return done;
+}
+
+void VirtualMachine::load(vmunit program) {
+    verified = false;
+    verifyError = "";
+    if (verify) {
+        try {
+            funcOpStackWords = Verifier(program).run();
+            verified = true;
+        } catch (runtime_error &e) {
+            verifyError = e.what();
+        }
+    }
+    memcpy(memory, program.code.data(), program.code.size()*sizeof(WORD));
+    for (auto f : program.funcs) {
+        funcNames[f.first] = f.second.first;
+        funcNumArgs[f.second.first] = f.second.second;
+    }
+    sourceLines = program.lines;
+    for (auto s : program.strings) intern_constant(s);
+    // results are cached by code address
+    memo.clear();
+    memoCalls.clear();
+}
+
+// the VM the SIGPROF handler samples on this thread
+static thread_local VirtualMachine *sampledVM = nullptr;
+
+struct SampledScope {
+    VirtualMachine *prev = sampledVM;
+    SampledScope(VirtualMachine *vm) { if (vm) sampledVM = vm; }
+    ~SampledScope() { sampledVM = prev; }
+};
+
 void VirtualMachine::run(std::string funcname) {
+    SampledScope scope(samples ? this : nullptr);
+    start(funcname);
+    while (!finished()) {
+        if (perf || samples) step();
+        else if (checkFree) exec_until_done<CheckFree>();
+        else exec_until_done<Checked>();
+    }
+}
+
+void VirtualMachine::start(std::string funcname) {
     auto it = funcNames.find(funcname);
     if (it == funcNames.end()) throw runtime_error("Can't find entry function");
     PC = it->second;
-    newStack();
-    while (PC != ENDPC && PC < CODE_END) {
-        step();
+    checkFree = verified;
+    memoCalls.clear();
+    newStack(ENDPC, PC);
+    for (int i=0;i<funcNumArgs[PC];i++)
+        setDword(getStackPtr(i), popValue());
+    error = "";
+}
+
+RunStatus VirtualMachine::execute(uint64_t n) {
+    if (!error.empty()) return RunStatus::Error;
+    SampledScope scope(samples ? this : nullptr);
+    try {
+        for (uint64_t i=0;i<n && !finished() && !yielded;) {
+            if (!cacheTop || perf || samples) {
+                step();
+                i++;
+            } else if (checkFree) i += exec_cached<CheckFree>(n-i);
+            else i += exec_cached<Checked>(n-i);
+        }
+    } catch (exception &e) {
+        error = e.what();
+        return RunStatus::Error;
+    }
+    return finished() ? RunStatus::Finished : RunStatus::Yielded;
+}
+
+RunStatus VirtualMachine::run_for(uint64_t n) {
+    RunStatus s = execute(n);
+    yielded = false;
+    return s;
+}
+
+RunStatus VirtualMachine::run_until(chrono::steady_clock::time_point deadline) {
+    while (true) {
+        RunStatus s = execute(DEADLINE_CHECK_INTERVAL);
+        if (s != RunStatus::Yielded || yielded || chrono::steady_clock::now() >= deadline) {
+            yielded = false;
+            return s;
+        }
     }
 }
 
+void VirtualMachine::yield() {
+    yielded = true;
+}
+
 void VirtualMachine::binOp(binopint fi, binopfloat ff) {
     Type t,t2; int32_t d,d2;
     tie(t,d) = extract(popOpStack());
     tie(t2,d2) = extract(popOpStack());
     int32_t res;
     if (t == Nil || t2 == Nil) throw runtime_error("Can't binop with nil");
+    if (t == Tuple || t2 == Tuple) throw runtime_error("Can't binop with a tuple");
     if (t == Float) {
         if (t2 == Float) res = asint(ff(asfloat(d),asfloat(d2)));
         else res = asint(ff(asfloat(d),(float)d2));
@@ -215,6 +534,7 @@ void VirtualMachine::binOpRel(binopint fi, binopfloat ff) {
     tie(t2,d2) = extract(popOpStack());
     int32_t res;
     if (t == Nil || t2 == Nil) throw runtime_error("Can't binop with nil");
+    if (t == Tuple || t2 == Tuple) throw runtime_error("Can't binop with a tuple");
     if (t == Float) {
         if (t2 == Float) res = asint(ff(asfloat(d),asfloat(d2)));
         else res = asint(ff(asfloat(d),(float)d2));
@@ -226,114 +546,463 @@ void VirtualMachine::binOpRel(binopint fi, binopfloat ff) {
 }
 
 void VirtualMachine::printf() {
+    format_to(out);
+}
+
+void VirtualMachine::format() {
+    stringstream ss;
+    format_to(ss);
+    pushOpStack(makeValue(String, string_intern(ss.str())));
+}
+
+void VirtualMachine::format_to(ostream &o) {
     Type t; int32_t v; tie(t,v) = extract(popOpStack());
-    if (t != String) throw "Invalid argument 0 for printf";
+    if (t != String) throw runtime_error("Invalid format string");
 
     auto addr = asPtr(v);
+    const char *s = (const char*)&memory[addr+1];
+    const char *end = s + memory[addr];
 
-    while (true) {
-        char c = (char)memory[addr];
-        if (c == '\0') break;
-        if (c == '%') {
-            addr++;
-            char c1 = (char)memory[addr];
-            if (c1 == 'd' || c1 == 'i') {
-                tie(t,v) = extract(popOpStack());
-                if (t == Float) out << (int)asfloat(v);
-                else  out << v;
-            } else if (c1 == 'f' || c1 == 'g') {
-                tie(t,v) = extract(popOpStack());
-                if (t == Float) out << asfloat(v);
-                else out << (float)v;
-            }
-        } else {
-            out << c;
+    while (s < end) {
+        auto c = (const char*)memchr(s, '%', end-s);
+        if (!c) c = end;
+        o.write(s, c-s);
+        if (c == end) break;
+        // a trailing or unknown conversion is printed as written
+        if (c+1 == end) {
+            o << '%';
+            break;
         }
-        addr++;
+        char c1 = c[1];
+        if (c1 == 'd' || c1 == 'i') {
+            tie(t,v) = extract(popOpStack());
+            if (t == Tuple) throw runtime_error("Can't format a tuple as a number");
+            if (t == Float) o << (int)asfloat(v);
+            else o << v;
+        } else if (c1 == 'f' || c1 == 'g') {
+            tie(t,v) = extract(popOpStack());
+            if (t == Tuple) throw runtime_error("Can't format a tuple as a number");
+            if (t == Float) o << asfloat(v);
+            else o << (float)v;
+        } else if (c1 == 's') {
+            o << to_text(popOpStack());
+        } else if (c1 == '%') {
+            o << '%';
+        } else o << '%' << c1;
+        s = c+2;
     }
 }
 
-void VirtualMachine::newStack(PTR addr) {
+// STRINGS
+// Every string lives once in internedStrings : constants are registered when
+// the program is loaded, duplicates forwarding to the first copy, and strings
+// built at runtime are looked up before allocating. Interned heap strings stay
+// alive for the lifetime of the VM.
+
+void VirtualMachine::intern_constant(PTR addr) {
+    auto it = internedStrings.insert(make_pair(string_value(addr), addr));
+    if (!it.second) memory[addr] = STRING_FORWARD | it.first->second;
+}
+
+PTR VirtualMachine::string_intern(const string &s) {
+    auto it = internedStrings.find(s);
+    if (it != internedStrings.end()) return it->second;
+    int words = 1 + (s.size()+sizeof(WORD))/sizeof(WORD);
+    auto addr = alloc(words);
+    memset(&memory[addr], 0, words*sizeof(WORD));
+    memory[addr] = s.size();
+    memcpy(&memory[addr+1], s.data(), s.size());
+    internedStrings[s] = addr;
+    if (epochStart != NULLPTR) epochStrings.push_back(s);
+    return addr;
+}
+
+string VirtualMachine::string_value(PTR addr) {
+    return string((const char*)&memory[addr+1], memory[addr]);
+}
+
+string VirtualMachine::to_text(DWORD v) {
+    Type t; int32_t d;
+    tie(t,d) = extract(v);
+    if (t == String) return string_value(asPtr(d));
+    stringstream ss;
+    if (t == Float) ss << asfloat(d);
+    else if (t == Int) ss << d;
+    else if (t == Nil) ss << "nil";
+    else throw runtime_error("Can't convert value to string");
+    return ss.str();
+}
+
+void VirtualMachine::newStack(PTR addr, PTR callee) {
+    if (trace) trace->record(TraceKind::Enter, tracePid, traceTid, callee);
+    if (perf) perfCalls.push_back(callee);
+    if (checkFree) {
+        auto it = funcOpStackWords.find(callee);
+        if (it == funcOpStackWords.end() || opStackFrame + it->second >= MAX_OP_STACK_SIZE) checkFree = false;
+    }
     memory[ADDR_STACK_START + stackFrame] = addr;
+    frameHeapMarks[stackFrame] = frameHeapTop;
     stackFrame += 1;
     if (stackFrame == MAX_STACK_SIZE) throw runtime_error("Stack overflow");
 }
 
 PTR VirtualMachine::popStack() {
     if (stackFrame == 0) throw runtime_error("Stack underflow");
+    if (!memoCalls.empty() && memoCalls.back().frame == stackFrame) memo_store();
+    if (trace) trace->record(TraceKind::Exit, tracePid, traceTid);
+    if (perf && !perfCalls.empty()) perfCalls.pop_back();
     stackFrame -= 1;
+    frameHeapTop = frameHeapMarks[stackFrame];
     return memory[ADDR_STACK_START + stackFrame];
 }
 
+template<typename P>
 void VirtualMachine::pushOpStack(DWORD v) {
-    if (opStackFrame == MAX_OP_STACK_SIZE-1) throw runtime_error("Operand stack overflow");
-    for (int i=0;i<LOCAL_VARS_SIZE;i++) deepFree(getStackPtr(i));
-
+    if (P::checks && opStackFrame == MAX_OP_STACK_SIZE-1) throw runtime_error("Operand stack overflow");
     setDword(OP_STACK_START+2*(opStackFrame++), v);
 }
 
+template<typename P>
 DWORD VirtualMachine::popOpStack() {
-    if (opStackFrame == 0) throw runtime_error("Operand stack underflow");
+    if (P::checks && opStackFrame == 0) throw runtime_error("Operand stack underflow");
     return getDword(OP_STACK_START+2*(--opStackFrame));
 }
 
+template<typename P>
+DWORD VirtualMachine::peekOpStack(int depth) {
+    if (P::checks && depth >= opStackFrame) throw runtime_error("Operand stack underflow");
+    return getDword(OP_STACK_START+2*(opStackFrame-1-depth));
+}
+
+template<typename P>
+DWORD VirtualMachine::popValue() {
+    DWORD v = popOpStack<P>();
+    if (!isInlineTuple(v)) return v;
+    int size = v & 0xffffffff;
+    auto addr = alloc(1+size*2);
+    memory[addr] = size;
+    for (int i=0;i<size;i++)
+        setDword(addr+1+i*2, popOpStack<P>());
+    return makeValue(Tuple, addr);
+}
+
+// natives and input builtins use the stack from code compiled in other units
+template void VirtualMachine::pushOpStack<VirtualMachine::Checked>(DWORD v);
+template DWORD VirtualMachine::popOpStack<VirtualMachine::Checked>();
+template DWORD VirtualMachine::popValue<VirtualMachine::Checked>();
+
+void VirtualMachine::dropValue() {
+    DWORD v = popOpStack();
+    if (!isInlineTuple(v)) return;
+    int size = v & 0xffffffff;
+    if (size > opStackFrame) throw runtime_error("Operand stack underflow");
+    opStackFrame -= size;
+}
+
+template<typename P>
 PTR VirtualMachine::getStackPtr(int index) {
-    if (index < 0 || index >= LOCAL_VARS_SIZE) throw runtime_error("Invalid stack slot");
+    if (P::checks && (index < 0 || index >= LOCAL_VARS_SIZE)) throw runtime_error("Invalid stack slot");
     return STACK_START + 2*((stackFrame-1)*LOCAL_VARS_SIZE+index);
 }
 
-void VirtualMachine::list_create(int size) {
-    auto addr = alloc(1+size*2);
+// LISTS
+// {num_elements, type, value...} : a list whose elements are all ints or all
+// floats has that element type and stores one raw word per element, any
+// other list has type nil and stores tagged dwords. Storing a value of
+// another type into a typed list moves it to a generic copy, the old block
+// then holds {new address, LIST_MOVED} and is followed on every access.
+
+const WORD LIST_MOVED = Pointer;
+
+PTR VirtualMachine::list_resolve(PTR p) {
+    while (memory[p+1] == LIST_MOVED) p = memory[p];
+    return p;
+}
+
+// local lists are bumped in the frame heap, they fall back to the heap when it is full
+PTR VirtualMachine::list_alloc(int size, Type type, bool local) {
+    int words = 2+size*(type == Nil ? 2 : 1);
+    PTR addr;
+    if (local && frameHeapTop + words <= TUPLE_SCRATCH) {
+        addr = frameHeapTop;
+        frameHeapTop += words;
+    } else addr = alloc(words);
     memory[addr] = size;
+    memory[addr+1] = type;
+    return addr;
+}
+
+DWORD VirtualMachine::list_get(PTR p, int index) {
+    Type type = Type(memory[p+1]);
+    if (type == Nil) return getDword(p+2+index*2);
+    return makeValue(type, memory[p+2+index]);
+}
+
+PTR VirtualMachine::list_promote(PTR p) {
+    int size = memory[p];
+    auto addr = list_alloc(size, Nil, p >= FRAME_HEAP_START && p < FRAME_HEAP_END);
     for (int i=0;i<size;i++)
-        setDword(addr+1+i*2, popOpStack());
-    pushOpStack(makeValue(List, addr));
+        setDword(addr+2+i*2, list_get(p, i));
+    memory[p] = addr;
+    memory[p+1] = LIST_MOVED;
+    return addr;
+}
+
+PTR VirtualMachine::list_from(const vector<DWORD> &elements, bool local) {
+    Type type = elements.empty() ? Nil : get<0>(extract(elements[0]));
+    if (type != Int && type != Float) type = Nil;
+    for (auto e : elements)
+        if (get<0>(extract(e)) != type) type = Nil;
+
+    int size = elements.size();
+    auto addr = list_alloc(size, type, local);
+    for (int i=0;i<size;i++) {
+        if (type == Nil) setDword(addr+2+i*2, elements[i]);
+        else memory[addr+2+i] = elements[i] & 0xffffffff;
+    }
+    return addr;
+}
+
+void VirtualMachine::list_create(int size) {
+    vector<DWORD> elements(size);
+    for (int i=0;i<size;i++) elements[i] = popValue();
+    pushOpStack(makeValue(List, list_from(elements)));
+}
+
+void VirtualMachine::list_create_local(int size) {
+    vector<DWORD> elements(size);
+    for (int i=0;i<size;i++) elements[i] = popValue();
+    pushOpStack(makeValue(List, list_from(elements, true)));
 }
 
 void VirtualMachine::list_concat(PTR d, PTR d2) {
+    d = list_resolve(d);
+    d2 = list_resolve(d2);
     int len1 = memory[d];
     int len2 = memory[d2];
-    int new_size = len1+len2;
-    auto addr = alloc(1+new_size*2);
-    memory[addr] = new_size;
-    memcpy(&memory[addr+1]       , &memory[d +1], len1*sizeof(DWORD));
-    memcpy(&memory[addr+1+len1*2], &memory[d2+1], len2*sizeof(DWORD));
-    pushOpStack(makeValue(List, addr));
+    Type type = Type(memory[d+1]);
+    if (type == memory[d2+1]) {
+        int stride = (type == Nil) ? 2 : 1;
+        auto addr = list_alloc(len1+len2, type);
+        memcpy(&memory[addr+2]            , &memory[d +2], len1*stride*sizeof(WORD));
+        memcpy(&memory[addr+2+len1*stride], &memory[d2+2], len2*stride*sizeof(WORD));
+        pushOpStack(makeValue(List, addr));
+        return;
+    }
+    vector<DWORD> elements;
+    for (int i=0;i<len1;i++) elements.push_back(list_get(d, i));
+    for (int i=0;i<len2;i++) elements.push_back(list_get(d2, i));
+    pushOpStack(makeValue(List, list_from(elements)));
 }
 
 void VirtualMachine::list_add(PTR d, DWORD v) {
+    d = list_resolve(d);
     int len1 = memory[d];
-    int new_size = len1+1;
-    auto addr = alloc(1+new_size*2);
-    memory[addr] = new_size;
-    memcpy(&memory[addr+1], &memory[d+1], len1*sizeof(DWORD));
-    setDword(addr+1+len1*2, v);
+    Type type = Type(memory[d+1]);
+    if (len1 == 0 || (type != Nil && type != get<0>(extract(v)))) {
+        vector<DWORD> elements;
+        for (int i=0;i<len1;i++) elements.push_back(list_get(d, i));
+        elements.push_back(v);
+        pushOpStack(makeValue(List, list_from(elements)));
+        return;
+    }
+    int stride = (type == Nil) ? 2 : 1;
+    auto addr = list_alloc(len1+1, type);
+    memcpy(&memory[addr+2], &memory[d+2], len1*stride*sizeof(WORD));
+    if (type == Nil) setDword(addr+2+len1*2, v);
+    else memory[addr+2+len1] = v & 0xffffffff;
     pushOpStack(makeValue(List, addr));
 }
 
+// pointers to elements of typed lists carry the list address in their upper bits
+
+DWORD makeElementPtr(PTR list, PTR element) {
+    return makeValue(Pointer, element) | DWORD(list) << 40;
+}
+
+PTR elementPtrList(DWORD ptr) {
+    return (ptr >> 40) & 0xffffff;
+}
+
+DWORD VirtualMachine::load_ptr(DWORD ptr) {
+    PTR addr = asPtr(ptr & 0xffffffff);
+    PTR list = elementPtrList(ptr);
+    if (!list) return getDword(addr);
+    return list_get(list_resolve(list), addr-list-2);
+}
+
+void VirtualMachine::store_ptr(DWORD ptr, DWORD v) {
+    PTR addr = asPtr(ptr & 0xffffffff);
+    PTR list = elementPtrList(ptr);
+    if (!list) {
+        deepFree(getDword(addr));
+        setDword(addr, v);
+        return;
+    }
+    int index = addr-list-2;
+    PTR p = list_resolve(list);
+    Type type = Type(memory[p+1]);
+    if (type == get<0>(extract(v))) {
+        memory[p+2+index] = v & 0xffffffff;
+        return;
+    }
+    if (type != Nil) p = list_promote(p);
+    deepFree(getDword(p+2+index*2));
+    setDword(p+2+index*2, v);
+}
+
 void VirtualMachine::list_access_ptr() {
     Type t,t2; int32_t d,d2;
+    if (get<0>(extract(peekOpStack(1))) == Map) return map_access_ptr();
     tie(t2,d2) = extract(popOpStack());
+    if (get<0>(extract(peekOpStack())) == Tuple) {
+        if (t2 != Int) throw runtime_error("Can't index into tuple with non-int");
+        return tuple_access_ptr(d2);
+    }
     tie(t,d) = extract(popOpStack());
     if (t != List) throw runtime_error("Can't access from non-list");
     if (t2 != Int) throw runtime_error("Can't index into list with non-int");
-    int len = memory[d];
+    PTR p = list_resolve(asPtr(d));
+    int len = memory[p];
 
     if (d2 < 0 || d2 >= len) throw runtime_error("Access out of bounds");
-    pushOpStack(makeValue(Pointer, d+1+d2*2));
+    if (memory[p+1] == Nil) pushOpStack(makeValue(Pointer, p+2+d2*2));
+    else pushOpStack(makeElementPtr(p, p+2+d2));
+}
+
+void VirtualMachine::list_access_ptr_u() {
+    int32_t index = popOpStack();
+    PTR p = list_resolve(asPtr(popOpStack()));
+    if (memory[p+1] == Nil) pushOpStack(makeValue(Pointer, p+2+index*2));
+    else pushOpStack(makeElementPtr(p, p+2+index));
 }
 
 void VirtualMachine::list_access() {
-    list_access_ptr();
-    int32_t d;
-    tie (ignore,d) = extract(popOpStack());
-    pushOpStack(getDword(d));
+    if (get<0>(extract(peekOpStack(1))) == Map) return map_access();
+    Type t,t2; int32_t d,d2;
+    tie(t2,d2) = extract(popOpStack());
+    tie(t,d) = extract(peekOpStack());
+    if (t == Tuple) {
+        if (t2 != Int) throw runtime_error("Can't index into tuple with non-int");
+        return tuple_access(d2);
+    }
+    popOpStack();
+    if (t != List) throw runtime_error("Can't access from non-list");
+    if (t2 != Int) throw runtime_error("Can't index into list with non-int");
+    PTR p = list_resolve(asPtr(d));
+
+    if (d2 < 0 || d2 >= (int)memory[p]) throw runtime_error("Access out of bounds");
+    pushOpStack(list_get(p, d2));
+}
+
+void VirtualMachine::list_access_u() {
+    int32_t index = popOpStack();
+    PTR p = list_resolve(asPtr(popOpStack()));
+    pushOpStack(list_get(p, index));
 }
 
 void VirtualMachine::list_length() {
     Type t; int32_t d;
     tie(t,d) = extract(popOpStack());
-    pushOpStack(makeValue(Int, memory[d]));
+    if (t == Map) pushOpStack(makeValue(Int, memory[asPtr(d)+1]));
+    else if (t == List) pushOpStack(makeValue(Int, memory[list_resolve(asPtr(d))]));
+    else pushOpStack(makeValue(Int, memory[d]));
+}
+
+// TUPLES
+// Tuples of up to MAX_INLINE_TUPLE elements are kept unboxed on the op stack :
+// the elements sit below a header holding their count, element 0 first.
+// They only get a heap block when stored somewhere a single value is expected.
+
+void VirtualMachine::tuple_create(int size) {
+    if (size > MAX_INLINE_TUPLE) {
+        auto addr = alloc(1+size*2);
+        memory[addr] = size;
+        for (int i=0;i<size;i++)
+            setDword(addr+1+i*2, popValue());
+        pushOpStack(makeValue(Tuple, addr));
+        return;
+    }
+    DWORD elements[MAX_INLINE_TUPLE];
+    for (int i=0;i<size;i++) elements[i] = popValue();
+    for (int i=size-1;i>=0;i--) pushOpStack(elements[i]);
+    pushOpStack(makeValue(Tuple, size) | INLINE_TUPLE);
+}
+
+void VirtualMachine::tuple_elements(DWORD v, vector<DWORD> &elements) {
+    Type t; int32_t d;
+    tie(t,d) = extract(v);
+    if (t != Tuple) throw runtime_error("Can't use a non-tuple as a tuple");
+    if (isInlineTuple(v)) {
+        for (int i=0;i<d;i++) elements.push_back(popOpStack());
+    } else {
+        auto p = asPtr(d);
+        for (int i=0;i<memory[p];i++) elements.push_back(getDword(p+1+i*2));
+    }
+}
+
+void VirtualMachine::tuple_concat() {
+    vector<DWORD> elements;
+    tuple_elements(popOpStack(), elements);
+    tuple_elements(popOpStack(), elements);
+    int size = elements.size();
+    for (int i=size-1;i>=0;i--) pushOpStack(elements[i]);
+    tuple_create(size);
+}
+
+// An inline tuple is a temporary, the element is written into a scratch slot
+// at the end of the frame heap that the next such write reuses.
+void VirtualMachine::tuple_access_ptr(int index) {
+    DWORD v = popOpStack();
+    Type t; int32_t d;
+    tie(t,d) = extract(v);
+    if (t != Tuple) throw runtime_error("Can't access from non-tuple");
+    if (isInlineTuple(v)) {
+        if (index < 0 || index >= d) throw runtime_error("Access out of bounds");
+        for (int i=0;i<d;i++) {
+            DWORD e = popOpStack();
+            if (i == index) setDword(TUPLE_SCRATCH, e);
+        }
+        pushOpStack(makeValue(Pointer, TUPLE_SCRATCH));
+        return;
+    }
+    auto p = asPtr(d);
+    if (index < 0 || index >= memory[p]) throw runtime_error("Access out of bounds");
+    pushOpStack(makeValue(Pointer, p+1+index*2));
+}
+
+void VirtualMachine::tuple_access(int index) {
+    DWORD v = popOpStack();
+    Type t; int32_t d;
+    tie(t,d) = extract(v);
+    if (t != Tuple) throw runtime_error("Can't access from non-tuple");
+    if (isInlineTuple(v)) {
+        if (index < 0 || index >= d) throw runtime_error("Access out of bounds");
+        DWORD res = 0;
+        for (int i=0;i<d;i++) {
+            DWORD e = popOpStack();
+            if (i == index) res = e;
+        }
+        pushOpStack(res);
+    } else {
+        auto p = asPtr(d);
+        if (index < 0 || index >= memory[p]) throw runtime_error("Access out of bounds");
+        pushOpStack(getDword(p+1+index*2));
+    }
+}
+
+void VirtualMachine::tuple_unpack(int size) {
+    DWORD v = popOpStack();
+    Type t; int32_t d;
+    tie(t,d) = extract(v);
+    if (t != Tuple) throw runtime_error("Can't unpack a non-tuple");
+    if (isInlineTuple(v)) {
+        if (d != size) throw runtime_error("Wrong number of values to unpack");
+        return;
+    }
+    auto p = asPtr(d);
+    if (memory[p] != size) throw runtime_error("Wrong number of values to unpack");
+    for (int i=size-1;i>=0;i--) pushOpStack(getDword(p+1+i*2));
 }
 
 
@@ -382,18 +1051,939 @@ DWORD VirtualMachine::getDword(PTR addr) {
     return v;
 }
 
+// MAPS
+// Open addressing with linear probing, a nil key marks an empty slot.
+// Removal shifts the following entries back instead of leaving tombstones.
+// Growing keeps the previous table around and moves MAP_MIGRATE_STEP of its
+// slots on every insertion and removal, so no single operation pays for a
+// full rehash. Until the migration is done, slots of the old table at or
+// after `migrated` are still live. Removing one of those leaves a tombstone
+// key, as shifting entries could bring back ones already moved, and the
+// tombstones go away with the old table. Float keys compare by value, and
+// NaNs by their bits, so that a NaN key can be found again.
+
+const int MAP_CAPACITY = 0, MAP_COUNT = 1, MAP_TABLE = 2;
+const int MAP_OLD_CAPACITY = 3, MAP_OLD_TABLE = 4, MAP_MIGRATED = 5;
+const int MAP_HEADER_SIZE = 6;
+const Type MAP_TOMBSTONE = Pointer;
+
+WORD VirtualMachine::map_hash(DWORD key) {
+    Type t; int32_t d;
+    tie(t,d) = extract(key);
+    WORD h = d;
+    if (t == Float && asfloat(d) == 0.0f) h = 0;
+    h ^= t;
+    h ^= h >> 16; h *= 0x85ebca6b;
+    h ^= h >> 13; h *= 0xc2b2ae35;
+    h ^= h >> 16;
+    return h;
+}
+
+bool VirtualMachine::map_key_equal(DWORD a, DWORD b) {
+    Type t,t2; int32_t d,d2;
+    tie(t,d) = extract(a);
+    tie(t2,d2) = extract(b);
+    if (t != t2) return false;
+    if (t == Float) return asfloat(d) == asfloat(d2) || d == d2;
+    return d == d2;
+}
+
+PTR VirtualMachine::map_alloc_table(int capacity) {
+    auto table = alloc(capacity*4);
+    memset(&memory[table], 0, capacity*4*sizeof(WORD));
+    return table;
+}
+
+PTR VirtualMachine::map_find(PTR table, int capacity, DWORD key) {
+    for (WORD i = map_hash(key);; i++) {
+        PTR slot = table + (i & (capacity-1))*4;
+        DWORD k = getDword(slot);
+        if (get<0>(extract(k)) == Nil) return NULLPTR;
+        if (map_key_equal(k, key)) return slot;
+    }
+}
+
+PTR VirtualMachine::map_insert_new(PTR table, int capacity, DWORD key, DWORD value) {
+    for (WORD i = map_hash(key);; i++) {
+        PTR slot = table + (i & (capacity-1))*4;
+        if (get<0>(extract(getDword(slot))) == Nil) {
+            setDword(slot, key);
+            setDword(slot+2, value);
+            return slot;
+        }
+    }
+}
+
+void VirtualMachine::map_migrate(PTR map, int steps) {
+    PTR old = memory[map+MAP_OLD_TABLE];
+    if (!old) return;
+    int oldCapacity = memory[map+MAP_OLD_CAPACITY];
+    int pos = memory[map+MAP_MIGRATED];
+    int end = min(oldCapacity, pos+steps);
+    for (;pos<end;pos++) {
+        DWORD k = getDword(old+pos*4);
+        Type t = get<0>(extract(k));
+        if (t != Nil && t != MAP_TOMBSTONE)
+            map_insert_new(memory[map+MAP_TABLE], memory[map+MAP_CAPACITY], k, getDword(old+pos*4+2));
+    }
+    memory[map+MAP_MIGRATED] = pos;
+    if (pos == oldCapacity) {
+        vmfree(old);
+        memory[map+MAP_OLD_TABLE] = 0;
+        memory[map+MAP_OLD_CAPACITY] = 0;
+        memory[map+MAP_MIGRATED] = 0;
+    }
+}
+
+// returns the address of the value slot for key, NULLPTR if absent and not inserted
+PTR VirtualMachine::map_slot(PTR map, DWORD key, bool insert) {
+    Type t = get<0>(extract(key));
+    if (t != Int && t != Float && t != String) throw runtime_error("Invalid map key type");
+
+    PTR slot = map_find(memory[map+MAP_TABLE], memory[map+MAP_CAPACITY], key);
+    if (slot != NULLPTR) return slot+2;
+    PTR old = memory[map+MAP_OLD_TABLE];
+    if (old) {
+        slot = map_find(old, memory[map+MAP_OLD_CAPACITY], key);
+        if (slot != NULLPTR && int(slot-old)/4 >= int(memory[map+MAP_MIGRATED])) return slot+2;
+    }
+    if (!insert) return NULLPTR;
+
+    map_migrate(map, MAP_MIGRATE_STEP);
+    int capacity = memory[map+MAP_CAPACITY];
+    if ((memory[map+MAP_COUNT]+1)*4 > capacity*3) {
+        map_migrate(map, memory[map+MAP_OLD_CAPACITY]);
+        memory[map+MAP_OLD_CAPACITY] = capacity;
+        memory[map+MAP_OLD_TABLE] = memory[map+MAP_TABLE];
+        memory[map+MAP_MIGRATED] = 0;
+        capacity *= 2;
+        memory[map+MAP_CAPACITY] = capacity;
+        memory[map+MAP_TABLE] = map_alloc_table(capacity);
+    }
+    memory[map+MAP_COUNT] += 1;
+    return map_insert_new(memory[map+MAP_TABLE], capacity, key, makeValue(Nil, 0))+2;
+}
+
+bool VirtualMachine::map_remove_key(PTR map, DWORD key) {
+    map_migrate(map, MAP_MIGRATE_STEP);
+    int capacity = memory[map+MAP_CAPACITY];
+    PTR table = memory[map+MAP_TABLE];
+    PTR slot = map_find(table, capacity, key);
+    if (slot == NULLPTR) {
+        PTR old = memory[map+MAP_OLD_TABLE];
+        if (!old) return false;
+        slot = map_find(old, memory[map+MAP_OLD_CAPACITY], key);
+        if (slot == NULLPTR || int(slot-old)/4 < int(memory[map+MAP_MIGRATED])) return false;
+        deepFree(getDword(slot+2));
+        setDword(slot, makeValue(MAP_TOMBSTONE, 0));
+        memory[map+MAP_COUNT] -= 1;
+        return true;
+    }
+    deepFree(getDword(slot+2));
+
+    int i = (slot-table)/4;
+    for (int j = (i+1) & (capacity-1);; j = (j+1) & (capacity-1)) {
+        DWORD k = getDword(table+j*4);
+        if (get<0>(extract(k)) == Nil) break;
+        int home = map_hash(k) & (capacity-1);
+        bool stays = (i <= j) ? (i < home && home <= j) : (i < home || home <= j);
+        if (!stays) {
+            memcpy(&memory[table+i*4], &memory[table+j*4], 4*sizeof(WORD));
+            i = j;
+        }
+    }
+    setDword(table+i*4, makeValue(Nil, 0));
+    memory[map+MAP_COUNT] -= 1;
+    return true;
+}
+
+void VirtualMachine::map_create(int size) {
+    int capacity = MAP_MIN_CAPACITY;
+    while (size*4 > capacity*3) capacity *= 2;
+    auto map = alloc(MAP_HEADER_SIZE);
+    memset(&memory[map], 0, MAP_HEADER_SIZE*sizeof(WORD));
+    memory[map+MAP_CAPACITY] = capacity;
+    memory[map+MAP_TABLE] = map_alloc_table(capacity);
+    for (int i=0;i<size;i++) {
+        DWORD k = popValue();
+        DWORD v = popValue();
+        PTR slot = map_slot(map, k, true);
+        deepFree(getDword(slot));
+        setDword(slot, v);
+    }
+    pushOpStack(makeValue(Map, map));
+}
+
+void VirtualMachine::map_add() {
+    DWORD v = popValue();
+    DWORD k = popValue();
+    Type t; int32_t d;
+    tie(t,d) = extract(peekOpStack());
+    if (t != Map) throw runtime_error("Can't add pair to non-map");
+    PTR slot = map_slot(asPtr(d), k, true);
+    deepFree(getDword(slot));
+    setDword(slot, v);
+}
+
+void VirtualMachine::map_access_ptr() {
+    DWORD k = popValue();
+    Type t; int32_t d;
+    tie(t,d) = extract(popOpStack());
+    if (t != Map) throw runtime_error("Can't access from non-map");
+    pushOpStack(makeValue(Pointer, map_slot(asPtr(d), k, true)));
+}
+
+void VirtualMachine::map_access() {
+    DWORD k = popValue();
+    Type t; int32_t d;
+    tie(t,d) = extract(popOpStack());
+    if (t != Map) throw runtime_error("Can't access from non-map");
+    PTR slot = map_slot(asPtr(d), k, false);
+    if (slot == NULLPTR) throw runtime_error("Key not found in map");
+    pushOpStack(getDword(slot));
+}
+
+void VirtualMachine::map_remove() {
+    Type t; int32_t d;
+    tie(t,d) = extract(popOpStack());
+    DWORD k = popValue();
+    if (t != Map) throw runtime_error("Can't remove from non-map");
+    pushOpStack(makeValue(Int, map_remove_key(asPtr(d), k)));
+}
+
+void VirtualMachine::map_has() {
+    Type t; int32_t d;
+    tie(t,d) = extract(popOpStack());
+    DWORD k = popValue();
+    if (t != Map) throw runtime_error("Can't look up in non-map");
+    pushOpStack(makeValue(Int, map_slot(asPtr(d), k, false) != NULLPTR));
+}
+
+// CLOSURES
+// functions used as values are closures without captures, the value holds
+// the code address and nothing is allocated
+
+void VirtualMachine::closure_create(PTR addr) {
+    pushOpStack(makeValue(Closure, addr));
+}
+
+PTR VirtualMachine::closure_code(DWORD closure, int numArgs) {
+    Type t; int32_t d;
+    tie(t,d) = extract(closure);
+    if (t != Closure) throw runtime_error("Can't call a non-closure");
+    PTR addr = asPtr(d);
+    if (funcNumArgs[addr] != numArgs) throw runtime_error("Wrong number of arguments");
+    return addr;
+}
+
+void VirtualMachine::closure_call(int numArgs) {
+    PTR addr = closure_code(popOpStack(), numArgs);
+    newStack(PC, addr);
+    for (int i=0;i<numArgs;i++)
+        setDword(getStackPtr(i), popValue());
+    PC = addr;
+}
+
+DWORD VirtualMachine::invoke(DWORD closure, const vector<DWORD> &args) {
+    PTR addr = closure_code(closure, args.size());
+    for (int i=args.size()-1;i>=0;i--) pushOpStack(args[i]);
+    return call_code(addr, args.size());
+}
+
+DWORD VirtualMachine::call_code(PTR addr, int numArgs) {
+    int base = opStackFrame - numArgs;
+    PTR returnPC = PC;
+    newStack(ENDPC, addr);
+    for (int i=0;i<numArgs;i++)
+        setDword(getStackPtr(i), popValue());
+    PC = addr;
+    // runs inside a single instruction of the caller, so the caller's
+    // deadline is checked here too
+    for (uint64_t i=1; PC != ENDPC; i++) {
+        step();
+        if (i % DEADLINE_CHECK_INTERVAL == 0 && chrono::steady_clock::now() >= timeLimit)
+            throw runtime_error("Time limit exceeded");
+    }
+    PC = returnPC;
+    // a function can return without a value
+    return (opStackFrame > base) ? popValue() : makeValue(Nil, 0);
+}
+
+// NATIVES
+
+static int32_t native_min(int32_t a, int32_t b) { return a < b ? a : b; }
+static int32_t native_max(int32_t a, int32_t b) { return a > b ? a : b; }
+static float native_sqrt(float a) { return sqrt(a); }
+
+static float native_sum(const vector<float> &l) {
+    float s = 0;
+    for (auto v : l) s += v;
+    return s;
+}
+
+NativeRegistry natives;
+
+NativeRegistry::NativeRegistry() {
+    add({"printf", -1, &VirtualMachine::builtin_thunk<&VirtualMachine::printf>, nullptr, 0});
+    add({"format", -1, &VirtualMachine::builtin_thunk<&VirtualMachine::format>, nullptr, 1});
+    add({"pmap", 2, &VirtualMachine::builtin_thunk<&VirtualMachine::pmap>, nullptr, 1});
+    add({"preduce", 3, &VirtualMachine::builtin_thunk<&VirtualMachine::preduce>, nullptr, 1});
+    add({"yield", 0, &VirtualMachine::builtin_thunk<&VirtualMachine::yield>, nullptr, 0});
+    add("min", &native_min);
+    add("max", &native_max);
+    add("sqrt", &native_sqrt);
+    add("sum", &native_sum);
+    add({"input_open", 1, &VirtualMachine::builtin_thunk<&VirtualMachine::input_open>, nullptr, 1});
+    add({"input_close", 1, &VirtualMachine::builtin_thunk<&VirtualMachine::input_close>, nullptr, 0});
+    add({"input_line", 1, &VirtualMachine::builtin_thunk<&VirtualMachine::input_line>, nullptr, 1});
+    add({"line_bytes", 1, &VirtualMachine::builtin_thunk<&VirtualMachine::line_bytes>, nullptr, 1});
+    add({"line_text", 1, &VirtualMachine::builtin_thunk<&VirtualMachine::line_text>, nullptr, 1});
+    add({"line_int", 2, &VirtualMachine::builtin_thunk<&VirtualMachine::line_int>, nullptr, 1});
+    add({"line_float", 2, &VirtualMachine::builtin_thunk<&VirtualMachine::line_float>, nullptr, 1});
+    add({"line_ints", 1, &VirtualMachine::builtin_thunk<&VirtualMachine::line_ints>, nullptr, 1});
+    add({"line_floats", 1, &VirtualMachine::builtin_thunk<&VirtualMachine::line_floats>, nullptr, 1});
+    add({"input_ints", 2, &VirtualMachine::builtin_thunk<&VirtualMachine::input_ints>, nullptr, 1});
+    add({"input_floats", 2, &VirtualMachine::builtin_thunk<&VirtualMachine::input_floats>, nullptr, 1});
+}
+
+uint32_t NativeRegistry::add(const Native &n) {
+    if (index.count(n.name)) throw runtime_error("Native " + n.name + " is already registered");
+    if (list.size() == ENDPC) throw runtime_error("Too many natives");
+    index[n.name] = list.size();
+    list.push_back(n);
+    return list.size()-1;
+}
+
+int NativeRegistry::find(const string &name) const {
+    auto it = index.find(name);
+    return (it == index.end()) ? -1 : it->second;
+}
+
+void VirtualMachine::native_unbox(DWORD v, int32_t &out) {
+    Type t; int32_t d;
+    tie(t,d) = extract(v);
+    if (t == Int) out = d;
+    else if (t == Float) out = asfloat(d);
+    else throw runtime_error("Native function expected an int");
+}
+
+void VirtualMachine::native_unbox(DWORD v, float &out) {
+    Type t; int32_t d;
+    tie(t,d) = extract(v);
+    if (t == Float) out = asfloat(d);
+    else if (t == Int) out = d;
+    else throw runtime_error("Native function expected a float");
+}
+
+void VirtualMachine::native_unbox(DWORD v, string &out) {
+    Type t; int32_t d;
+    tie(t,d) = extract(v);
+    if (t != String) throw runtime_error("Native function expected a string");
+    out = string_value(asPtr(d));
+}
+
+void VirtualMachine::native_unbox(DWORD v, vector<int32_t> &out) {
+    Type t; int32_t d;
+    tie(t,d) = extract(v);
+    if (t != List) throw runtime_error("Native function expected a list");
+    PTR p = list_resolve(asPtr(d));
+    out.resize(memory[p]);
+    // int lists are copied as they are stored
+    if (Type(memory[p+1]) == Int) memcpy(out.data(), &memory[p+2], out.size()*sizeof(WORD));
+    else for (size_t i=0;i<out.size();i++) native_unbox(list_get(p, i), out[i]);
+}
+
+void VirtualMachine::native_unbox(DWORD v, vector<float> &out) {
+    Type t; int32_t d;
+    tie(t,d) = extract(v);
+    if (t != List) throw runtime_error("Native function expected a list");
+    PTR p = list_resolve(asPtr(d));
+    out.resize(memory[p]);
+    if (Type(memory[p+1]) == Float) memcpy(out.data(), &memory[p+2], out.size()*sizeof(WORD));
+    else for (size_t i=0;i<out.size();i++) native_unbox(list_get(p, i), out[i]);
+}
+
+void VirtualMachine::native_unbox(DWORD v, HostValue &out) {
+    out = to_host(v);
+}
+
+void VirtualMachine::native_box(int32_t v) {
+    pushOpStack(makeValue(Int, v));
+}
+
+void VirtualMachine::native_box(float v) {
+    pushOpStack(makeValue(Float, asint(v)));
+}
+
+void VirtualMachine::native_box(const string &v) {
+    pushOpStack(makeValue(String, string_intern(v)));
+}
+
+void VirtualMachine::native_box(const vector<int32_t> &v) {
+    auto addr = list_alloc(v.size(), Int);
+    memcpy(&memory[addr+2], v.data(), v.size()*sizeof(WORD));
+    pushOpStack(makeValue(List, addr));
+}
+
+void VirtualMachine::native_box(const vector<float> &v) {
+    auto addr = list_alloc(v.size(), Float);
+    memcpy(&memory[addr+2], v.data(), v.size()*sizeof(WORD));
+    pushOpStack(makeValue(List, addr));
+}
+
+void VirtualMachine::native_box(const HostValue &v) {
+    pushOpStack(from_host(v));
+}
+
+// EMBEDDING
+
+FunctionHandle VirtualMachine::function(const string &name) {
+    auto it = funcNames.find(name);
+    if (it == funcNames.end()) throw runtime_error("Can't find function " + name);
+    return {it->second, funcNumArgs[it->second]};
+}
+
+void VirtualMachine::push(const HostValue &v) {
+    hostArgs.push_back(from_host(v));
+}
+
+HostValue VirtualMachine::call(FunctionHandle f) {
+    if ((int)hostArgs.size() != f.numArgs) {
+        hostArgs.clear();
+        throw runtime_error("Wrong number of arguments");
+    }
+    PTR returnPC = PC;
+    int frame = stackFrame;
+    int opFrame = opStackFrame;
+    PTR frameHeap = frameHeapTop;
+    size_t memoDepth = memoCalls.size();
+    checkFree = verified;
+    for (int i=hostArgs.size()-1;i>=0;i--) pushOpStack(hostArgs[i]);
+    hostArgs.clear();
+    try {
+        return to_host(call_code(f.addr, f.numArgs));
+    } catch (...) {
+        // leave the VM ready for the next call
+        PC = returnPC;
+        stackFrame = frame;
+        opStackFrame = opFrame;
+        frameHeapTop = frameHeap;
+        // calls that missed the cache never returned, nothing to store
+        memoCalls.resize(memoDepth);
+        throw;
+    }
+}
+
+vector<HostValue> VirtualMachine::call_batch(FunctionHandle f, const vector<vector<HostValue>> &rows) {
+    vector<HostValue> results;
+    results.reserve(rows.size());
+    for (auto &row : rows) {
+        for (auto &v : row) push(v);
+        results.push_back(call(f));
+        if (epochStart != NULLPTR) reset_epoch();
+    }
+    return results;
+}
+
+HostValue VirtualMachine::to_host(DWORD v) {
+    Type t; int32_t d;
+    tie(t,d) = extract(v);
+    if (t == Int) return HostValue(d);
+    if (t == Float) return HostValue(asfloat(d));
+    if (t == String) return HostValue(string_value(asPtr(d)));
+    if (t == Nil) return HostValue();
+    throw runtime_error("Only ints, floats, strings and nil can be passed to the host");
+}
+
+DWORD VirtualMachine::from_host(const HostValue &v) {
+    if (v.type == Int) return makeValue(Int, v.i);
+    if (v.type == Float) return makeValue(Float, asint(v.f));
+    if (v.type == String) return makeValue(String, string_intern(v.s));
+    if (v.type == Nil) return makeValue(Nil, 0);
+    throw runtime_error("Only ints, floats, strings and nil can be passed to a VM");
+}
+
+// EPOCHS
+// The arena is the largest free block of the buddy heap. Frees inside it are
+// no-ops, strings interned during the epoch are forgotten on reset. Once the
+// arena is full, allocations come from the heap and reset frees them.
+
+void VirtualMachine::begin_epoch() {
+    if (epochStart != NULLPTR) end_epoch();
+    for (int size = HEAP_SIZE; size >= SMALLEST_ALLOC; size /= 2) {
+        PTR a = alloc(&heaproot, size);
+        if (a == NULLPTR) continue;
+        if (stats) count_alloc(a, size, chrono::steady_clock::now());
+        epochStart = epochTop = a;
+        epochEnd = a + size;
+        return;
+    }
+    throw runtime_error("Memory full, can't open an epoch");
+}
+
+void VirtualMachine::reset_epoch() {
+    if (epochStart == NULLPTR) throw runtime_error("No epoch to reset");
+    epochTop = epochStart;
+    for (auto &s : epochStrings) internedStrings.erase(s);
+    // memoized calls may have strings of the epoch as arguments or result
+    if (!epochStrings.empty()) memo.clear();
+    epochStrings.clear();
+    auto overflow = move(epochOverflow);
+    epochOverflow.clear();
+    for (PTR a : overflow) vmfree(a);
+    epoch++;
+}
+
+void VirtualMachine::end_epoch() {
+    reset_epoch();
+    PTR a = epochStart;
+    epochStart = NULLPTR;
+    vmfree(a);
+}
+
+// PARALLEL
+// pmap(f, list) and preduce(f, list, init) run f on worker VMs. Each worker
+// works on a copy of the memory, so f must not rely on side effects other
+// than printing; output is replayed in list order once all workers are done.
+// Chunks are taken from a shared counter, faster workers take more of them.
+
+VirtualMachine::VirtualMachine(const VirtualMachine &parent, ostream &o) : out(o) {
+    memcpy(memory, parent.memory, TOTAL_SIZE*sizeof(WORD));
+    heap_copy(&heaproot, &parent.heaproot);
+    internedStrings = parent.internedStrings;
+    funcNames = parent.funcNames;
+    funcNumArgs = parent.funcNumArgs;
+    sourceLines = parent.sourceLines;
+    verified = parent.verified;
+    checkFree = parent.verified;
+    funcOpStackWords = parent.funcOpStackWords;
+    // same mappings, each worker reads from its own position
+    inputs = parent.inputs;
+    frameHeapTop = parent.frameHeapTop;
+    epochStart = parent.epochStart;
+    epochTop = parent.epochTop;
+    epochEnd = parent.epochEnd;
+    epochOverflow = parent.epochOverflow;
+    timeLimit = parent.timeLimit;
+    workers = 1;
+    trace = parent.trace;
+    tracePid = parent.tracePid;
+}
+
+int VirtualMachine::parallel_chunks(int n, const chunkfn &body) {
+    int minChunk = PARALLEL_MIN_CHUNK;
+    int threads = max(1, min(workers, n / minChunk));
+    if (threads == 1) {
+        body(*this, 0, 0, n);
+        return 1;
+    }
+
+    int chunkSize = max(minChunk, n / (threads*4));
+    int numChunks = (n + chunkSize-1) / chunkSize;
+    vector<string> output(numChunks);
+    vector<exception_ptr> errors(threads);
+    atomic<int> next(0);
+    auto worker = [&](int w) {
+        try {
+            stringstream o;
+            VirtualMachine vm(*this, o);
+            vm.traceTid = w+1;
+            for (int c = next++; c < numChunks; c = next++) {
+                body(vm, c, c*chunkSize, min(n, (c+1)*chunkSize));
+                output[c] = o.str();
+                o.str("");
+            }
+        } catch (...) {
+            errors[w] = current_exception();
+        }
+    };
+    vector<thread> pool;
+    for (int w=0;w<threads;w++) pool.emplace_back(worker, w);
+    for (auto &t : pool) t.join();
+    for (auto &e : errors)
+        if (e) rethrow_exception(e);
+    for (auto &o : output) out << o;
+    return numChunks;
+}
+
+void VirtualMachine::pmap() {
+    DWORD f = popValue();
+    Type t; int32_t d;
+    tie(t,d) = extract(popValue());
+    if (t != List) throw runtime_error("Can't pmap over a non-list");
+    PTR list = list_resolve(asPtr(d));
+    int n = memory[list];
+
+    // results leave a worker as host values, its heap is gone once it finishes
+    vector<HostValue> results(n);
+    parallel_chunks(n, [&](VirtualMachine &vm, int, int begin, int end) {
+        for (int i=begin;i<end;i++)
+            results[i] = vm.to_host(vm.invoke(f, {vm.list_get(list, i)}));
+    });
+
+    vector<DWORD> elements(n);
+    for (int i=0;i<n;i++) elements[i] = from_host(results[i]);
+    pushOpStack(makeValue(List, list_from(elements)));
+}
+
+// f must be associative : chunks are reduced separately, chunk 0 from init
+// and the others from their first element, then the partial results in order
+void VirtualMachine::preduce() {
+    DWORD f = popValue();
+    Type t; int32_t d;
+    tie(t,d) = extract(popValue());
+    DWORD init = popValue();
+    if (t != List) throw runtime_error("Can't preduce over a non-list");
+    PTR list = list_resolve(asPtr(d));
+    int n = memory[list];
+
+    vector<HostValue> partials(max(1, n));
+    int numChunks = parallel_chunks(n, [&](VirtualMachine &vm, int chunk, int begin, int end) {
+        DWORD acc = init;
+        if (chunk > 0) acc = vm.list_get(list, begin++);
+        for (int i=begin;i<end;i++)
+            acc = vm.invoke(f, {acc, vm.list_get(list, i)});
+        partials[chunk] = vm.to_host(acc);
+    });
+
+    DWORD acc = from_host(partials[0]);
+    for (int c=1;c<numChunks;c++)
+        acc = invoke(f, {acc, from_host(partials[c])});
+    pushOpStack(acc);
+}
+
+// ALLOCATOR STATISTICS
+
+static_assert(1 << (HeapStats::ORDERS-1) == VirtualMachine::HEAP_SIZE, "one order per block size");
+
+void VirtualMachine::collect_heap_stats() {
+    stats.reset(new HeapStats());
+    // what is allocated already is live
+    HeapStats tree;
+    heap_walk(&heaproot, tree, stats->liveWords);
+    stats->peakWords = stats->liveWords;
+}
+
+HeapStats VirtualMachine::heap_stats() {
+    HeapStats s = stats ? *stats : HeapStats();
+    uint64_t allocated = 0;
+    heap_walk(&heaproot, s, allocated);
+    return s;
+}
+
+void VirtualMachine::count_alloc(PTR a, int size, chrono::steady_clock::time_point start) {
+    stats->allocTime += chrono::steady_clock::now() - start;
+    if (a == NULLPTR) {
+        stats->failed++;
+        return;
+    }
+    int words = block_words(size);
+    int order = 0;
+    while ((1 << order) < words) order++;
+    stats->allocs[order]++;
+    stats->requestedWords += size;
+    stats->blockWords += words;
+    stats->liveWords += words;
+    stats->peakWords = max(stats->peakWords, stats->liveWords);
+}
+
+void VirtualMachine::heap_walk(HeapTree *tree, HeapStats &s, uint64_t &allocated) {
+    if (tree->allocated) {
+        allocated += tree->size;
+    } else if (tree->left) {
+        heap_walk(tree->left.get(), s, allocated);
+        heap_walk(tree->right.get(), s, allocated);
+    } else {
+        s.freeWords += tree->size;
+        s.freeBlocks++;
+        s.largestFree = max(s.largestFree, (uint64_t)tree->size);
+    }
+}
+
+void HeapStats::print(ostream &o) const {
+    auto fixed = [](double v, const char *unit) {
+        char buf[32];
+        snprintf(buf, sizeof(buf), "%.3f%s", v, unit);
+        return string(buf);
+    };
+    auto ms = [&](chrono::nanoseconds t) { return fixed(t.count() / 1e6, "ms"); };
+    uint64_t numAllocs = 0, numFrees = 0;
+    for (int i=0;i<ORDERS;i++) {
+        numAllocs += allocs[i];
+        numFrees += frees[i];
+    }
+    o << "heap : " << VirtualMachine::HEAP_SIZE << " words, " << liveWords << " live, " << peakWords << " at peak" << endl;
+    o << "allocations : " << numAllocs << ", frees : " << numFrees << ", failed : " << failed << endl;
+    for (int i=0;i<ORDERS;i++)
+        if (allocs[i] || frees[i])
+            o << "    " << (1 << i) << " words : " << allocs[i] << " allocations, " << frees[i] << " frees" << endl;
+    o << "internal fragmentation : " << fixed(internalFragmentation()*100, "%") << " (" << requestedWords
+      << " words asked for, " << blockWords << " handed out)" << endl;
+    o << "free : " << freeWords << " words in " << freeBlocks << " blocks, largest " << largestFree
+      << ", external fragmentation : " << fixed(externalFragmentation()*100, "%") << endl;
+    o << "time : alloc " << ms(allocTime) << ", vmfree " << ms(freeTime) << ", deepFree " << ms(deepFreeTime) << endl;
+}
+
+// TRACING
+
+void VirtualMachine::trace_to(TraceBuffer *t, uint16_t pid) {
+    trace = t;
+    tracePid = pid;
+    if (t) t->name_functions(pid, funcNames);
+}
+
+// HARDWARE COUNTERS
+
+// assembler mnemonics, by opcode
+static const char *OPCODE_NAMES[] = {
+    "noop", "load_int", "load_float", "load_str", "load_var_addr", "load_var", "load_mem",
+    "store_mem", "store_var", "call", "call_ext", "pop", "return", "ifjump", "ifnjump", "jump",
+    "not", "and", "or", "usubi", "mul", "div", "mod", "add", "sub", "lteq", "lt", "gt", "gteq",
+    "eq", "neq", "inc", "list_create", "list_access_ptr", "list_access", "list_length",
+    "list_create_local", "tuple_create", "tuple_concat", "tuple_access_ptr", "tuple_access",
+    "tuple_unpack", "closure_create", "closure_call", "map_create", "map_add", "map_access_ptr",
+    "map_access", "map_remove", "map_has", "add_int", "sub_int", "mul_int", "div_int",
+    "mod_int", "lt_int", "lteq_int", "gt_int", "gteq_int", "eq_int", "neq_int", "add_float",
+    "sub_float", "mul_float", "div_float", "ifjump_int", "ifnjump_int", "list_access_int",
+    "list_access_u", "list_access_ptr_u", "call_memo",
+};
+
+string VirtualMachine::instruction_set() {
+    string s;
+    for (auto name : OPCODE_NAMES) s += string(name) + " ";
+    for (size_t i=0;i<natives.size();i++) s += natives[i].name + "/" + to_string(natives[i].numArgs) + " ";
+    return s;
+}
+
+void VirtualMachine::collect_perf_counters() {
+    PerfGroup &g = PerfGroup::thread();
+    if (!g.error.empty()) throw runtime_error(g.error);
+    perf = true;
+    perfFunctions.clear();
+    perfOpcodes.assign(sizeof(OPCODE_NAMES)/sizeof(OPCODE_NAMES[0]), PerfCounts());
+    perfFunc = ENDPC;
+    perfCurrent = &perfFunctions[perfFunc];
+    // counting starts here
+    PerfCounts c;
+    g.read(c);
+}
+
+// The counters are read after each instruction, whatever ran since the last
+// read is charged to it : the instruction, and the bookkeeping of the one before
+void VirtualMachine::perf_step() {
+    PTR func = perfCalls.empty() ? ENDPC : perfCalls.back();
+    if (func != perfFunc) {
+        perfFunc = func;
+        perfCurrent = &perfFunctions[func];
+    }
+    Instruction i0 = get<0>(decode(memory[PC]));
+    if (checkFree) exec<CheckFree>();
+    else exec<Checked>();
+
+    PerfGroup &g = PerfGroup::thread();
+    if (!g.error.empty()) throw runtime_error(g.error);
+    PerfCounts c;
+    g.read(c);
+    c.steps = 1;
+    perfCurrent->add(c);
+    if ((size_t)i0 < perfOpcodes.size()) perfOpcodes[i0].add(c);
+}
+
+PerfProfile VirtualMachine::perf_profile() {
+    PerfProfile p;
+    if (!perf) return p;
+    copy(PerfGroup::thread().available, PerfGroup::thread().available+PERF_EVENTS, p.available);
+    p.userRead = PerfGroup::thread().userRead;
+    map<PTR, string> names;
+    for (auto &f : funcNames) names[f.second] = f.first;
+    for (auto &f : perfFunctions) {
+        if (!f.second.steps) continue;
+        auto it = names.find(f.first);
+        string name = it != names.end() ? it->second : f.first == ENDPC ? "(outside)" : "@" + to_string(f.first);
+        p.functions[name].add(f.second);
+    }
+    for (size_t i=0;i<perfOpcodes.size();i++)
+        if (perfOpcodes[i].steps) p.opcodes[OPCODE_NAMES[i]] = perfOpcodes[i];
+    return p;
+}
+
+// MEMOIZATION
+
+static uint64_t memo_hash(PTR func, const DWORD *args, int n) {
+    uint64_t h = func;
+    for (int i=0;i<n;i++) {
+        h = (h ^ args[i]) * 0xff51afd7ed558ccdull;
+        h ^= h >> 32;
+    }
+    return h;
+}
+
+// A hit pushes the result in place of the arguments, as the call would
+template<typename P>
+void VirtualMachine::call_memo(PTR addr) {
+    if (P::checks && (addr < CODE_START || addr >= CODE_END)) return;
+    int n = funcNumArgs[addr];
+    MemoCache &c = memo[addr];
+    MemoCall call = MemoCall();
+    bool keyed = n <= MEMO_MAX_ARGS && n <= opStackFrame;
+    for (int i=0;i<n && keyed;i++) {
+        call.args[i] = peekOpStack<P>(i);
+        keyed = isPrim(get<0>(extract(call.args[i])));
+    }
+    if (keyed) {
+        if (c.entries.empty()) c.entries.resize(MEMO_CACHE_SIZE);
+        MemoEntry &e = c.entries[memo_hash(addr, call.args, n) & (MEMO_CACHE_SIZE-1)];
+        if (e.used && equal(call.args, call.args+n, e.args)) {
+            c.counts.hits++;
+            opStackFrame -= n;
+            pushOpStack<P>(e.result);
+            return;
+        }
+        c.counts.misses++;
+        call.frame = stackFrame+1;
+        call.opStackBase = opStackFrame-n;
+        call.entry = &e;
+        memoCalls.push_back(call);
+    } else c.counts.skipped++;
+
+    newStack(PC, addr);
+    for (int i=0;i<n;i++)
+        setDword(getStackPtr<P>(i), popValue<P>());
+    PC = addr;
+}
+
+// the frame of a call that missed returns, its result is the one value
+// above the caller's operands
+void VirtualMachine::memo_store() {
+    MemoCall call = memoCalls.back();
+    memoCalls.pop_back();
+    if (opStackFrame != call.opStackBase+1) return;
+    DWORD result = getDword(OP_STACK_START+2*(opStackFrame-1));
+    if (!isPrim(get<0>(extract(result)))) return;
+    MemoEntry &e = *call.entry;
+    e.used = true;
+    copy(call.args, call.args+MEMO_MAX_ARGS, e.args);
+    e.result = result;
+}
+
+map<string, MemoCounts> VirtualMachine::memo_stats() {
+    map<string, MemoCounts> stats;
+    for (auto &f : funcNames) {
+        auto it = memo.find(f.second);
+        if (it != memo.end()) stats[f.first] = it->second.counts;
+    }
+    return stats;
+}
+
+// SAMPLING PROFILER
+
+void VirtualMachine::on_sample(int) {
+    VirtualMachine *vm = sampledVM;
+    if (vm && vm->samples) vm->samples->add(vm->PC, &vm->memory[ADDR_STACK_START], vm->stackFrame);
+}
+
+void VirtualMachine::collect_samples(int hz) {
+    if (hz <= 0 || hz > 1000000) throw runtime_error("Invalid sampling rate");
+    samples.reset(new StackSamples(SAMPLE_BUFFER_WORDS));
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_sample;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    itimerval t;
+    // tv_usec must stay below a second, 1 hz is a whole one
+    t.it_interval.tv_sec = 1 / hz;
+    t.it_interval.tv_usec = (1000000 / hz) % 1000000;
+    t.it_value = t.it_interval;
+    if (sigaction(SIGPROF, &sa, nullptr) != 0 || setitimer(ITIMER_PROF, &t, nullptr) != 0)
+        throw runtime_error(string("Can't start sampling : ") + strerror(errno));
+}
+
+const SourcePos *VirtualMachine::source_pos(PTR pc) {
+    auto it = upper_bound(sourceLines.begin(), sourceLines.end(), pc,
+        [](PTR pc, const SourcePos &p) { return pc < p.pc; });
+    return it == sourceLines.begin() ? nullptr : &*(it-1);
+}
+
+// A return address is resolved at the call before it. The pc is one past
+// the instruction running, or the target of a jump, so the last instruction
+// of a statement counts for the next one rather than every jump back for
+// the statement before its target.
+SampleProfile VirtualMachine::sample_profile() {
+    SampleProfile p;
+    if (!samples) return p;
+    itimerval off;
+    memset(&off, 0, sizeof(off));
+    setitimer(ITIMER_PROF, &off, nullptr);
+
+    map<PTR, string> names;
+    for (auto &f : funcNames) names[f.second] = f.first;
+    auto frame = [&](PTR pc, vector<int32_t> &lines) {
+        auto it = names.upper_bound(pc);
+        if (pc >= CODE_END || it == names.begin()) return string("(outside)");
+        --it;
+        const SourcePos *pos = source_pos(pc);
+        if (!pos || pos->pc < it->first) return it->second;
+        lines.push_back(pos->line);
+        return it->second + ":" + to_string(pos->line);
+    };
+
+    auto &w = samples->words;
+    for (size_t i=0;i<samples->used;) {
+        int frames = w[i];
+        PTR pc = w[i+1];
+        const WORD *returns = &w[i+2];
+        i += 2 + frames;
+
+        string stack;
+        vector<int32_t> lines;
+        for (int k=1;k<frames;k++) {
+            if (returns[k] == ENDPC) continue;
+            stack += frame(returns[k]-1, lines) + ";";
+        }
+        size_t callers = lines.size();
+        stack += frame(pc, lines);
+        p.stacks[stack]++;
+        if (lines.size() > callers) p.self[lines.back()]++;
+        sort(lines.begin(), lines.end());
+        lines.erase(unique(lines.begin(), lines.end()), lines.end());
+        for (auto l : lines) p.total[l]++;
+        p.samples++;
+    }
+    p.dropped = samples->dropped;
+    return p;
+}
+
 // ALLOC
 
 PTR VirtualMachine::alloc(int size) {
+    if (epochStart != NULLPTR && epochTop + size <= epochEnd) {
+        epochTop += size;
+        return epochTop - size;
+    }
+    auto start = stats ? chrono::steady_clock::now() : chrono::steady_clock::time_point();
     PTR a = alloc(&heaproot, size);
+    if (stats) count_alloc(a, size, start);
+    if (trace) {
+        // the size of the buddy block, as freeing it reports
+        if (a == NULLPTR) trace->record(TraceKind::HeapFull, tracePid, traceTid, 0, size);
+        else trace->record(TraceKind::Alloc, tracePid, traceTid, a, block_words(size));
+    }
     if (a == NULLPTR) throw runtime_error("Memory full, can't allocate");
+    if (epochStart != NULLPTR) epochOverflow.insert(a);
     return a;
 }
 
+int VirtualMachine::block_words(int size) {
+    int words = SMALLEST_ALLOC;
+    while (words < size) words <<= 1;
+    return words;
+}
+
 PTR VirtualMachine::alloc(HeapTree *tree, int size) {
-    if (tree->allocated) return NULLPTR;
+    if (tree->allocated || size > tree->size) return NULLPTR;
     if (!tree->left) {
-        if (size > tree->size/2 || size < SMALLEST_ALLOC) {
+        if (size > tree->size/2 || tree->size/2 < SMALLEST_ALLOC) {
             tree->allocated = true;
             return tree->start;
         } else {
@@ -409,50 +1999,101 @@ PTR VirtualMachine::alloc(HeapTree *tree, int size) {
 // FREE
 
 void VirtualMachine::vmfree(PTR ptr) {
+    if (ptr >= epochStart && ptr < epochEnd) return;
+    if (epochStart != NULLPTR) epochOverflow.erase(ptr);
+    auto start = stats ? chrono::steady_clock::now() : chrono::steady_clock::time_point();
     auto tree = find(&heaproot, ptr);
-    if (tree->start == tree->parent->start) tree->parent->left = nullptr;
-    else tree->parent->right = nullptr;
+    if (trace) trace->record(TraceKind::Free, tracePid, traceTid, ptr, tree->size);
+    int words = tree->size;
+    tree->allocated = false;
     merge(tree->parent);
+    if (stats) {
+        int order = 0;
+        while ((1 << order) < words) order++;
+        stats->frees[order]++;
+        stats->liveWords -= words;
+        stats->freeTime += chrono::steady_clock::now() - start;
+    }
 }
 
+// drops the children of tree once both halves are free again
 void VirtualMachine::merge(HeapTree *tree) {
     if (!tree) return;
-    if (!tree->left && !tree->right) {
-        auto l = tree->parent;
-        if (tree->start == tree->parent->start)
-            l->left = nullptr;
-        else 
-            l->right = nullptr;
-        return merge(l);
+    auto isFree = [](HeapTree *t) { return !t->allocated && !t->left; };
+    if (isFree(tree->left.get()) && isFree(tree->right.get())) {
+        tree->left = nullptr;
+        tree->right = nullptr;
+        merge(tree->parent);
     }
 }
 
 VirtualMachine::HeapTree* VirtualMachine::find(HeapTree *tree, PTR ptr) {
     if (tree->allocated) return tree;
+    if (!tree->left) throw runtime_error("Can't free unallocated memory");
     if (ptr < tree->start + tree->size/2) 
         return find(tree->left.get(), ptr);
     else
         return find(tree->right.get(), ptr);
 }
 
+void VirtualMachine::heap_copy(HeapTree *to, const HeapTree *from) {
+    to->allocated = from->allocated;
+    to->left = nullptr;
+    to->right = nullptr;
+    if (from->left) {
+        to->left  = shared_ptr<HeapTree>(new HeapTree{from->left->start , from->left->size , false, nullptr, nullptr, to});
+        to->right = shared_ptr<HeapTree>(new HeapTree{from->right->start, from->right->size, false, nullptr, nullptr, to});
+        heap_copy(to->left.get(), from->left.get());
+        heap_copy(to->right.get(), from->right.get());
+    }
+}
+
 // memory management
 // deep free on values
 // free previous value on assign (store_mem, store_var)
 // free all values on stack when popping the stack
 
 void VirtualMachine::deepFree(DWORD value) {
+    if (!stats || isPrim(get<0>(extract(value)))) {
+        deepFreeValue(value);
+        return;
+    }
+    auto start = chrono::steady_clock::now();
+    deepFreeValue(value);
+    stats->deepFreeTime += chrono::steady_clock::now() - start;
+}
+
+void VirtualMachine::deepFreeValue(DWORD value) {
     Type t; int32_t d;
     tie(t,d) = extract(value);
     PTR p = asPtr(d);
     if (isPrim(t)) return;
     if (t == Pointer) {
         if (d > HEAP_START) {
-            deepFree(getDword(p));
+            deepFreeValue(getDword(p));
         }
-    } else if (t == List || t == Tuple) {
+    } else if (t == List) {
+        while (memory[p+1] == LIST_MOVED) {
+            PTR next = memory[p];
+            if (p >= HEAP_START) vmfree(p);
+            p = next;
+        }
+        if (memory[p+1] == Nil) {
+            for (int i=0;i<memory[p];i++)
+                deepFreeValue(getDword(p+2+i*2));
+        }
+    } else if (t == Tuple) {
         for (int i=0;i<memory[p];i++) {
-            deepFree(getDword(p+i*2));
+            deepFreeValue(getDword(p+1+i*2));
+        }
+    } else if (t == Map) {
+        map_migrate(p, memory[p+MAP_OLD_CAPACITY]);
+        PTR table = memory[p+MAP_TABLE];
+        for (int i=0;i<memory[p+MAP_CAPACITY];i++) {
+            if (get<0>(extract(getDword(table+i*4))) != Nil)
+                deepFreeValue(getDword(table+i*4+2));
         }
+        vmfree(table);
     }
     // TODO implem for other types
     if (p >= HEAP_START) vmfree(p);
@@ -7,6 +7,16 @@
 #include <cstring>
 #include <functional>
 #include <memory>
+#include <unordered_map>
+#include <unordered_set>
+#include <thread>
+#include <chrono>
+#include <tuple>
+#include <utility>
+
+#include "Trace.h"
+#include "Perf.h"
+#include "Profiler.h"
 
 #define WORD uint32_t
 #define DWORD uint64_t
@@ -16,9 +26,18 @@
 
 using vmcode = std::vector<WORD>;
 
+// the code from pc up to the next entry comes from this source position
+struct SourcePos {
+    PTR pc;
+    int32_t line, col;
+};
+
 struct vmunit {
     vmcode code;
     std::map<std::string, std::pair<PTR, int>> funcs;
+    std::vector<PTR> strings;
+    // by pc, from the .line directives of the assembly
+    std::vector<SourcePos> lines;
 };
 
 enum Type : int8_t {
@@ -26,12 +45,12 @@ enum Type : int8_t {
     Nil = 0,
     Int,      
     Float,     
-    String,    // ptr to str const in code or str in heap
+    String,    // ptr to {length, packed bytes...}, interned : equal strings share one address
     Pointer,   // ptr to anywhere
-    Closure,   // ptr to {code ptr, num_args, num_captured, value...}
-    List,      // ptr to {num_elements, type, value...}
-    Tuple,     // ptr to {num_elements, value...}
-    Map        // ptr to {num_pairs, (value, value)...}
+    Closure,   // code ptr of a function, no captures
+    List,      // ptr to {num_elements, type, value...}, values are raw words when type is Int or Float
+    Tuple,     // ptr to {num_elements, value...}, or inline {num_elements} above its elements on the op stack
+    Map        // ptr to {capacity, num_pairs, table, old_capacity, old_table, migrated}, table is {(value, value)...}
 };
 
 enum Instruction : int8_t {
@@ -73,11 +92,13 @@ enum Instruction : int8_t {
     ListAccessPtr, //        - (list, int)  -> ptr
     ListAccess,    //        - (list, int)  -> value
     ListLength,    //        - (list)       -> int
+    ListCreateLocal, // size - (value...)   -> list, released when the frame returns
 
     TupleCreate,    // size   - (value...)     -> tuple
     TupleConcat,    //        - (tuple, tuple) -> tuple
     TupleAccessPtr, // int    - (tuple) -> ptr
     TupleAccess,    // int    - (tuple) -> value
+    TupleUnpack,    // size   - (tuple) -> (value...)
 
     ClosureCreate,  // ptr       - (value...) -> closure
     ClosureCall,    // numargs   - (closure, value...) -> value|closure
@@ -86,43 +107,247 @@ enum Instruction : int8_t {
     MapAdd,         //       - (map, value, value) -> map
     MapAccessPtr,   //       - (map, value) -> ptr
     MapAccess,      //       - (map, value) -> value
+    MapRemove,      //       - (value, map) -> int
+    MapHas,         //       - (value, map) -> int
+
+    // type specialized, the compiler proved the operand types so they skip all checks
+    AddInt,         //       - (int, int) -> int
+    SubInt,         //       - (int, int) -> int
+    MulInt,         //       - (int, int) -> int, computed in float like mul
+    DivInt,         //       - (int, int) -> int, computed in float like div
+    ModInt,         //       - (int, int) -> int
+    LtInt,          //       - (int, int) -> int
+    LteqInt,        //       - (int, int) -> int
+    GtInt,          //       - (int, int) -> int
+    GteqInt,        //       - (int, int) -> int
+    EqInt,          //       - (int, int) -> int
+    NeqInt,         //       - (int, int) -> int
+    AddFloat,       //       - (float, float) -> float
+    SubFloat,       //       - (float, float) -> float
+    MulFloat,       //       - (float, float) -> float
+    DivFloat,       //       - (float, float) -> float
+    IfJumpInt,      // ptr   - (int) ->
+    IfNJumpInt,     // ptr   - (int) ->
+    ListAccessInt,  //       - (list of ints, int) -> int
+    // the compiler proved the index is in range
+    ListAccessU,    //       - (list, int) -> value
+    ListAccessPtrU, //       - (list, int) -> ptr
+
+    // call of a pure function, through its result cache
+    CallMemo,       // ptr   - () ->
 
 };
 
+// builtins, registered first so their native indices are fixed
 enum ReservedFuncs : uint32_t {
     Printf, 
+    Format,
+    Pmap,
+    Preduce,
+    Yield,
+};
+
+class VirtualMachine;
+
+// a native function, called with its arguments on the op stack
+struct Native {
+    std::string name;
+    int numArgs;    // -1 : variadic
+    void (*thunk)(VirtualMachine &vm, void (*fn)());
+    void (*fn)();   // the registered function, only used by its thunk
+    int numResults; // values it pushes, 0 or 1
+};
+
+enum class RunStatus {
+    Finished,
+    Yielded,   // out of budget or called yield(), run again to resume
+    Error,     // see VirtualMachine::error, the VM can't be resumed
+};
+
+// a value passed between the host and a VM, strings are copied
+struct HostValue {
+    Type type = Nil;
+    int32_t i = 0;
+    float f = 0;
+    std::string s;
+
+    HostValue() {}
+    HostValue(int32_t i) : type(Int), i(i) {}
+    HostValue(float f) : type(Float), f(f) {}
+    HostValue(double f) : type(Float), f(f) {}
+    HostValue(std::string s) : type(String), s(s) {}
+    HostValue(const char *s) : type(String), s(s) {}
+};
+
+// Counters of the heap tree's buddy allocator. The epoch arena counts as
+// one allocation, what is bump allocated inside it doesn't.
+struct HeapStats {
+    const static int ORDERS = 17;   // blocks of 1 << order words, up to HEAP_SIZE
+
+    uint64_t liveWords = 0;         // in allocated blocks
+    uint64_t peakWords = 0;
+    uint64_t allocs[ORDERS] = {};
+    uint64_t frees[ORDERS] = {};
+    uint64_t failed = 0;            // allocations that found no free block
+    uint64_t requestedWords = 0;    // asked for, over all allocations
+    uint64_t blockWords = 0;        // handed out, over all allocations
+    // time spent in alloc, vmfree and deepFree, deepFree includes its frees
+    std::chrono::nanoseconds allocTime{0};
+    std::chrono::nanoseconds freeTime{0};
+    std::chrono::nanoseconds deepFreeTime{0};
+
+    // free leaves of the tree when the stats were taken
+    uint64_t freeWords = 0;
+    uint64_t freeBlocks = 0;
+    uint64_t largestFree = 0;
+
+    // share of the words handed out that weren't asked for
+    double internalFragmentation() const { return blockWords ? 1 - (double)requestedWords/blockWords : 0; }
+    // share of the free words that can't be had in a single allocation
+    double externalFragmentation() const { return freeWords ? 1 - (double)largestFree/freeWords : 0; }
+    void print(std::ostream &o) const;
+};
+
+// Calls of a memoized function. Skipped calls had an argument the cache
+// can't key, a list, tuple, map or closure.
+struct MemoCounts {
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t skipped = 0;
+};
+
+struct FunctionHandle {
+    PTR addr;
+    int numArgs;
 };
 
 class VirtualMachine {
 public:
     VirtualMachine(std::ostream &o) : out(o) {}
-    void load(vmunit program) {
-        memcpy(memory, program.code.data(), program.code.size()*sizeof(WORD));
-        for (auto f : program.funcs) {
-            funcNames[f.first] = f.second.first;
-            funcNumArgs[f.second.first] = f.second.second;
-        }
-    }
+    ~VirtualMachine() { release_memory(); }
+    void load(vmunit program);
     
     void step();
+    // the entry function takes its arguments from the op stack, so it
+    // receives the result of the previous run
     void run(std::string funcname);
+
+    // sets up a call of funcname to be executed by run_for or run_until
+    void start(std::string funcname);
+    // executes at most n instructions
+    RunStatus run_for(uint64_t n);
+    // executes until the deadline passes, checked every DEADLINE_CHECK_INTERVAL instructions
+    RunStatus run_until(std::chrono::steady_clock::time_point deadline);
+    std::string error;
+    // callbacks of pmap and preduce run within one instruction, past this
+    // point they fail with "Time limit exceeded"
+    std::chrono::steady_clock::time_point timeLimit = std::chrono::steady_clock::time_point::max();
+
+    // EMBEDDING
+    // resolves a function once, so calls skip the name lookup
+    FunctionHandle function(const std::string &name);
+    // arguments of the next call, first argument first
+    void push(const HostValue &v);
+    // runs f to completion on the pushed arguments and returns its result
+    HostValue call(FunctionHandle f);
+    // one call per row of arguments, resetting the epoch after each call if one is open
+    std::vector<HostValue> call_batch(FunctionHandle f, const std::vector<std::vector<HostValue>> &rows);
+
+    // Allocations made after begin_epoch come from a single arena, and
+    // reset_epoch releases all of them at once. Values allocated before
+    // stay valid, but must not be made to point into the arena.
+    void begin_epoch();
+    void reset_epoch();
+    void end_epoch();
+    uint32_t epoch = 0;
+
+    // dumps memory, allocator state and functions of a VM between runs
+    void snapshot(const std::string &path);
+    // maps a snapshot copy-on-write in place of this VM's memory
+    void restore(const std::string &path);
+
+    // opcodes and natives in the order bytecode numbers them, compiled
+    // code only runs on a VM with the same instruction set
+    static std::string instruction_set();
+
+    // threads used by pmap and preduce
+    int workers = std::thread::hardware_concurrency();
+
+    // keeps the top of the op stack in a register between instructions,
+    // clear to run every instruction through step
+    bool cacheTop = true;
+
+    // VERIFIER
+    // load verifies the program's bytecode, and a verified program runs
+    // without operand stack, local slot, call target and pointer checks.
+    // Clear before load to keep the checks.
+    bool verify = true;
+    // why load couldn't verify the program, empty if it runs check-free
+    std::string verifyError;
+
+    // ALLOCATOR STATISTICS
+    // counts and times heap allocations and frees from now on
+    void collect_heap_stats();
+    // the counters, zero if they aren't collected, and the tree's free space
+    HeapStats heap_stats();
+
+    // HARDWARE COUNTERS
+    // counts time, cycles, instructions, branch and cache misses of each
+    // instruction from now on, by function and by opcode, through Linux
+    // perf_event_open. Instructions then run one at a time. Throws if the
+    // counters can't be opened. Worker VMs aren't counted.
+    void collect_perf_counters();
+    PerfProfile perf_profile();
+
+    // MEMOIZATION
+    // counts of the result cache of each memoized function, by name
+    std::map<std::string, MemoCounts> memo_stats();
+
+    // SAMPLING PROFILER
+    // samples the call stack hz times per second of process cpu time from
+    // now on, through setitimer and SIGPROF, the kernel tick bounds the
+    // rate. Instructions then run one at a time. Only the VM running on the
+    // interrupted thread is sampled, worker VMs aren't.
+    void collect_samples(int hz);
+    // stops the timer, so call it once every sampled VM is done. Frames
+    // are named function:line from the unit's source lines.
+    SampleProfile sample_profile();
+
+    // TRACING
+    // records calls, returns and heap operations into t as process pid,
+    // nullptr stops tracing. Call after load, worker VMs trace into the
+    // same buffer.
+    void trace_to(TraceBuffer *t, uint16_t pid = 0);
     
     const static int CODE_SIZE          = 1 << 14;
     const static int LOCAL_VARS_SIZE    = 1 << 5;
     const static int MAX_STACK_SIZE     = 1 << 6;
     const static int MAX_OP_STACK_SIZE  = 1 << 8;
+    const static int FRAME_HEAP_SIZE    = 1 << 12;
     const static int HEAP_SIZE          = 1 << 16;
+    const static int MAX_INLINE_TUPLE   = 4;
+    const static int MAP_MIN_CAPACITY   = 8;
+    const static int MAP_MIGRATE_STEP   = 8;
+    const static int PARALLEL_MIN_CHUNK = 16;
+    const static int DEADLINE_CHECK_INTERVAL = 1 << 10;
+    const static int INPUT_RELEASE_BYTES = 1 << 24;
+    const static int SAMPLE_BUFFER_WORDS = 1 << 22;
+    const static int MEMO_MAX_ARGS      = 4;
+    const static int MEMO_CACHE_SIZE    = 1 << 12;
 
     const static PTR CODE_START         = 0;
     const static PTR STACK_START        = CODE_START + CODE_SIZE;
     const static PTR ADDR_STACK_START   = STACK_START + LOCAL_VARS_SIZE*MAX_STACK_SIZE*2;
     const static PTR OP_STACK_START     = ADDR_STACK_START + MAX_STACK_SIZE;
-    const static PTR HEAP_START         = OP_STACK_START + MAX_OP_STACK_SIZE*2;
+    const static PTR FRAME_HEAP_START   = OP_STACK_START + MAX_OP_STACK_SIZE*2;
+    const static PTR HEAP_START         = FRAME_HEAP_START + FRAME_HEAP_SIZE;
 
     const static PTR CODE_END           = STACK_START;
     const static PTR STACK_END          = ADDR_STACK_START;
     const static PTR ADDR_STACK_END     = OP_STACK_START;
-    const static PTR OP_STACK_END       = HEAP_START;
+    const static PTR OP_STACK_END       = FRAME_HEAP_START;
+    const static PTR FRAME_HEAP_END     = HEAP_START;
+    const static PTR TUPLE_SCRATCH      = FRAME_HEAP_END - 2;  // element written through an inline tuple
     const static PTR HEAP_END           = HEAP_START+HEAP_SIZE;
     const static PTR TOTAL_SIZE         = HEAP_END;
 
@@ -130,18 +355,45 @@ private:
     PTR PC = CODE_START;
     PTR allocStart = HEAP_START;
     WORD* memory = new WORD[TOTAL_SIZE];
-    std::map<ReservedFuncs, void (VirtualMachine::*)()> stdlib = {
-        { Printf, &VirtualMachine::printf},
-    };
+    bool mappedMemory = false;
+    void release_memory();
     int stackFrame = 0;
     int opStackFrame = 0;
+    // bump allocator for lists that never outlive their frame
+    PTR frameHeapTop = FRAME_HEAP_START;
+    PTR frameHeapMarks[MAX_STACK_SIZE];
 
     bool isPrim(Type t) { return t==Nil || t==Int || t==Float || t==String;}
-    void newStack(PTR addr=ENDPC);
+
+    // INTERPRETER
+    // step is compiled once per policy, CheckFree leaves out the checks the
+    // verifier proved unneeded
+    struct Checked { const static bool checks = true; };
+    struct CheckFree { const static bool checks = false; };
+    template<typename P> void exec();
+    template<typename P> void exec_until_done();
+    // runs at most n instructions, keeping the top of the op stack in a
+    // local : loads, stores, jumps and typed arithmetic run here, any other
+    // opcode writes it back and runs through exec. Returns the instructions run.
+    template<typename P> uint64_t exec_cached(uint64_t n);
+    bool verified = false;
+    // cleared by newStack when a call could overflow the op stack, the run
+    // goes on with checks
+    bool checkFree = false;
+    // op stack words each function of a verified program uses at most
+    std::map<PTR, int> funcOpStackWords;
+
+    // addr : return address, callee : address of the function called
+    void newStack(PTR addr, PTR callee);
     PTR popStack();
-    void pushOpStack(DWORD v);
-    DWORD popOpStack();
-    PTR getStackPtr(int index);
+    template<typename P = Checked> void pushOpStack(DWORD v);
+    template<typename P = Checked> DWORD popOpStack();
+    template<typename P = Checked> DWORD peekOpStack(int depth=0);
+    // pops a value, boxing it if it is an inline tuple
+    template<typename P = Checked> DWORD popValue();
+    // pops a value, including the elements of an inline tuple
+    void dropValue();
+    template<typename P = Checked> PTR getStackPtr(int index);
 
     void setDword(PTR addr, DWORD v);
     DWORD getDword(PTR addr);
@@ -151,6 +403,9 @@ private:
 
     void binOp(binopint fi, binopfloat ff);
     void binOpRel(binopint fi, binopfloat ff);
+    // the result replaces both operands in place
+    template<typename F> void intOp(F f);
+    template<typename F> void floatOp(F f);
 
     void printOpStack();
     void printStack();
@@ -158,14 +413,165 @@ private:
     std::ostream &out;
 
     void printf();
+    void format();
+    void format_to(std::ostream &o);
+    void pmap();
+    void preduce();
+    void yield();
+
+    // NATIVES
+    friend class NativeRegistry;
+    // builtins pop their own arguments
+    template<void (VirtualMachine::*M)()>
+    static void builtin_thunk(VirtualMachine &vm, void (*)()) { (vm.*M)(); }
+
+    // typed natives : arguments are popped and unboxed in order, the result
+    // is boxed and pushed, void functions push nothing
+    template<typename R, typename... A>
+    static void native_thunk(VirtualMachine &vm, void (*fn)()) {
+        vm.native_call((R (*)(A...))fn, std::index_sequence_for<A...>());
+    }
+
+    template<typename R, typename... A, size_t... I>
+    void native_call(R (*fn)(A...), std::index_sequence<I...>) {
+        std::tuple<typename std::decay<A>::type...> args;
+        // braced lists are evaluated in order, and the first argument is on top
+        (void)std::initializer_list<int>{(native_unbox(popValue(), std::get<I>(args)), 0)...};
+        native_return(fn, args, std::is_void<R>(), std::index_sequence<I...>());
+    }
+
+    template<typename R, typename... A, typename Args, size_t... I>
+    void native_return(R (*fn)(A...), Args &args, std::false_type, std::index_sequence<I...>) {
+        native_box(fn(std::get<I>(args)...));
+    }
+
+    template<typename R, typename... A, typename Args, size_t... I>
+    void native_return(R (*fn)(A...), Args &args, std::true_type, std::index_sequence<I...>) {
+        fn(std::get<I>(args)...);
+    }
+
+    void native_unbox(DWORD v, int32_t &out);
+    void native_unbox(DWORD v, float &out);
+    void native_unbox(DWORD v, std::string &out);
+    void native_unbox(DWORD v, std::vector<int32_t> &out);
+    void native_unbox(DWORD v, std::vector<float> &out);
+    void native_unbox(DWORD v, HostValue &out);
+    void native_box(int32_t v);
+    void native_box(float v);
+    void native_box(const std::string &v);
+    void native_box(const std::vector<int32_t> &v);
+    void native_box(const std::vector<float> &v);
+    void native_box(const HostValue &v);
+
+    // INPUT
+    // Files are mapped read-only outside of the VM memory and scripts refer
+    // to them by an int handle. Lines are found in place, and only the bytes,
+    // text or numbers asked for are copied into the heap.
+    struct InputMap {
+        const char *data = nullptr;
+        size_t size = 0;
+        ~InputMap();
+    };
+    struct Input {
+        std::shared_ptr<InputMap> map;  // null once closed, shared with worker VMs
+        size_t pos = 0;                 // where the next line or number is read
+        size_t lineBegin = 0;           // current line, without its line break
+        size_t lineEnd = 0;
+        size_t released = 0;            // pages before it were given back
+    };
+    std::vector<Input> inputs;
+    Input &input_handle(DWORD h);
+    // gives back the pages before pos once INPUT_RELEASE_BYTES of them were read
+    void input_release(Input &in, size_t pos);
+    void line_number(bool floats);
+    void line_numbers(bool floats);
+    void input_numbers(bool floats);
+    std::vector<WORD> numberBuffer;
+
+    void input_open();
+    void input_close();
+    void input_line();
+    void line_bytes();
+    void line_text();
+    void line_int() { line_number(false); }
+    void line_float() { line_number(true); }
+    void line_ints() { line_numbers(false); }
+    void line_floats() { line_numbers(true); }
+    void input_ints() { input_numbers(false); }
+    void input_floats() { input_numbers(true); }
+
+    // set by yield(), ends the current run_for or run_until
+    bool yielded = false;
+    bool finished() { return PC == ENDPC || PC >= CODE_END; }
+    RunStatus execute(uint64_t n);
+
+    // CLOSURES
+    void closure_create(PTR addr);
+    void closure_call(int numArgs);
+    PTR closure_code(DWORD closure, int numArgs);
+    // calls a closure from native code and returns its result
+    DWORD invoke(DWORD closure, const std::vector<DWORD> &args);
+    // runs the function at addr on the numArgs values on top of the op stack
+    DWORD call_code(PTR addr, int numArgs);
+    std::vector<DWORD> hostArgs;
+    HostValue to_host(DWORD v);
+    DWORD from_host(const HostValue &v);
+
+    // PARALLEL
+    // a worker VM starts from a copy of its parent's memory and heap
+    VirtualMachine(const VirtualMachine &parent, std::ostream &o);
+    using chunkfn = std::function<void(VirtualMachine &vm, int chunk, int begin, int end)>;
+    // splits [0, n) in chunks run on worker VMs, returns the number of chunks
+    int parallel_chunks(int n, const chunkfn &body);
+
+    // STRINGS
+    std::unordered_map<std::string, PTR> internedStrings;
+    void intern_constant(PTR addr);
+    PTR string_intern(const std::string &s);
+    std::string string_value(PTR addr);
+    std::string to_text(DWORD v);
     void list_create(int size);
+    void list_create_local(int size);
     void list_access_ptr();
     void list_access();
+    void list_access_ptr_u();
+    void list_access_u();
     void list_length();
 
     void list_concat(PTR d, PTR d2);
     void list_add(PTR d, DWORD v);
 
+    PTR list_resolve(PTR p);
+    PTR list_alloc(int size, Type type, bool local=false);
+    DWORD list_get(PTR p, int index);
+    PTR list_promote(PTR p);
+    PTR list_from(const std::vector<DWORD> &elements, bool local=false);
+    DWORD load_ptr(DWORD ptr);
+    void store_ptr(DWORD ptr, DWORD v);
+
+    void tuple_create(int size);
+    void tuple_concat();
+    void tuple_access_ptr(int index);
+    void tuple_access(int index);
+    void tuple_unpack(int size);
+    void tuple_elements(DWORD v, std::vector<DWORD> &elements);
+
+    void map_create(int size);
+    void map_add();
+    void map_access_ptr();
+    void map_access();
+    void map_remove();
+    void map_has();
+
+    WORD map_hash(DWORD key);
+    bool map_key_equal(DWORD a, DWORD b);
+    PTR map_alloc_table(int capacity);
+    PTR map_find(PTR table, int capacity, DWORD key);
+    PTR map_slot(PTR map, DWORD key, bool insert);
+    PTR map_insert_new(PTR table, int capacity, DWORD key, DWORD value);
+    void map_migrate(PTR map, int steps);
+    bool map_remove_key(PTR map, DWORD key);
+
     const int SMALLEST_ALLOC = 2;
 
     const int NULLPTR = 0xffffff;
@@ -181,6 +587,18 @@ private:
 
     HeapTree heaproot;
 
+    // bump arena of the current epoch, epochStart is NULLPTR outside of one
+    PTR epochStart = 0xffffff;
+    PTR epochTop = 0xffffff;
+    PTR epochEnd = 0xffffff;
+    std::vector<std::string> epochStrings;
+    // heap blocks handed out once the arena was full, freed on reset
+    std::unordered_set<PTR> epochOverflow;
+
+    void heap_save(std::ostream &o, HeapTree *tree);
+    void heap_restore(std::istream &i, HeapTree *tree);
+    void heap_copy(HeapTree *to, const HeapTree *from);
+
     // ALLOC
     PTR alloc(int size);
     PTR alloc(HeapTree *tree, int size);
@@ -190,15 +608,98 @@ private:
     void merge(HeapTree *tree);
     HeapTree* find(HeapTree *tree, PTR ptr);
 
+    std::unique_ptr<HeapStats> stats;
+    // words of the block handed out for size words
+    int block_words(int size);
+    void count_alloc(PTR a, int size, std::chrono::steady_clock::time_point start);
+    void heap_walk(HeapTree *tree, HeapStats &s, uint64_t &allocated);
+
     // memory management
     // deep free on values
     // free previous value on assign (store_mem, store_var)
     // free all values on stack when popping the stack
 
     void deepFree(DWORD value);
+    void deepFreeValue(DWORD value);
 
     // functions
 
     std::map<std::string, PTR> funcNames;
     std::map<PTR, int> funcNumArgs;
-};
\ No newline at end of file
+    std::vector<SourcePos> sourceLines;
+
+    // HARDWARE COUNTERS
+    bool perf = false;
+    // functions being run, innermost last
+    std::vector<PTR> perfCalls;
+    std::map<PTR, PerfCounts> perfFunctions;
+    std::vector<PerfCounts> perfOpcodes;
+    // counts of the function being run
+    PTR perfFunc = ENDPC;
+    PerfCounts *perfCurrent = nullptr;
+    void perf_step();
+
+    // MEMOIZATION
+    // Results by arguments, direct mapped : a result replaces whatever
+    // hashed to the same entry. Only single values that aren't on the heap,
+    // or are interned strings, are stored.
+    struct MemoEntry {
+        bool used = false;
+        DWORD args[MEMO_MAX_ARGS];
+        DWORD result;
+    };
+    struct MemoCache {
+        std::vector<MemoEntry> entries;
+        MemoCounts counts;
+    };
+    std::map<PTR, MemoCache> memo;
+    // a call that missed, its result is stored when its frame returns
+    struct MemoCall {
+        int frame;
+        int opStackBase;
+        MemoEntry *entry;
+        DWORD args[MEMO_MAX_ARGS];
+    };
+    std::vector<MemoCall> memoCalls;
+    template<typename P> void call_memo(PTR addr);
+    void memo_store();
+
+    // SAMPLING PROFILER
+    std::unique_ptr<StackSamples> samples;
+    static void on_sample(int);
+    // the source position of pc, nullptr if the unit has none
+    const SourcePos *source_pos(PTR pc);
+
+    // TRACING
+    // tested once per call, return, allocation and free
+    TraceBuffer *trace = nullptr;
+    uint16_t tracePid = 0;
+    uint16_t traceTid = 0;
+};
+
+// Natives are numbered in registration order and call_ext refers to them by
+// index, so the assembler and every VM share one registry. Register before
+// assembling : a unit only runs with the natives it was assembled against.
+class NativeRegistry {
+public:
+    NativeRegistry();
+
+    // int32_t, float, std::string, lists as std::vector<int32_t> or
+    // std::vector<float>, and HostValue, as arguments or result
+    template<typename R, typename... A>
+    uint32_t add(const std::string &name, R (*fn)(A...)) {
+        return add({name, sizeof...(A), &VirtualMachine::native_thunk<R, A...>, (void (*)())fn, !std::is_void<R>::value});
+    }
+    uint32_t add(const Native &n);
+
+    // -1 when there is no such native
+    int find(const std::string &name) const;
+    const Native &operator[](uint32_t i) const { return list[i]; }
+    size_t size() const { return list.size(); }
+
+private:
+    std::vector<Native> list;
+    std::unordered_map<std::string, uint32_t> index;
+};
+
+extern NativeRegistry natives;
@@ -1,4 +1,5 @@
 #include <iostream>
+#include <cstdlib>
 
 #include <antlr4-runtime/antlr4-runtime.h>
 #include "parser/NorbertParser.h"
@@ -7,30 +8,329 @@
 #include "Assembler.h"
 #include "ASTGen.h"
 #include "Codegen.h"
+#include "Cache.h"
+#include "Parser.h"
+#include "ASTPrint.h"
+#include "Scheduler.h"
 
 using namespace std;
 using namespace antlr4;
 
-int main(int argc, char **argv) {
+// any rebuild of the compiler, or change of the VM's opcodes or natives,
+// invalidates cached units
+const string COMPILER_VERSION = string("norbert 0.1 ") + __DATE__ + " " + __TIME__;
+const uint64_t CACHE_MAX_BYTES = 64 << 20;
+
+File parse(const string &source, bool antlr) {
+    if (!antlr) return Parser(source).parse();
 
-    string filename = (argc==2)?argv[1]:"test.nor";
-    ifstream stream(filename);
-    ANTLRInputStream input(stream);
+    ANTLRInputStream input(source);
     NorbertLexer lexer(&input);
     CommonTokenStream tokens(&lexer);
-    NorbertParser parser(&tokens);    
+    NorbertParser parser(&tokens);
     NorbertParser::FileContext* tree = parser.file();
+    if (parser.getNumberOfSyntaxErrors() > 0)
+        throw runtime_error("syntax errors in input");
 
     ASTGen gen;
-    auto ast = gen.gen(tree);
+    return gen.gen(tree);
+}
+
+int main(int argc, char **argv) {
+
+    vector<string> filenames;
+    string cacheDir = getenv("NORBERT_CACHE_DIR") ? getenv("NORBERT_CACHE_DIR") : ".norbert-cache";
+    bool useCache = true;
+    bool cacheStats = false;
+    int threads = thread::hardware_concurrency();
+    bool antlr = false;
+    bool dumpAst = false;
+    bool dumpIr = false;
+    bool dumpAsm = false;
+    int optLevel = 1;
+    string init = "";
+    string snapshotPath = "";
+    string restorePath = "";
+    int timeLimit = 0;
+    string tracePath = "";
+    bool heapStats = false;
+    bool verify = true;
+    bool perf = false;
+    string profilePath = "";
+    int profileHz = 1000;
+    set<string> memoize;
+    bool autoMemoize = true;
+    bool memoStats = false;
+    for (int i=1;i<argc;i++) {
+        string arg = argv[i];
+        if (arg == "--no-cache") useCache = false;
+        else if (arg == "--cache-dir" && i+1 < argc) cacheDir = argv[++i];
+        else if (arg == "--cache-stats") cacheStats = true;
+        else if (arg == "-j" && i+1 < argc) threads = atoi(argv[++i]);
+        else if (arg == "--antlr") antlr = true;
+        else if (arg == "--dump-ast") dumpAst = true;
+        else if (arg == "--dump-ir") dumpIr = true;
+        else if (arg == "--dump-asm") dumpAsm = true;
+        else if (arg == "-O0" || arg == "-O1" || arg == "-O2") optLevel = arg[2] - '0';
+        else if (arg == "--init" && i+1 < argc) init = argv[++i];
+        else if (arg == "--snapshot" && i+1 < argc) snapshotPath = argv[++i];
+        else if (arg == "--restore" && i+1 < argc) restorePath = argv[++i];
+        else if (arg == "--time-limit" && i+1 < argc) timeLimit = atoi(argv[++i]);
+        else if (arg == "--trace" && i+1 < argc) tracePath = argv[++i];
+        else if (arg == "--heap-stats") heapStats = true;
+        else if (arg == "--no-verify") verify = false;
+        else if (arg == "--perf") perf = true;
+        else if (arg == "--profile" && i+1 < argc) profilePath = argv[++i];
+        else if (arg == "--profile-hz" && i+1 < argc) profileHz = atoi(argv[++i]);
+        else if (arg == "--memoize" && i+1 < argc) {
+            stringstream names(argv[++i]);
+            string name;
+            while (getline(names, name, ',')) if (!name.empty()) memoize.insert(name);
+        }
+        else if (arg == "--no-memoize") autoMemoize = false;
+        else if (arg == "--memo-stats") memoStats = true;
+        else filenames.push_back(arg);
+    }
+    if (filenames.empty()) filenames.push_back("test.nor");
+
+    // Chrome trace of every VM, written once they are done
+    unique_ptr<TraceBuffer> trace;
+    if (!tracePath.empty()) trace.reset(new TraceBuffer());
+    // hardware counters are optional, the script runs without them
+    auto collectPerf = [&](VirtualMachine &vm) {
+        if (!perf) return;
+        try {
+            vm.collect_perf_counters();
+        } catch (runtime_error &e) {
+            cerr << "perf : " << e.what() << endl;
+        }
+    };
+
+    // sampled stacks go to profilePath collapsed for flamegraph.pl, one root
+    // frame per script when there are several, and each source annotated
+    // with its share of the samples to stderr
+    auto collectSamples = [&](VirtualMachine &vm) {
+        if (profilePath.empty()) return;
+        try {
+            vm.collect_samples(profileHz);
+        } catch (runtime_error &e) {
+            cerr << "profile : " << e.what() << endl;
+        }
+    };
+    ofstream folded;
+    auto writeProfile = [&](VirtualMachine &vm, const string &root, const string &source) {
+        if (profilePath.empty()) return;
+        SampleProfile p = vm.sample_profile();
+        if (!folded.is_open()) folded.open(profilePath);
+        p.write_folded(folded, root);
+        if (!folded) cerr << "Can't write profile " << profilePath << endl;
+        if (!source.empty()) p.print_lines(cerr, source);
+    };
+
+    // calls answered from the result caches of memoized functions
+    auto printMemoStats = [&](VirtualMachine &vm) {
+        if (!memoStats) return;
+        for (auto &f : vm.memo_stats())
+            cerr << "memo " << f.first << " : " << f.second.hits << " hits, " << f.second.misses << " misses, "
+                 << f.second.skipped << " skipped" << endl;
+    };
+
+    // statistics asked for on the command line, once a VM is done, each
+    // line prefixed with the script's name when there are several
+    auto report = [&](VirtualMachine &vm, const string &name, const string &source) {
+        string prefix = name.empty() ? "" : name + " ";
+        if (heapStats) {
+            cerr << prefix;
+            vm.heap_stats().print(cerr);
+        }
+        if (perf) {
+            cerr << prefix;
+            vm.perf_profile().print(cerr);
+        }
+        if (memoStats) {
+            cerr << prefix;
+            printMemoStats(vm);
+        }
+        if (!profilePath.empty()) {
+            cerr << prefix;
+            writeProfile(vm, name, source);
+        }
+    };
+
+    auto writeTrace = [&]() {
+        if (!trace) return;
+        ofstream o(tracePath);
+        trace->write_json(o);
+        if (!o) cerr << "Can't write trace " << tracePath << endl;
+        if (trace->dropped()) cerr << "trace : dropped the " << trace->dropped() << " oldest events" << endl;
+    };
 
-    auto code = CodeGen().gen(ast);
+    // a snapshot holds the code and the heap left by its init function,
+    // main starts with that function's result as argument
+    if (!restorePath.empty()) {
+        VirtualMachine m(cout);
+        try {
+            m.restore(restorePath);
+        } catch (runtime_error &e) {
+            cerr << e.what() << endl;
+            return 1;
+        }
+        m.trace_to(trace.get());
+        if (heapStats) m.collect_heap_stats();
+        collectPerf(m);
+        collectSamples(m);
+        cout << "VM output : " << endl;
+        try {
+            m.run("main");
+        } catch (runtime_error &e) {
+            writeTrace();
+            report(m, "", "");
+            cerr << e.what() << endl;
+            return 1;
+        }
+        writeTrace();
+        report(m, "", "");
+        return 0;
+    }
+
+    CompileCache cache(cacheDir, CACHE_MAX_BYTES);
+    vector<vmunit> units;
+    vector<string> sources;
+    for (auto &filename : filenames) {
+        ifstream stream(filename);
+        stringstream source;
+        source << stream.rdbuf();
+        sources.push_back(source.str());
+
+        if (dumpAst) {
+            try {
+                ASTPrint(cout).print(parse(source.str(), antlr));
+            } catch (runtime_error &e) {
+                cerr << filename << ":" << e.what() << endl;
+                return 1;
+            }
+            continue;
+        }
+
+        // the IR only exists at -O2
+        if (dumpIr) {
+            try {
+                CodeGen cg(threads, 2);
+                cg.gen(parse(source.str(), antlr));
+                cout << cg.ir;
+            } catch (runtime_error &e) {
+                cerr << filename << ":" << e.what() << endl;
+                return 1;
+            }
+            continue;
+        }
+
+        if (dumpAsm) {
+            try {
+                CodeGen cg(threads, optLevel);
+                cg.memoize = memoize;
+                cg.autoMemoize = autoMemoize;
+                cg.gen(parse(source.str(), antlr));
+                cout << cg.assembly;
+            } catch (runtime_error &e) {
+                cerr << filename << ":" << e.what() << endl;
+                return 1;
+            }
+            continue;
+        }
+
+        // flags that change the generated code go in the cache key
+        string flags = string(antlr ? "antlr" : "") + " -O" + to_string(optLevel) + (autoMemoize ? "" : " no-memo");
+        for (auto &name : memoize) flags += " memo:" + name;
+
+        vmunit code;
+        string key = cacheKey(source.str(), COMPILER_VERSION + " " + VirtualMachine::instruction_set(), flags);
+        bool hit = useCache && cache.load(key, code);
+        if (!hit) {
+            try {
+                CodeGen cg(threads, optLevel);
+                cg.memoize = memoize;
+                cg.autoMemoize = autoMemoize;
+                code = cg.gen(parse(source.str(), antlr));
+            } catch (runtime_error &e) {
+                cerr << filename << ":" << e.what() << endl;
+                return 1;
+            }
+            if (useCache) cache.store(key, code);
+        }
+        if (useCache) {
+            cache.count(hit);
+            if (cacheStats)
+                cerr << "cache " << (hit?"hit":"miss") << " (hits : " << cache.hits << ", misses : " << cache.misses << ")" << endl;
+        }
+        units.push_back(code);
+    }
+    if (dumpAst || dumpIr || dumpAsm) return 0;
+
+    // several scripts, or a time limit : run them as jobs sharing the threads
+    if (units.size() > 1 || timeLimit > 0) {
+        Scheduler scheduler(threads);
+        vector<stringstream> outputs(units.size());
+        for (size_t i=0;i<units.size();i++) {
+            unique_ptr<VirtualMachine> vm(new VirtualMachine(outputs[i]));
+            vm->verify = verify;
+            vm->load(units[i]);
+            vm->trace_to(trace.get(), i);
+            if (heapStats) vm->collect_heap_stats();
+            collectPerf(*vm);
+            collectSamples(*vm);
+            // init runs as the first phase of the job, under the same time limit
+            try {
+                vm->start(init.empty() ? "main" : init);
+            } catch (runtime_error &e) {
+                scheduler.add_failed(move(vm), e.what());
+                continue;
+            }
+            scheduler.add(move(vm), chrono::milliseconds(timeLimit), init.empty() ? "" : "main");
+        }
+        scheduler.run();
+        writeTrace();
+
+        int status = 0;
+        for (size_t i=0;i<units.size();i++) {
+            auto &job = scheduler.jobs[i];
+            cout << filenames[i] << " output : " << endl << outputs[i].str();
+            report(*job.vm, filenames[i], sources[i]);
+            if (job.status == RunStatus::Error) {
+                cerr << filenames[i] << ":" << job.error << endl;
+                status = 1;
+            }
+        }
+        return status;
+    }
 
     VirtualMachine m(cout);
-    m.load(code);
+    m.verify = verify;
+    m.load(units[0]);
+    m.trace_to(trace.get());
+    if (heapStats) m.collect_heap_stats();
+    collectPerf(m);
+    collectSamples(m);
+
+    if (!snapshotPath.empty() && init.empty()) init = "init";
 
     cout << "VM output : " << endl;
-    m.run("main");
+    try {
+        if (!init.empty()) m.run(init);
+        if (!snapshotPath.empty()) {
+            m.snapshot(snapshotPath);
+            writeTrace();
+            return 0;
+        }
+        m.run("main");
+    } catch (runtime_error &e) {
+        writeTrace();
+        report(m, "", sources[0]);
+        cerr << e.what() << endl;
+        return 1;
+    }
+    writeTrace();
+    report(m, "", sources[0]);
 
     return 0;
-}
\ No newline at end of file
+}